@@ -23,17 +23,24 @@
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
 
 
 #include "stl.h"
 #include "config.h"
 
 static void usage(int status, char *program_name);
+static int is_stdout(const char *name);
 
 int
 main(int argc, char **argv)
 {
   stl_file stl_in;
+  stl_writer writers[3];
+  stl_facet *facets;
+  FILE     *msg;
+  int      num_writers;
+  int      count;
   int      i;
   int      last_edges_fixed = 0;
   float    tolerance = 0;
@@ -53,10 +60,15 @@ main(int argc, char **argv)
   char     *off_name = NULL;
   char     *dxf_name = NULL;
   char     *vrml_name = NULL;
+  char     *part_stats_name = NULL;
+  char     *cache_name = NULL;
   int      fixall_flag = 1;	       /* Default behavior is to fix all. */
   int      exact_flag = 0;	       /* All checks turned off by default. */
+  int      sort_edges_flag = 0;
+  int      weld_flag = 0;
   int      tolerance_flag = 0;	       /* Is tolerance specified on cmdline */
   int      nearby_flag = 0;
+  int      nearby_distance_flag = 0;
   int      remove_unconnected_flag = 0;
   int      fill_holes_flag = 0;
   int      normal_directions_flag = 0;
@@ -67,7 +79,10 @@ main(int argc, char **argv)
   int      generate_shared_vertices_flag = 0;
   int      write_off_flag = 0;
   int      write_dxf_flag = 0;
+  int      write_cache_flag = 0;
   int      write_vrml_flag = 0;
+  int      part_stats_flag = 0;
+  int      write_part_stats_flag = 0;
   int      translate_flag = 0;
   int      scale_flag = 0;
   int      rotate_x_flag = 0;
@@ -77,6 +92,8 @@ main(int argc, char **argv)
   int      mirror_yz_flag = 0;
   int      mirror_xz_flag = 0;
   int      merge_flag = 0;
+  int      stream_flag = 0;
+  int      stats_only_flag = 0;
   int      help_flag = 0;
   int      version_flag = 0;
   
@@ -86,12 +103,15 @@ main(int argc, char **argv)
   
   enum {rotate_x = 1000, rotate_y, rotate_z, merge, help, version,
       mirror_xy, mirror_yz, mirror_xz, scale, translate, reverse_all,
-      off_file, dxf_file, vrml_file};
+      off_file, dxf_file, vrml_file, threads, sort_edges, weld,
+      nearby_distance, part_stats, part_stats_file, stats_only, cache_file};
   
   struct option long_options[] =
     {
 	{"exact",              no_argument,       NULL, 'e'},
+	{"sort-edges",         no_argument,       NULL, sort_edges},
 	{"nearby",             no_argument,       NULL, 'n'},
+	{"nearby-distance",    no_argument,       NULL, nearby_distance},
 	{"tolerance",          required_argument, NULL, 't'},
 	{"iterations",         required_argument, NULL, 'i'},
 	{"increment",          required_argument, NULL, 'm'},
@@ -106,6 +126,9 @@ main(int argc, char **argv)
 	{"write-off",          required_argument, NULL, off_file},
 	{"write-dxf",          required_argument, NULL, dxf_file},
 	{"write-vrml",         required_argument, NULL, vrml_file},
+	{"write-cache",        required_argument, NULL, cache_file},
+	{"part-stats",         no_argument,       NULL, part_stats},
+	{"write-part-stats",   required_argument, NULL, part_stats_file},
 	{"translate",          required_argument, NULL, translate},
 	{"scale",              required_argument, NULL, scale},
 	{"x-rotate",           required_argument, NULL, rotate_x},
@@ -115,6 +138,9 @@ main(int argc, char **argv)
 	{"yz-mirror",          no_argument,       NULL, mirror_yz},
 	{"xz-mirror",          no_argument,       NULL, mirror_xz},
 	{"merge",              required_argument, NULL, merge},
+	{"weld-vertices",      no_argument,       NULL, weld},
+	{"stats-only",         no_argument,       NULL, stats_only},
+	{"threads",            required_argument, NULL, threads},
 	{"help",               no_argument,       NULL, help},
 	{"version",            no_argument,       NULL, version},
 	{NULL, 0, NULL, 0}
@@ -132,6 +158,9 @@ main(int argc, char **argv)
 	  exact_flag = 1;
 	  fixall_flag = 0;
 	  break;
+	 case sort_edges:
+	  sort_edges_flag = 1;
+	  break;
 	 case 'n':
 	  nearby_flag = 1;
 	  fixall_flag = 0;
@@ -188,6 +217,17 @@ main(int argc, char **argv)
 	  write_vrml_flag = 1;
 	  vrml_name = optarg;
 	  break;
+	 case part_stats:
+	  part_stats_flag = 1;
+	  break;
+	 case part_stats_file:
+	  write_part_stats_flag = 1;
+	  part_stats_name = optarg;
+	  break;
+	 case cache_file:
+	  write_cache_flag = 1;
+	  cache_name = optarg;
+	  break;
 	 case dxf_file:
 	  write_dxf_flag = 1;
 	  dxf_name = optarg;
@@ -225,6 +265,18 @@ main(int argc, char **argv)
 	  merge_flag = 1;
 	  merge_name = optarg;
 	  break;
+	 case nearby_distance:
+	  nearby_distance_flag = 1;
+	  break;
+	 case weld:
+	  weld_flag = 1;
+	  break;
+	 case stats_only:
+	  stats_only_flag = 1;
+	  break;
+	 case threads:
+	  stl_set_threads(atoi(optarg));
+	  break;
 	 case help:
 	  help_flag = 1;
 	  break;
@@ -259,69 +311,187 @@ main(int argc, char **argv)
       input_file = argv[optind];
     }
 
-  printf("\
+  /* Nothing but the output goes to stdout when it is one of the files */
+  msg = stdout;
+  if(is_stdout(binary_name) || is_stdout(ascii_name) || is_stdout(off_name)
+     || is_stdout(dxf_name) || is_stdout(vrml_name)
+     || is_stdout(part_stats_name) || is_stdout(cache_name))
+    {
+      msg = stderr;
+    }
+
+  fprintf(msg, "\
 ADMesh version " VERSION ", Copyright (C) 1995, 1996 Anthony D. Martin\n\
 ADMesh comes with NO WARRANTY.  This is free software, and you are welcome to\n\
 redistribute it under certain conditions.  See the file COPYING for details.\n");
 
   
-  printf("Opening %s\n", input_file);
-  stl_open(&stl_in, input_file);
+  /* Nothing but the transformations and the STL and DXF writers work a
+     block of facets at a time, so only they can go without reading the
+     whole file into memory */
+  stream_flag = stats_only_flag
+    || !(exact_flag || fixall_flag || nearby_flag || remove_unconnected_flag
+	 || fill_holes_flag || normal_directions_flag || normal_values_flag
+	 || reverse_all_flag || merge_flag || weld_flag
+	 || generate_shared_vertices_flag || part_stats_flag
+	 || write_part_stats_flag || write_cache_flag);
+  /* A cache is mapped or read whole, never a block at a time */
+  if(stl_is_cache(input_file))
+    {
+      stream_flag = 0;
+    }
+  /* Translating needs the size first, and stdin can only be read once */
+  if(translate_flag && !stats_only_flag && strcmp(input_file, "-") == 0)
+    {
+      stream_flag = 0;
+    }
+
+  fprintf(msg, "Opening %s\n", input_file);
+  if(stream_flag)
+    {
+      stl_open_blocks(&stl_in, input_file);
+    }
+  else
+    {
+      stl_open(&stl_in, input_file);
+    }
   
   if(rotate_x_flag)
     {
-      printf("Rotating about the x axis by %f degrees...\n", rotate_x_angle);
+      fprintf(msg, "Rotating about the x axis by %f degrees...\n",
+	      rotate_x_angle);
       stl_rotate_x(&stl_in, rotate_x_angle);
     }
   if(rotate_y_flag)
     {
-      printf("Rotating about the y axis by %f degrees...\n", rotate_y_angle);
+      fprintf(msg, "Rotating about the y axis by %f degrees...\n",
+	      rotate_y_angle);
       stl_rotate_y(&stl_in, rotate_y_angle);
     }
   if(rotate_z_flag)
     {
-      printf("Rotating about the z axis by %f degrees...\n", rotate_z_angle);
+      fprintf(msg, "Rotating about the z axis by %f degrees...\n",
+	      rotate_z_angle);
       stl_rotate_z(&stl_in, rotate_z_angle);
     }
   if(mirror_xy_flag)
     {
-      printf("Mirroring about the xy plane...\n");
+      fprintf(msg, "Mirroring about the xy plane...\n");
       stl_mirror_xy(&stl_in);
     }
   if(mirror_yz_flag)
     {
-      printf("Mirroring about the yz plane...\n");
+      fprintf(msg, "Mirroring about the yz plane...\n");
       stl_mirror_yz(&stl_in);
     }
   if(mirror_xz_flag)
     {
-      printf("Mirroring about the xz plane...\n");
+      fprintf(msg, "Mirroring about the xz plane...\n");
       stl_mirror_xz(&stl_in);
     }
   
   if(scale_flag)
     {
-      printf("Scaling by factor %f...\n", scale_factor);
+      fprintf(msg, "Scaling by factor %f...\n", scale_factor);
       stl_scale(&stl_in, scale_factor);
     }  
   if(translate_flag)
     {
-      printf("Translating to %f, %f, %f ...\n", x_trans, y_trans, z_trans);
+      fprintf(msg, "Translating to %f, %f, %f ...\n",
+	      x_trans, y_trans, z_trans);
       stl_translate(&stl_in, x_trans, y_trans, z_trans);
     }
+
+  if(stats_only_flag)
+    {
+      fprintf(msg, "Calculating statistics...\n");
+      stl_calculate_stats_blocks(&stl_in);
+      stl_stats_out(&stl_in, msg, input_file);
+      stl_close(&stl_in);
+      return 0;
+    }
+
+  if(stream_flag)
+    {
+      /* Every block is handed to all of the outputs as soon as it is read */
+      num_writers = 0;
+      if(write_dxf_flag)
+	{
+	  fprintf(msg, "Writing DXF file %s\n", dxf_name);
+	  stl_writer_open_dxf(&writers[num_writers++], dxf_name,
+			      "Created by ADMesh version " VERSION);
+	}
+      if(write_ascii_stl_flag)
+	{
+	  fprintf(msg, "Writing ascii file %s\n", ascii_name);
+	  stl_writer_open_ascii(&writers[num_writers++], ascii_name,
+				"Processed by ADMesh version " VERSION);
+	}
+      if(write_binary_stl_flag)
+	{
+	  fprintf(msg, "Writing binary file %s\n", binary_name);
+	  stl_writer_open_binary(&writers[num_writers++], binary_name,
+				 "Processed by ADMesh version " VERSION,
+				 stl_in.stats.type == binary
+				 ? stl_in.stats.number_of_facets : -1);
+	}
+
+      facets = (stl_facet*)malloc(STL_CONVERT_BLOCK_FACETS
+				  * sizeof(stl_facet));
+      if(facets == NULL)
+	{
+	  perror("admesh");
+	  exit(1);
+	}
+      while((count = stl_read_block(&stl_in, facets,
+				    STL_CONVERT_BLOCK_FACETS)) > 0)
+	{
+	  for(i = 0; i < num_writers; i++)
+	    {
+	      stl_writer_put(&writers[i], facets, count);
+	    }
+	}
+      for(i = 0; i < num_writers; i++)
+	{
+	  stl_writer_close(&writers[i]);
+	}
+      free(facets);
+      stl_close(&stl_in);
+      return 0;
+    }
   if(merge_flag)
     {
-      printf("Merging %s with %s\n", input_file, merge_name);
+      fprintf(msg, "Merging %s with %s\n", input_file, merge_name);
       /* Open the file and add the contents to stl_in: */
       stl_open_merge(&stl_in, merge_name);
     }
+
+  if(weld_flag)
+    {
+      fprintf(msg, "Welding vertices...\n");
+      stl_weld_vertices(&stl_in);
+    }
   
   if(exact_flag || fixall_flag || nearby_flag || remove_unconnected_flag
-     || fill_holes_flag || normal_directions_flag)
+     || fill_holes_flag || normal_directions_flag || part_stats_flag
+     || write_part_stats_flag)
     {
-      printf("Checking exact...\n");
       exact_flag = 1;
-      stl_check_facets_exact(&stl_in);
+      if(stl_in.checked)
+	{
+	  fprintf(msg, "\
+Neighbors read from the cache.  No exact check necessary.\n");
+	}
+      else if(sort_edges_flag)
+	{
+	  fprintf(msg, "Checking exact...\n");
+	  stl_check_facets_exact_sort(&stl_in);
+	}
+      else
+	{
+	  fprintf(msg, "Checking exact...\n");
+	  stl_check_facets_exact(&stl_in);
+	}
       stl_in.stats.facets_w_1_bad_edge = 
 	(stl_in.stats.connected_facets_2_edge -
 	 stl_in.stats.connected_facets_3_edge);
@@ -351,18 +521,25 @@ redistribute it under certain conditions.  See the file COPYING for details.\n")
 	      if(stl_in.stats.connected_facets_3_edge < 
 		 stl_in.stats.number_of_facets)
 		{
-		  printf("\
+		  fprintf(msg, "\
 Checking nearby. Tolerance= %f Iteration=%d of %d...",
-			 tolerance, i + 1, iterations);
-		  stl_check_facets_nearby(&stl_in, tolerance);
-		  printf("  Fixed %d edges.\n",
-			 stl_in.stats.edges_fixed - last_edges_fixed);
+			       tolerance, i + 1, iterations);
+		  if(nearby_distance_flag)
+		    {
+		      stl_check_facets_nearby_grid(&stl_in, tolerance);
+		    }
+		  else
+		    {
+		      stl_check_facets_nearby(&stl_in, tolerance);
+		    }
+		  fprintf(msg, "  Fixed %d edges.\n",
+			       stl_in.stats.edges_fixed - last_edges_fixed);
 		  last_edges_fixed = stl_in.stats.edges_fixed;
 		  tolerance += increment;
 		}
 	      else
 		{
-		  printf("\
+		  fprintf(msg, "\
 All facets connected.  No further nearby check necessary.\n");
 		  break;
 		}
@@ -370,7 +547,7 @@ All facets connected.  No further nearby check necessary.\n");
 	}
       else
 	{
-	  printf("All facets connected.  No nearby check necessary.\n");
+	  fprintf(msg, "All facets connected.  No nearby check necessary.\n");
 	}
     }
   
@@ -378,93 +555,114 @@ All facets connected.  No further nearby check necessary.\n");
     {
       if(stl_in.stats.connected_facets_3_edge <  stl_in.stats.number_of_facets)
 	{
-	  printf("Removing unconnected facets...\n");
+	  fprintf(msg, "Removing unconnected facets...\n");
 	  stl_remove_unconnected_facets(&stl_in);
 	}
       else
-	printf("No unconnected need to be removed.\n");
+	fprintf(msg, "No unconnected need to be removed.\n");
     }
   
   if(fill_holes_flag || fixall_flag)
     {
       if(stl_in.stats.connected_facets_3_edge <  stl_in.stats.number_of_facets)
 	{
-	  printf("Filling holes...\n");
+	  fprintf(msg, "Filling holes...\n");
 	  stl_fill_holes(&stl_in);
 	}
       else
-	printf("No holes need to be filled.\n");
+	fprintf(msg, "No holes need to be filled.\n");
     }
 
   if(reverse_all_flag)
     {
-      printf("Reversing all facets...\n");
+      fprintf(msg, "Reversing all facets...\n");
       stl_reverse_all_facets(&stl_in);
     }
   
   if(normal_directions_flag || fixall_flag)
     {
-      printf("Checking normal directions...\n");
+      fprintf(msg, "Checking normal directions...\n");
       stl_fix_normal_directions(&stl_in);
     }
   
   if(normal_values_flag || fixall_flag)
     {
-      printf("Checking normal values...\n");
+      fprintf(msg, "Checking normal values...\n");
       stl_fix_normal_values(&stl_in);
     }
 
   /* Always calculate the volume.  It shouldn't take too long */
-  printf("Calculating volume...\n");
+  fprintf(msg, "Calculating volume...\n");
   stl_calculate_volume(&stl_in);
 	
   if(exact_flag)
     {
-      printf("Verifying neighbors...\n");
+      fprintf(msg, "Verifying neighbors...\n");
       stl_verify_neighbors(&stl_in);
     }
+
+  /* The parts come from the neighbors, which the checks above found */
+  if(part_stats_flag || write_part_stats_flag)
+    {
+      fprintf(msg, "Calculating part statistics...\n");
+      stl_calculate_part_stats(&stl_in);
+    }
+
+  if(write_part_stats_flag)
+    {
+      fprintf(msg, "Writing part statistics %s\n", part_stats_name);
+      stl_write_part_stats(&stl_in, part_stats_name);
+    }
   
-  if(generate_shared_vertices_flag)
+  /* Shared vertices that are not welded can only have come from a cache */
+  if(generate_shared_vertices_flag
+     && (stl_in.v_shared == NULL || stl_in.v_welded))
     {
-      printf("Generating shared vertices...\n");
+      fprintf(msg, "Generating shared vertices...\n");
       stl_generate_shared_vertices(&stl_in);
     }
+
+  if(write_cache_flag)
+    {
+      fprintf(msg, "Writing cache file %s\n", cache_name);
+      stl_write_cache(&stl_in, cache_name);
+    }
   
   if(write_off_flag)
     {
-      printf("Writing OFF file %s\n", off_name);
+      fprintf(msg, "Writing OFF file %s\n", off_name);
       stl_write_off(&stl_in, off_name);
     }
 
   if(write_dxf_flag)
     {
-      printf("Writing DXF file %s\n", dxf_name);
+      fprintf(msg, "Writing DXF file %s\n", dxf_name);
       stl_write_dxf(&stl_in, dxf_name, "Created by ADMesh version " VERSION);
     }
 
   if(write_vrml_flag)
     {
-      printf("Writing VRML file %s\n", vrml_name);
+      fprintf(msg, "Writing VRML file %s\n", vrml_name);
       stl_write_vrml(&stl_in, vrml_name);
     }
 
   if(write_ascii_stl_flag)
     {
-      printf("Writing ascii file %s\n", ascii_name);
+      fprintf(msg, "Writing ascii file %s\n", ascii_name);
       stl_write_ascii(&stl_in, ascii_name, 
 		      "Processed by ADMesh version " VERSION);
     }
   
   if(write_binary_stl_flag)
     {
-      printf("Writing binary file %s\n", binary_name);
+      fprintf(msg, "Writing binary file %s\n", binary_name);
       stl_write_binary(&stl_in, binary_name,
 		       "Processed by ADMesh version " VERSION);
     }
   
   if(exact_flag)
     {
-      stl_stats_out(&stl_in, stdout, input_file);
+      stl_stats_out(&stl_in, msg, input_file);
     }
   
   stl_close(&stl_in);
@@ -472,6 +670,13 @@ All facets connected.  No further nearby check necessary.\n");
   return 0;
 }
 
+/* Whether name is "-", which stands for stdout */
+static int
+is_stdout(const char *name)
+{
+  return name != NULL && strcmp(name, "-") == 0;
+}
+
 static void 
 usage(int status, char *program_name)
 {
@@ -495,8 +700,11 @@ usage(int status, char *program_name)
       printf("     --scale=factor       Scale the file by factor (multiply by factor)\n");
       printf("     --translate=x,y,z    Translate the file to x, y, and z\n");
       printf("     --merge=name         Merge file called name with input file\n");
+      printf("     --weld-vertices      Index identical vertices before any checks\n");
       printf(" -e, --exact              Only check for perfectly matched edges\n");
+      printf("     --sort-edges         Match exact edges by sorting instead of hashing\n");
       printf(" -n, --nearby             Find and connect nearby facets. Correct bad facets\n");
+      printf("     --nearby-distance    Match nearby edges by distance, not grid cells\n");
       printf(" -t, --tolerance=tol      Initial tolerance to use for nearby check = tol\n");
       printf(" -i, --iterations=i       Number of iterations for nearby check = i\n");
       printf(" -m, --increment=inc      Amount to increment tolerance after iteration=inc\n");
@@ -511,6 +719,12 @@ usage(int status, char *program_name)
       printf("     --write-off=name     Output a Geomview OFF format file called name\n");
       printf("     --write-dxf=name     Output a DXF format file called name\n");
       printf("     --write-vrml=name    Output a VRML format file called name\n");
+      printf("     --write-cache=name   Output an ADMesh cache file called name\n");
+      printf("     --part-stats         Print the size, volume and area of each part\n");
+      printf("     --write-part-stats=name  Output the statistics of each part as CSV\n");
+      printf("     --stats-only         Only print the statistics that need no checks,\n");
+      printf("                          reading the file a block at a time\n");
+      printf("     --threads=n          Use n threads, 0 to use one per processor\n");
       printf("     --help               Display this help and exit\n");
       printf("     --version            Output version information and exit\n");
       printf("\n");
@@ -518,5 +732,12 @@ usage(int status, char *program_name)
       printf("So check here to find what happens if, for example, --translate and --merge\n");
       printf("options are specified together.  The order of the options specified on the\n");
       printf("command line is not important.\n");
+      printf("\n");
+      printf("A file name of - stands for stdin or stdout.  When the output goes to\n");
+      printf("stdout, the messages go to stderr.\n");
+      printf("Input compressed with gzip or zstd is found and read as it is.  Output\n");
+      printf("files whose names end in .gz or .zst are compressed that way.\n");
+      printf("A file written with --write-cache opens without the exact check and\n");
+      printf("without generating the shared vertices again.\n");
     }
 }  
@@ -0,0 +1,429 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/hroncok/admesh/issues
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "stl.h"
+
+/* A cache keeps the arrays of an stl_file the way they are in memory, so
+   only a build of the same version for the same kind of machine reads it
+   back.  Every section starts at a multiple of STL_CACHE_ALIGN bytes, so
+   each array is read with one aligned fread(). */
+#define STL_CACHE_VERSION    1
+#define STL_CACHE_BYTE_ORDER 0x01020304
+#define STL_CACHE_ALIGN      64
+
+/* The sections, in the order they are in the file */
+#define STL_CACHE_STATS      0
+#define STL_CACHE_FACETS     1
+#define STL_CACHE_NEIGHBORS  2
+#define STL_CACHE_V_INDICES  3
+#define STL_CACHE_V_SHARED   4
+#define STL_CACHE_SECTIONS   5
+
+#define STL_CACHE_CHECKED    1	/* the neighbors are what the checks found */
+#define STL_CACHE_WELDED     2	/* v_shared is from stl_weld_vertices() */
+
+typedef struct
+{
+  uint64_t          offset;
+  uint64_t          size;	/* 0 if the array wasn't there */
+}stl_cache_section;
+
+typedef struct
+{
+  char              magic[8];
+  uint32_t          version;
+  uint32_t          byte_order;
+  uint32_t          sizes[STL_CACHE_SECTIONS]; /* of an element of each */
+  uint32_t          flags;
+  stl_cache_section sections[STL_CACHE_SECTIONS];
+}stl_cache_header;
+
+static void stl_cache_sizes(uint32_t *sizes);
+static void *stl_cache_load(FILE *fp, const stl_cache_section *section);
+static void stl_cache_broken(const char *file);
+static void stl_cache_facet_stats(stl_file *stl);
+static int stl_cache_indices_ok(const stl_neighbors *neighbors,
+				const v_indices_struct *v_indices,
+				int num_facets, int num_vertices);
+
+static void
+stl_cache_sizes(uint32_t *sizes)
+{
+  sizes[STL_CACHE_STATS] = sizeof(stl_stats);
+  sizes[STL_CACHE_FACETS] = sizeof(stl_facet);
+  sizes[STL_CACHE_NEIGHBORS] = sizeof(stl_neighbors);
+  sizes[STL_CACHE_V_INDICES] = sizeof(v_indices_struct);
+  sizes[STL_CACHE_V_SHARED] = sizeof(stl_vertex);
+}
+
+/* Writes the facets, the neighbors, the shared vertices and the stats to
+   file, so that stl_open() can read them back without doing any of the
+   work that went into them again */
+void
+stl_write_cache(stl_file *stl, char *file)
+{
+  static const char zeros[STL_CACHE_ALIGN];
+  stl_cache_header  header;
+  const void        *data[STL_CACHE_SECTIONS];
+  size_t            count[STL_CACHE_SECTIONS];
+  FILE              *fp;
+  uint64_t          offset;
+  int               i;
+
+  stl_flush_transform(stl);
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STL_CACHE_MAGIC, sizeof(header.magic));
+  header.version = STL_CACHE_VERSION;
+  header.byte_order = STL_CACHE_BYTE_ORDER;
+  stl_cache_sizes(header.sizes);
+
+  data[STL_CACHE_STATS] = &stl->stats;
+  count[STL_CACHE_STATS] = 1;
+  data[STL_CACHE_FACETS] = stl->facet_start;
+  count[STL_CACHE_FACETS] = stl->stats.number_of_facets;
+  /* Neighbors that no check found are of no use */
+  data[STL_CACHE_NEIGHBORS] = stl->neighbors_start;
+  count[STL_CACHE_NEIGHBORS] = stl->checked ? stl->stats.number_of_facets : 0;
+  data[STL_CACHE_V_INDICES] = stl->v_indices;
+  data[STL_CACHE_V_SHARED] = stl->v_shared;
+  count[STL_CACHE_V_INDICES] = 0;
+  count[STL_CACHE_V_SHARED] = 0;
+  if(stl->v_indices != NULL && stl->v_shared != NULL
+     && stl->stats.shared_vertices > 0)
+    {
+      count[STL_CACHE_V_INDICES] = stl->stats.number_of_facets;
+      count[STL_CACHE_V_SHARED] = stl->stats.shared_vertices;
+    }
+  if(stl->checked)
+    {
+      header.flags |= STL_CACHE_CHECKED;
+    }
+  if(stl->v_welded)
+    {
+      header.flags |= STL_CACHE_WELDED;
+    }
+
+  offset = sizeof(header);
+  for(i = 0; i < STL_CACHE_SECTIONS; i++)
+    {
+      offset = (offset + STL_CACHE_ALIGN - 1) / STL_CACHE_ALIGN
+	* STL_CACHE_ALIGN;
+      header.sections[i].offset = offset;
+      header.sections[i].size = (uint64_t)count[i] * header.sizes[i];
+      offset += header.sections[i].size;
+    }
+
+  /* It has to be read back as it is, to be mapped */
+  if(stl_compression_for(file) != STL_COMPRESS_NONE)
+    {
+      fprintf(stderr, "stl_write_cache: a cache can't be compressed, "
+	      "use a name that doesn't end in .gz or .zst for %s\n", file);
+      exit(1);
+    }
+  fp = stl_open_output(file, "stl_write_cache");
+  offset = sizeof(header);
+  if(fwrite(&header, sizeof(header), 1, fp) != 1)
+    {
+      perror("stl_write_cache");
+      exit(1);
+    }
+  for(i = 0; i < STL_CACHE_SECTIONS; i++)
+    {
+      if(fwrite(zeros, 1, header.sections[i].offset - offset, fp)
+	 != header.sections[i].offset - offset
+	 || (header.sections[i].size > 0
+	     && fwrite(data[i], 1, header.sections[i].size, fp)
+	     != header.sections[i].size))
+	{
+	  perror("stl_write_cache");
+	  exit(1);
+	}
+      offset = header.sections[i].offset + header.sections[i].size;
+    }
+  stl_close_output(fp, "stl_write_cache");
+}
+
+/* Whether file was written by stl_write_cache() */
+int
+stl_is_cache(const char *file)
+{
+  FILE *fp;
+  char magic[8];
+  int  found;
+
+  if(strcmp(file, "-") == 0)
+    {
+      return 0;
+    }
+  fp = fopen(file, "rb");
+  if(fp == NULL)
+    {
+      return 0;
+    }
+  found = fread(magic, 1, sizeof(magic), fp) == sizeof(magic)
+    && memcmp(magic, STL_CACHE_MAGIC, sizeof(magic)) == 0;
+  fclose(fp);
+  return found;
+}
+
+static void
+stl_cache_broken(const char *file)
+{
+  fprintf(stderr, "stl_read_cache: %s is broken, or was written by another "
+	  "version of ADMesh or on another kind of machine\n", file);
+  exit(1);
+}
+
+/* Works out the bounds and the shortest edge from the facets, in the one
+   pass stl_facet_stats() makes as they are read, rather than trusting
+   those that were saved.  The shortest edge is taken over every edge, as
+   the check of a reopened file does. */
+static void
+stl_cache_facet_stats(stl_file *stl)
+{
+  stl_facet *facet;
+  float      max_diff;
+  int        i;
+  int        j;
+
+  /* Without a facet there is nothing to measure */
+  memset(&stl->stats.max, 0, sizeof(stl_vertex));
+  memset(&stl->stats.min, 0, sizeof(stl_vertex));
+  stl->stats.shortest_edge = 0;
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      facet = &stl->facet_start[i];
+      stl_facet_stats(stl, *facet, i == 0);
+      for(j = 0; j < 3; j++)
+	{
+	  max_diff = STL_MAX(ABS(facet->vertex[j].x
+				 - facet->vertex[(j + 1) % 3].x),
+			     ABS(facet->vertex[j].y
+				 - facet->vertex[(j + 1) % 3].y));
+	  max_diff = STL_MAX(ABS(facet->vertex[j].z
+				 - facet->vertex[(j + 1) % 3].z), max_diff);
+	  stl->stats.shortest_edge = STL_MIN(max_diff,
+					     stl->stats.shortest_edge);
+	}
+    }
+  stl->stats.size.x = stl->stats.max.x - stl->stats.min.x;
+  stl->stats.size.y = stl->stats.max.y - stl->stats.min.y;
+  stl->stats.size.z = stl->stats.max.z - stl->stats.min.z;
+  stl->stats.bounding_diameter =
+    sqrt(stl->stats.size.x * stl->stats.size.x
+	 + stl->stats.size.y * stl->stats.size.y
+	 + stl->stats.size.z * stl->stats.size.z);
+}
+
+/* Whether every index in neighbors and v_indices, either of which may be
+   NULL, points into the arrays it indexes, so that a broken cache can't
+   send the checks and the writers out of them.  The which_vertex_not of
+   an edge without a neighbor is never looked at, and isn't always set. */
+static int
+stl_cache_indices_ok(const stl_neighbors *neighbors,
+		     const v_indices_struct *v_indices,
+		     int num_facets, int num_vertices)
+{
+  int i;
+  int j;
+
+  for(i = 0; i < num_facets; i++)
+    {
+      for(j = 0; j < 3; j++)
+	{
+	  if(neighbors != NULL && neighbors[i].neighbor[j] != -1
+	     && (neighbors[i].neighbor[j] < 0
+		 || neighbors[i].neighbor[j] >= num_facets
+		 || neighbors[i].which_vertex_not[j] < 0
+		 || neighbors[i].which_vertex_not[j] > 5))
+	    {
+	      return 0;
+	    }
+	  if(v_indices != NULL
+	     && (v_indices[i].vertex[j] < 0
+		 || v_indices[i].vertex[j] >= num_vertices))
+	    {
+	      return 0;
+	    }
+	}
+    }
+  return 1;
+}
+
+/* Returns a section read into a new array, or NULL if it is empty */
+static void *
+stl_cache_load(FILE *fp, const stl_cache_section *section)
+{
+  void *data;
+
+  if(section->size == 0)
+    {
+      return NULL;
+    }
+  data = malloc(section->size);
+  if(data == NULL)
+    {
+      perror("stl_read_cache");
+      exit(1);
+    }
+  if(fseek(fp, section->offset, SEEK_SET) != 0
+     || fread(data, 1, section->size, fp) != section->size)
+    {
+      perror("stl_read_cache");
+      exit(1);
+    }
+  return data;
+}
+
+/* Reads a file written by stl_write_cache() into stl, which must have been
+   initialized.  The library owns all of the arrays as usual, so each is
+   read into one it allocated; only the bounds have to be worked out. */
+void
+stl_read_cache(stl_file *stl, char *file)
+{
+  stl_cache_header header;
+  uint32_t         sizes[STL_CACHE_SECTIONS];
+  void             *data[STL_CACHE_SECTIONS];
+  uint64_t         file_size;
+  uint64_t         facets_size;
+  FILE             *fp;
+  char             *error_msg;
+  int              i;
+
+  fp = fopen(file, "rb");
+  if(fp == NULL)
+    {
+      error_msg = (char*)
+	malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
+      sprintf(error_msg, "stl_read_cache: Couldn't open %s for reading",
+	      file);
+      perror(error_msg);
+      free(error_msg);
+      exit(1);
+    }
+  stl_cache_sizes(sizes);
+  if(fread(&header, sizeof(header), 1, fp) != 1
+     || memcmp(header.magic, STL_CACHE_MAGIC, sizeof(header.magic)) != 0
+     || header.version != STL_CACHE_VERSION
+     || header.byte_order != STL_CACHE_BYTE_ORDER
+     || memcmp(header.sizes, sizes, sizeof(sizes)) != 0
+     || fseek(fp, 0, SEEK_END) != 0)
+    {
+      stl_cache_broken(file);
+    }
+  file_size = ftell(fp);
+  for(i = 0; i < STL_CACHE_SECTIONS; i++)
+    {
+      if(header.sections[i].offset > file_size
+	 || header.sections[i].size > file_size - header.sections[i].offset
+	 || header.sections[i].size % sizes[i] != 0)
+	{
+	  stl_cache_broken(file);
+	}
+    }
+
+  for(i = 0; i < STL_CACHE_SECTIONS; i++)
+    {
+      data[i] = stl_cache_load(fp, &header.sections[i]);
+    }
+  fclose(fp);
+
+  if(header.sections[STL_CACHE_STATS].size != sizeof(stl_stats))
+    {
+      stl_cache_broken(file);
+    }
+  memcpy(&stl->stats, data[STL_CACHE_STATS], sizeof(stl_stats));
+  free(data[STL_CACHE_STATS]);
+  /* The mesh starts out as it was saved, and the counts of what was done
+     to it belong to the run that saved it */
+  stl->stats.original_num_facets = stl->stats.number_of_facets;
+  stl->stats.degenerate_facets = 0;
+  stl->stats.edges_fixed = 0;
+  stl->stats.facets_removed = 0;
+  stl->stats.facets_added = 0;
+  stl->stats.facets_reversed = 0;
+  stl->stats.backwards_edges = 0;
+  stl->stats.normals_fixed = 0;
+
+  /* Every array of facets has to be there for all of them, or not at all */
+  facets_size = (uint64_t)STL_MAX(stl->stats.number_of_facets, 0);
+  if(stl->stats.number_of_facets < 0
+     || header.sections[STL_CACHE_FACETS].size
+     != facets_size * sizeof(stl_facet)
+     || (data[STL_CACHE_NEIGHBORS] != NULL
+	 && header.sections[STL_CACHE_NEIGHBORS].size
+	 != facets_size * sizeof(stl_neighbors))
+     || (data[STL_CACHE_V_INDICES] != NULL
+	 && header.sections[STL_CACHE_V_INDICES].size
+	 != facets_size * sizeof(v_indices_struct))
+     || (data[STL_CACHE_V_SHARED] != NULL
+	 && header.sections[STL_CACHE_V_SHARED].size
+	 != (uint64_t)STL_MAX(stl->stats.shared_vertices, 0)
+	 * sizeof(stl_vertex))
+     || (data[STL_CACHE_V_INDICES] == NULL)
+     != (data[STL_CACHE_V_SHARED] == NULL)
+     || !stl_cache_indices_ok((stl_neighbors*)data[STL_CACHE_NEIGHBORS],
+			      (v_indices_struct*)data[STL_CACHE_V_INDICES],
+			      stl->stats.number_of_facets,
+			      stl->stats.shared_vertices))
+    {
+      stl_cache_broken(file);
+    }
+
+  stl->facet_start = (stl_facet*)data[STL_CACHE_FACETS];
+  stl->stats.facets_malloced = stl->stats.number_of_facets;
+  stl_cache_facet_stats(stl);
+  stl->neighbors_start = (stl_neighbors*)data[STL_CACHE_NEIGHBORS];
+  stl->checked = (header.flags & STL_CACHE_CHECKED)
+    && stl->neighbors_start != NULL;
+  if(stl->neighbors_start == NULL)
+    {
+      stl->neighbors_start = (stl_neighbors*)
+	calloc(STL_MAX(stl->stats.number_of_facets, 1),
+	       sizeof(stl_neighbors));
+      if(stl->neighbors_start == NULL)
+	{
+	  perror("stl_read_cache");
+	  exit(1);
+	}
+    }
+  if(stl->facet_start == NULL)
+    {
+      stl->facet_start = (stl_facet*)malloc(sizeof(stl_facet));
+      if(stl->facet_start == NULL)
+	{
+	  perror("stl_read_cache");
+	  exit(1);
+	}
+    }
+  stl->v_indices = (v_indices_struct*)data[STL_CACHE_V_INDICES];
+  stl->v_shared = (stl_vertex*)data[STL_CACHE_V_SHARED];
+  stl->stats.shared_malloced = stl->stats.shared_vertices;
+  stl->v_welded = (header.flags & STL_CACHE_WELDED) && stl->v_shared != NULL;
+}
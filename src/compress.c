@@ -0,0 +1,638 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/hroncok/admesh/issues
+ */
+
+/* fopencookie() lets the compressed files pass for ordinary FILEs, so the
+   readers and writers don't have to know about them */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stl.h"
+#include "config.h"
+
+#if !defined(HAVE_FOPENCOOKIE)
+#undef HAVE_ZLIB
+#undef HAVE_ZSTD
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Compressed bytes read from or written to the file per call */
+#define STL_COMPRESS_BUFFER_SIZE (1024 * 1024)
+
+static void stl_codec_fail(const char *caller);
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+
+/* A FILE that decompresses what it reads from raw, or compresses what is
+   written to it into raw */
+typedef struct
+{
+  FILE          *raw;
+  int           format;
+  unsigned char *buf;		/* compressed data */
+  size_t        pos;		/* next byte of buf to decompress */
+  size_t        end;		/* end of the data in buf */
+  long long     offset;		/* uncompressed bytes read so far */
+  int           in_stream;	/* a stream was started but didn't end */
+#ifdef HAVE_ZLIB
+  z_stream      zs;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_DStream  *zds;
+  ZSTD_CCtx     *zcs;
+#endif
+} stl_codec;
+
+static stl_codec *stl_codec_new(FILE *raw, int format);
+static void stl_decoder_start(stl_codec *c);
+static void stl_decoder_end(stl_codec *c);
+static ssize_t stl_decoder_read(void *cookie, char *data, size_t size);
+static int stl_decoder_seek(void *cookie, off64_t *position, int whence);
+static int stl_decoder_close(void *cookie);
+static int stl_encoder_flush(stl_codec *c);
+static int stl_encoder_run(stl_codec *c, const char *data, size_t size,
+			   int finish);
+static ssize_t stl_encoder_write(void *cookie, const char *data,
+				 size_t size);
+static int stl_encoder_close(void *cookie);
+
+#endif
+
+/* Tells the compression of the data that starts with the len bytes of buf
+   from its magic number */
+int
+stl_compression_of(const unsigned char *buf, size_t len)
+{
+  if(len >= 3 && buf[0] == 0x1f && buf[1] == 0x8b && buf[2] == 8)
+    {
+      return STL_COMPRESS_GZIP;
+    }
+  if(len >= 4 && buf[0] == 0x28 && buf[1] == 0xb5 && buf[2] == 0x2f
+     && buf[3] == 0xfd)
+    {
+      return STL_COMPRESS_ZSTD;
+    }
+  return STL_COMPRESS_NONE;
+}
+
+/* Tells the compression a file should get from its extension */
+int
+stl_compression_for(const char *file)
+{
+  size_t len = strlen(file);
+
+  if(len > 3 && strcmp(file + len - 3, ".gz") == 0)
+    {
+      return STL_COMPRESS_GZIP;
+    }
+  if(len > 4 && strcmp(file + len - 4, ".zst") == 0)
+    {
+      return STL_COMPRESS_ZSTD;
+    }
+  return STL_COMPRESS_NONE;
+}
+
+/* Returns how many bytes the data of raw, file_size bytes compressed in
+   format, will have decompressed, as far as the container says, or -1 if
+   it doesn't.  It may be wrong, as gzip only keeps the size modulo 2^32
+   and of its last member, so it can only be a guess.  raw is left at its
+   start. */
+long
+stl_decompressed_size(FILE *raw, int format, long file_size)
+{
+  unsigned char      buf[18]; /* the longest zstd frame header */
+  unsigned long long content;
+  long               size;
+#ifdef HAVE_ZSTD
+  size_t             len;
+#endif
+
+  size = -1;
+  if(format == STL_COMPRESS_GZIP)
+    {
+      /* The last four bytes of the file, little-endian */
+      if(file_size >= 18 && fseek(raw, -4, SEEK_END) == 0
+	 && fread(buf, 1, 4, raw) == 4)
+	{
+	  content = (unsigned long long)buf[0] | (unsigned long long)buf[1] << 8
+	    | (unsigned long long)buf[2] << 16
+	    | (unsigned long long)buf[3] << 24;
+	  /* deflate can't do better than about 1032:1 */
+	  if(content <= 0x7fffffffUL
+	     && content / 1032 <= (unsigned long long)file_size)
+	    {
+	      size = (long)content;
+	    }
+	}
+    }
+#ifdef HAVE_ZSTD
+  else if(format == STL_COMPRESS_ZSTD)
+    {
+      len = fread(buf, 1, sizeof(buf), raw);
+      content = ZSTD_getFrameContentSize(buf, len);
+      if(content != ZSTD_CONTENTSIZE_UNKNOWN
+	 && content != ZSTD_CONTENTSIZE_ERROR && content <= 0x7fffffffUL)
+	{
+	  size = (long)content;
+	}
+    }
+#endif
+  rewind(raw);
+  return size;
+}
+
+/* Returns a FILE that reads the data of raw decompressed.  The len bytes
+   of prefix were already read from raw, and are decompressed first.  Only
+   a raw file that can seek back to its start lets the result seek, and
+   then only from its start. */
+FILE *
+stl_open_decompressor(FILE *raw, int format, const unsigned char *prefix,
+		      size_t len)
+{
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+  cookie_io_functions_t io;
+  stl_codec             *c;
+  FILE                  *fp;
+
+  c = stl_codec_new(raw, format);
+  if(len > 0)
+    {
+      memcpy(c->buf, prefix, len);
+    }
+  c->end = len;
+  stl_decoder_start(c);
+
+  memset(&io, 0, sizeof(io));
+  io.read = stl_decoder_read;
+  io.seek = stl_decoder_seek;
+  io.close = stl_decoder_close;
+  fp = fopencookie(c, "r", io);
+  if(fp == NULL)
+    {
+      perror("stl_open_decompressor");
+      exit(1);
+    }
+  return fp;
+#else
+  (void)raw;
+  (void)format;
+  (void)prefix;
+  (void)len;
+  stl_codec_fail("stl_open_decompressor");
+  return NULL;
+#endif
+}
+
+/* Returns a FILE that writes what it gets compressed to raw, and closes
+   raw when it is closed */
+FILE *
+stl_open_compressor(FILE *raw, int format)
+{
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+  cookie_io_functions_t io;
+  stl_codec             *c;
+  FILE                  *fp;
+
+  c = stl_codec_new(raw, format);
+#ifdef HAVE_ZLIB
+  if(format == STL_COMPRESS_GZIP
+     && deflateInit2(&c->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+		     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+      stl_codec_fail("stl_open_compressor");
+    }
+#endif
+#ifdef HAVE_ZSTD
+  if(format == STL_COMPRESS_ZSTD)
+    {
+      c->zcs = ZSTD_createCCtx();
+      if(c->zcs == NULL)
+	{
+	  stl_codec_fail("stl_open_compressor");
+	}
+      /* Only a library built with threads takes workers, for the others
+	 this is a no-op that fails */
+      if(stl_get_threads() > 1)
+	{
+	  ZSTD_CCtx_setParameter(c->zcs, ZSTD_c_nbWorkers, stl_get_threads());
+	}
+    }
+#endif
+
+  memset(&io, 0, sizeof(io));
+  io.write = stl_encoder_write;
+  io.close = stl_encoder_close;
+  fp = fopencookie(c, "w", io);
+  if(fp == NULL)
+    {
+      perror("stl_open_compressor");
+      exit(1);
+    }
+  return fp;
+#else
+  (void)raw;
+  (void)format;
+  stl_codec_fail("stl_open_compressor");
+  return NULL;
+#endif
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+
+static stl_codec *
+stl_codec_new(FILE *raw, int format)
+{
+  stl_codec *c;
+
+#ifndef HAVE_ZLIB
+  if(format == STL_COMPRESS_GZIP)
+    {
+      stl_codec_fail("stl_open");
+    }
+#endif
+#ifndef HAVE_ZSTD
+  if(format == STL_COMPRESS_ZSTD)
+    {
+      stl_codec_fail("stl_open");
+    }
+#endif
+
+  c = (stl_codec*)calloc(1, sizeof(stl_codec));
+  if(c == NULL)
+    {
+      perror("stl_open");
+      exit(1);
+    }
+  c->buf = (unsigned char*)malloc(STL_COMPRESS_BUFFER_SIZE);
+  if(c->buf == NULL)
+    {
+      perror("stl_open");
+      exit(1);
+    }
+  c->raw = raw;
+  c->format = format;
+  return c;
+}
+
+#endif
+
+/* Reports a file that is compressed in a way this build can't handle, or
+   compressed data that is broken */
+static void
+stl_codec_fail(const char *caller)
+{
+  fprintf(stderr, "%s: The compressed data is broken, or compressed in a "
+	  "way this build of ADMesh can't handle\n", caller);
+  exit(1);
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+
+static void
+stl_decoder_start(stl_codec *c)
+{
+#ifdef HAVE_ZLIB
+  if(c->format == STL_COMPRESS_GZIP && inflateInit2(&c->zs, 15 + 16) != Z_OK)
+    {
+      stl_codec_fail("stl_open");
+    }
+#endif
+#ifdef HAVE_ZSTD
+  if(c->format == STL_COMPRESS_ZSTD)
+    {
+      c->zds = ZSTD_createDStream();
+      if(c->zds == NULL || ZSTD_isError(ZSTD_initDStream(c->zds)))
+	{
+	  stl_codec_fail("stl_open");
+	}
+    }
+#endif
+  c->offset = 0;
+  c->in_stream = 0;
+}
+
+static void
+stl_decoder_end(stl_codec *c)
+{
+#ifdef HAVE_ZLIB
+  if(c->format == STL_COMPRESS_GZIP)
+    {
+      inflateEnd(&c->zs);
+    }
+#endif
+#ifdef HAVE_ZSTD
+  if(c->format == STL_COMPRESS_ZSTD)
+    {
+      ZSTD_freeDStream(c->zds);
+    }
+#endif
+}
+
+/* Decompresses up to size bytes into data.  Several streams, one after
+   the other, are read as one, the way gzip and zstd do.  Like gzip, what
+   follows the last gzip member is ignored if it doesn't start another,
+   such as the zeros that block archivers pad with. */
+static ssize_t
+stl_decoder_read(void *cookie, char *data, size_t size)
+{
+  stl_codec *c = (stl_codec*)cookie;
+  size_t    done;
+#ifdef HAVE_ZLIB
+  int       status;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_inBuffer  in;
+  ZSTD_outBuffer out;
+  size_t         left;
+#endif
+
+  done = 0;
+  while(done < size)
+    {
+      if(c->pos == c->end)
+	{
+	  c->pos = 0;
+	  c->end = fread(c->buf, 1, STL_COMPRESS_BUFFER_SIZE, c->raw);
+	  if(c->end == 0)
+	    {
+	      if(ferror(c->raw) || c->in_stream)
+		{
+		  stl_codec_fail("stl_read");
+		}
+	      break;
+	    }
+	}
+#ifdef HAVE_ZLIB
+      if(c->format == STL_COMPRESS_GZIP && !c->in_stream)
+	{
+	  /* The magic number of the next member may be split by the end
+	     of buf */
+	  if(c->pos + 1 == c->end && c->buf[c->pos] == 0x1f)
+	    {
+	      c->buf[0] = c->buf[c->pos];
+	      c->pos = 0;
+	      c->end = 1 + fread(c->buf + 1, 1, STL_COMPRESS_BUFFER_SIZE - 1,
+				 c->raw);
+	    }
+	  if(c->buf[c->pos] != 0x1f
+	     || (c->pos + 1 < c->end && c->buf[c->pos + 1] != 0x8b))
+	    {
+	      break;
+	    }
+	}
+      if(c->format == STL_COMPRESS_GZIP)
+	{
+	  c->zs.next_in = c->buf + c->pos;
+	  c->zs.avail_in = c->end - c->pos;
+	  c->zs.next_out = (unsigned char*)data + done;
+	  c->zs.avail_out = size - done;
+	  status = inflate(&c->zs, Z_NO_FLUSH);
+	  c->in_stream = status != Z_STREAM_END;
+	  if(status == Z_STREAM_END)
+	    {
+	      inflateReset(&c->zs);
+	    }
+	  else if(status != Z_OK && status != Z_BUF_ERROR)
+	    {
+	      stl_codec_fail("stl_read");
+	    }
+	  c->pos = c->end - c->zs.avail_in;
+	  done = size - c->zs.avail_out;
+	}
+#endif
+#ifdef HAVE_ZSTD
+      if(c->format == STL_COMPRESS_ZSTD)
+	{
+	  in.src = c->buf;
+	  in.size = c->end;
+	  in.pos = c->pos;
+	  out.dst = data;
+	  out.size = size;
+	  out.pos = done;
+	  left = ZSTD_decompressStream(c->zds, &out, &in);
+	  if(ZSTD_isError(left))
+	    {
+	      stl_codec_fail("stl_read");
+	    }
+	  /* 0 is left when a frame was finished */
+	  c->in_stream = left != 0;
+	  c->pos = in.pos;
+	  done = out.pos;
+	}
+#endif
+    }
+  c->offset += done;
+  return done;
+}
+
+/* Seeks by decompressing up to position, from the start of the file if it
+   lies behind.  The end isn't known, so SEEK_END fails. */
+static int
+stl_decoder_seek(void *cookie, off64_t *position, int whence)
+{
+  stl_codec *c = (stl_codec*)cookie;
+  char      skip[4096];
+  long long target;
+  ssize_t   n;
+
+  if(whence == SEEK_SET)
+    {
+      target = *position;
+    }
+  else if(whence == SEEK_CUR)
+    {
+      target = c->offset + *position;
+    }
+  else
+    {
+      return -1;
+    }
+
+  if(target < c->offset)
+    {
+      if(fseek(c->raw, 0, SEEK_SET) != 0)
+	{
+	  return -1;
+	}
+      stl_decoder_end(c);
+      stl_decoder_start(c);
+      c->pos = 0;
+      c->end = 0;
+    }
+  while(c->offset < target)
+    {
+      n = stl_decoder_read(c, skip, STL_MIN((long long)sizeof(skip),
+					    target - c->offset));
+      if(n <= 0)
+	{
+	  return -1;
+	}
+    }
+  *position = c->offset;
+  return 0;
+}
+
+static int
+stl_decoder_close(void *cookie)
+{
+  stl_codec *c = (stl_codec*)cookie;
+  int       status;
+
+  stl_decoder_end(c);
+  status = fclose(c->raw);
+  free(c->buf);
+  free(c);
+  return status;
+}
+
+/* Writes out the compressed data waiting in c->buf */
+static int
+stl_encoder_flush(stl_codec *c)
+{
+  if(c->end > 0 && fwrite(c->buf, 1, c->end, c->raw) != c->end)
+    {
+      return -1;
+    }
+  c->end = 0;
+  return 0;
+}
+
+/* Compresses size bytes of data, and with finish the end of the stream */
+static int
+stl_encoder_run(stl_codec *c, const char *data, size_t size, int finish)
+{
+#ifdef HAVE_ZLIB
+  int            status;
+#endif
+#ifdef HAVE_ZSTD
+  ZSTD_inBuffer  in;
+  ZSTD_outBuffer out;
+  size_t         left;
+#endif
+
+#ifdef HAVE_ZLIB
+  if(c->format == STL_COMPRESS_GZIP)
+    {
+      c->zs.next_in = (unsigned char*)data;
+      c->zs.avail_in = size;
+      do
+	{
+	  c->zs.next_out = c->buf + c->end;
+	  c->zs.avail_out = STL_COMPRESS_BUFFER_SIZE - c->end;
+	  status = deflate(&c->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+	  if(status == Z_STREAM_ERROR)
+	    {
+	      return -1;
+	    }
+	  c->end = STL_COMPRESS_BUFFER_SIZE - c->zs.avail_out;
+	  if(c->end == STL_COMPRESS_BUFFER_SIZE && stl_encoder_flush(c) != 0)
+	    {
+	      return -1;
+	    }
+	}
+      while(c->zs.avail_in > 0 || (finish && status != Z_STREAM_END));
+    }
+#endif
+#ifdef HAVE_ZSTD
+  if(c->format == STL_COMPRESS_ZSTD)
+    {
+      in.src = data;
+      in.size = size;
+      in.pos = 0;
+      do
+	{
+	  out.dst = c->buf;
+	  out.size = STL_COMPRESS_BUFFER_SIZE;
+	  out.pos = c->end;
+	  left = ZSTD_compressStream2(c->zcs, &out, &in,
+				      finish ? ZSTD_e_end : ZSTD_e_continue);
+	  if(ZSTD_isError(left))
+	    {
+	      return -1;
+	    }
+	  c->end = out.pos;
+	  if(c->end == STL_COMPRESS_BUFFER_SIZE && stl_encoder_flush(c) != 0)
+	    {
+	      return -1;
+	    }
+	}
+      while(in.pos < in.size || (finish && left != 0));
+    }
+#endif
+  return 0;
+}
+
+static ssize_t
+stl_encoder_write(void *cookie, const char *data, size_t size)
+{
+  stl_codec *c = (stl_codec*)cookie;
+
+  if(stl_encoder_run(c, data, size, 0) != 0)
+    {
+      return 0;
+    }
+  return size;
+}
+
+static int
+stl_encoder_close(void *cookie)
+{
+  stl_codec *c = (stl_codec*)cookie;
+  int       status;
+
+  status = stl_encoder_run(c, NULL, 0, 1);
+  if(status == 0)
+    {
+      status = stl_encoder_flush(c);
+    }
+#ifdef HAVE_ZLIB
+  if(c->format == STL_COMPRESS_GZIP)
+    {
+      deflateEnd(&c->zs);
+    }
+#endif
+#ifdef HAVE_ZSTD
+  if(c->format == STL_COMPRESS_ZSTD)
+    {
+      ZSTD_freeCCtx(c->zcs);
+    }
+#endif
+  if(fclose(c->raw) != 0)
+    {
+      status = -1;
+    }
+  free(c->buf);
+  free(c);
+  return status;
+}
+
+#endif
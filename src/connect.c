@@ -24,9 +24,56 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <stdint.h>
 
 #include "stl.h"
 
+/* Smallest number of slots in the edge table */
+#define STL_EDGE_TABLE_MIN 1024
+
+/* Smallest mesh that is worth checking on several threads */
+#define STL_PARALLEL_EXACT_FACETS 65536
+
+/* Largest cell index along an axis of the nearby grid, so that a cell and
+   its neighbors always fit in an int64_t */
+#define STL_GRID_CELL_MAX ((int64_t)1 << 62)
+
+/* An edge key reduced to 64 bits, with the index of the edge it came from */
+typedef struct
+{
+  uint64_t hash;
+  int      edge;
+}stl_edge_sort;
+
+/* An end of an open edge, filed under the grid cell it lies in */
+typedef struct
+{
+  int64_t cell[3];
+  int     edge;			/* 3 * facet + edge of the facet */
+}stl_grid_entry;
+
+/* State shared by the threads of stl_check_facets_exact_parallel().  The
+   facets are split into blocks and the edges into shards by the top bits
+   of their hash, so equal edges always land in the same shard. */
+typedef struct
+{
+  stl_file      *stl;
+  char          *degenerate;	/* one flag per facet */
+  stl_hash_edge *edges;		/* three per facet, in facet order */
+  stl_edge_sort *hashes;	/* the hash of each edge */
+  stl_edge_sort *shards;	/* hashes grouped by shard, in edge order */
+  int           *offsets;	/* start of each block's part of a shard */
+  int           *shard_start;
+  int           *pairs;		/* matched edges, two per match */
+  int           *num_pairs;	/* matches found in each shard */
+  float         *shortest_edge;	/* per block */
+  int           num_facets;
+  int           block_size;
+  int           num_blocks;
+  int           num_shards;
+  int           shard_shift;
+}stl_exact_job;
+
 
 static void stl_match_neighbors_exact(stl_file *stl, 
 			 stl_hash_edge *edge_a, stl_hash_edge *edge_b);
@@ -35,17 +82,38 @@ static void stl_match_neighbors_nearby(stl_file *stl,
 static void stl_record_neighbors(stl_file *stl,
 			       stl_hash_edge *edge_a, stl_hash_edge *edge_b);
 static void stl_initialize_facet_check_exact(stl_file *stl);
+static void stl_initialize_neighbors(stl_file *stl);
+static int stl_facet_is_degenerate(stl_facet *facet);
+static void stl_radix_sort_edges(stl_edge_sort *edges, stl_edge_sort *temp,
+				 int num_edges);
+static void stl_match_sorted_edges(stl_file *stl, stl_hash_edge *edges,
+				   stl_edge_sort *run, int count);
+static void stl_check_facets_exact_parallel(stl_file *stl);
+static void stl_find_degenerate_block(void *arg, int block);
+static void stl_load_edges_block(void *arg, int block);
+static void stl_shard_edges_block(void *arg, int block);
+static void stl_match_edges_shard(void *arg, int shard);
 static void stl_initialize_facet_check_nearby(stl_file *stl);
+static int stl_update_open_edges(stl_file *stl);
+static int stl_next_open_edge(stl_file *stl, int *index, int *edge);
+static void stl_initialize_edges(stl_file *stl, int expected_edges);
+static void stl_grow_edges(stl_file *stl);
 static void stl_load_edge_exact(stl_file *stl, stl_hash_edge *edge,
 			 stl_vertex *a, stl_vertex *b);
+static float stl_load_edge_key(stl_hash_edge *edge, 
+			       stl_vertex *a, stl_vertex *b);
+static void stl_load_edge_welded(stl_file *stl, stl_hash_edge *edge);
+static int stl_compare_grid_entries(const void *a, const void *b);
+static int64_t stl_grid_cell(float value, float min, float cell_size);
+static unsigned stl_get_hash_for_cell(const int64_t *cell);
+static float stl_grid_distance(stl_vertex *a, stl_vertex *b);
 static int stl_load_edge_nearby(stl_file *stl, stl_hash_edge *edge,
 			 stl_vertex *a, stl_vertex *b, float tolerance);
 static void insert_hash_edge(stl_file *stl, stl_hash_edge edge,
 		      void (*match_neighbors)(stl_file *stl, 
 		    stl_hash_edge *edge_a, stl_hash_edge *edge_b));
-static int stl_get_hash_for_edge(int M, stl_hash_edge *edge);
+static uint64_t stl_get_hash_for_edge(stl_hash_edge *edge);
 static int stl_compare_function(stl_hash_edge *edge_a, stl_hash_edge *edge_b);
-static void stl_free_edges(stl_file *stl);
 static void stl_remove_facet(stl_file *stl, int facet_number);
 static void stl_change_vertices(stl_file *stl, int facet_num, int vnot,
 			 stl_vertex new_vertex);
@@ -73,6 +141,15 @@ stl_check_facets_exact(stl_file *stl)
   int            i;
   int            j;
 
+  stl_flush_transform(stl);
+  stl->checked = 1;
+  if(   stl_get_threads() > 1
+     && stl->stats.number_of_facets >= STL_PARALLEL_EXACT_FACETS)
+    {
+      stl_check_facets_exact_parallel(stl);
+      return;
+    }
+
   stl->stats.connected_edges = 0;
   stl->stats.connected_facets_1_edge = 0;
   stl->stats.connected_facets_2_edge = 0;
@@ -85,12 +162,7 @@ stl_check_facets_exact(stl_file *stl)
       facet = stl->facet_start[i];
 
       /* If any two of the three vertices are found to be exactally the same, call them degenerate and remove the facet. */
-      if(   !memcmp(&facet.vertex[0], &facet.vertex[1], 
-		    sizeof(stl_vertex))
-	 || !memcmp(&facet.vertex[1], &facet.vertex[2], 
-		    sizeof(stl_vertex))
-	 || !memcmp(&facet.vertex[0], &facet.vertex[2], 
-		    sizeof(stl_vertex)))
+      if(stl_facet_is_degenerate(&facet))
 	{
 	  stl->stats.degenerate_facets += 1;
 	  stl_remove_facet(stl, i);
@@ -104,16 +176,497 @@ stl_check_facets_exact(stl_file *stl)
 	  edge.which_edge = j;
 	  stl_load_edge_exact(stl, &edge, &facet.vertex[j],
 			      &facet.vertex[(j + 1) % 3]);
+	  if(stl->v_welded)
+	    {
+	      stl_load_edge_welded(stl, &edge);
+	    }
 	  
 	  insert_hash_edge(stl, edge, stl_match_neighbors_exact);
 	}
     }
-  stl_free_edges(stl);
+}
+
+void
+stl_check_facets_exact_sort(stl_file *stl)
+{
+/* This function builds the same neighbors list as stl_check_facets_exact(),
+ *  but finds the matching edges by sorting all of the edge keys instead of
+ *  inserting them into a hash table one at a time.
+ */
+
+  stl_hash_edge  *edges;
+  stl_edge_sort  *sorted;
+  stl_facet      *facet;
+  int            num_edges;
+  int            start;
+  int            end;
+  int            i;
+  int            j;
+
+  stl_flush_transform(stl);
+  stl->checked = 1;
+  stl->stats.connected_edges = 0;
+  stl->stats.connected_facets_1_edge = 0;
+  stl->stats.connected_facets_2_edge = 0;
+  stl->stats.connected_facets_3_edge = 0;
+
+  stl_initialize_neighbors(stl);
+
+  /* Remove the degenerate facets first.  The hash check removes them in
+     the same order, before it looks at any facet after them, so the
+     remaining facets end up in the same places. */
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      if(stl_facet_is_degenerate(&stl->facet_start[i]))
+	{
+	  stl->stats.degenerate_facets += 1;
+	  stl_remove_facet(stl, i);
+	  i--;
+	}
+    }
+
+  num_edges = 3 * stl->stats.number_of_facets;
+  edges = (stl_hash_edge*)malloc(num_edges * sizeof(stl_hash_edge));
+  sorted = (stl_edge_sort*)malloc(2 * num_edges * sizeof(stl_edge_sort));
+  if(edges == NULL || sorted == NULL)
+    {
+      perror("stl_check_facets_exact_sort");
+      exit(1);
+    }
+
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      facet = &stl->facet_start[i];
+      for(j = 0; j < 3; j++)
+	{
+	  edges[3 * i + j].facet_number = i;
+	  edges[3 * i + j].which_edge = j;
+	  stl_load_edge_exact(stl, &edges[3 * i + j], &facet->vertex[j],
+			      &facet->vertex[(j + 1) % 3]);
+	  if(stl->v_welded)
+	    {
+	      stl_load_edge_welded(stl, &edges[3 * i + j]);
+	    }
+	  sorted[3 * i + j].hash = stl_get_hash_for_edge(&edges[3 * i + j]);
+	  sorted[3 * i + j].edge = 3 * i + j;
+	}
+    }
+
+  /* The sort is stable, so each run of equal hashes lists its edges in
+     the order the hash check would have inserted them */
+  stl_radix_sort_edges(sorted, sorted + num_edges, num_edges);
+
+  for(start = 0; start < num_edges; start = end)
+    {
+      for(end = start + 1;
+	  end < num_edges && sorted[end].hash == sorted[start].hash; end++);
+      if(end - start > 1)
+	{
+	  stl_match_sorted_edges(stl, edges, sorted + start, end - start);
+	}
+    }
+
+  free(sorted);
+  free(edges);
+}
+
+/* Sorts the edges by hash, keeping edges with equal hashes in order.
+   temp must have room for num_edges entries. */
+static void
+stl_radix_sort_edges(stl_edge_sort *edges, stl_edge_sort *temp,
+		     int num_edges)
+{
+  stl_edge_sort *swap;
+  int           *count;
+  int           shift;
+  int           sum;
+  int           digit;
+  int           i;
+
+  count = (int*)malloc(65536 * sizeof(int));
+  if(count == NULL)
+    {
+      perror("stl_radix_sort_edges");
+      exit(1);
+    }
+
+  /* Four passes of 16 bits leave the result back in edges */
+  for(shift = 0; shift < 64; shift += 16)
+    {
+      memset(count, 0, 65536 * sizeof(int));
+      for(i = 0; i < num_edges; i++)
+	{
+	  count[(edges[i].hash >> shift) & 0xFFFF]++;
+	}
+      sum = 0;
+      for(digit = 0; digit < 65536; digit++)
+	{
+	  i = count[digit];
+	  count[digit] = sum;
+	  sum += i;
+	}
+      for(i = 0; i < num_edges; i++)
+	{
+	  temp[count[(edges[i].hash >> shift) & 0xFFFF]++] = edges[i];
+	}
+      swap = edges;
+      edges = temp;
+      temp = swap;
+    }
+  free(count);
+}
+
+/* Matches the edges of a run of equal hashes the way insert_hash_edge()
+   would: each edge is paired with the oldest waiting edge that has the
+   same key and belongs to another facet, or else waits itself.  The
+   front of the run is reused for the list of waiting edges. */
+static void
+stl_match_sorted_edges(stl_file *stl, stl_hash_edge *edges,
+		       stl_edge_sort *run, int count)
+{
+  int waiting;
+  int edge;
+  int i;
+  int j;
+
+  waiting = 0;
+  for(i = 0; i < count; i++)
+    {
+      edge = run[i].edge;
+      for(j = 0; j < waiting; j++)
+	{
+	  if(!stl_compare_function(&edges[edge], &edges[run[j].edge]))
+	    {
+	      break;
+	    }
+	}
+      if(j < waiting)
+	{
+	  stl_record_neighbors(stl, &edges[edge], &edges[run[j].edge]);
+	  for(waiting--; j < waiting; j++)
+	    {
+	      run[j].edge = run[j + 1].edge;
+	    }
+	}
+      else
+	{
+	  run[waiting++].edge = edge;
+	}
+    }
+}
+
+/* Builds the same neighbors list as the serial stl_check_facets_exact()
+   using all of the threads.  The keys are loaded and sharded in parallel,
+   each shard is matched on its own, and the matches are then recorded on
+   one thread, since a facet's neighbors may come from several shards. */
+static void
+stl_check_facets_exact_parallel(stl_file *stl)
+{
+  stl_exact_job job;
+  int           num_edges;
+  int           total;
+  int           last;
+  int           i;
+  int           j;
+  int           k;
+
+  stl->stats.connected_edges = 0;
+  stl->stats.connected_facets_1_edge = 0;
+  stl->stats.connected_facets_2_edge = 0;
+  stl->stats.connected_facets_3_edge = 0;
+  stl->stats.malloced = 0;
+  stl->stats.freed = 0;
+  stl->stats.collisions = 0;
+
+  stl_initialize_neighbors(stl);
+
+  job.stl = stl;
+  job.num_blocks = 4 * stl_get_threads();
+  for(job.num_shards = 1, job.shard_shift = 64;
+      job.num_shards < 4 * stl_get_threads();
+      job.num_shards *= 2, job.shard_shift--);
+
+  /* Flag the degenerate facets in parallel, then remove them in the same
+     order as the serial check: each one is replaced by the last facet,
+     which is looked at next. */
+  job.num_facets = stl->stats.number_of_facets;
+  job.block_size = (job.num_facets + job.num_blocks - 1) / job.num_blocks;
+  job.degenerate = (char*)malloc(job.num_facets);
+  if(job.degenerate == NULL)
+    {
+      perror("stl_check_facets_exact");
+      exit(1);
+    }
+  stl_parallel_run(job.num_blocks, stl_find_degenerate_block, &job);
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      if(job.degenerate[i])
+	{
+	  last = stl->stats.number_of_facets - 1;
+	  job.degenerate[i] = job.degenerate[last];
+	  stl->stats.degenerate_facets += 1;
+	  stl_remove_facet(stl, i);
+	  i--;
+	}
+    }
+  free(job.degenerate);
+
+  job.num_facets = stl->stats.number_of_facets;
+  job.block_size = (job.num_facets + job.num_blocks - 1) / job.num_blocks;
+  num_edges = 3 * job.num_facets;
+  job.edges = (stl_hash_edge*)malloc(num_edges * sizeof(stl_hash_edge));
+  job.hashes = (stl_edge_sort*)malloc(num_edges * sizeof(stl_edge_sort));
+  job.shards = (stl_edge_sort*)malloc(num_edges * sizeof(stl_edge_sort));
+  job.pairs = (int*)malloc(num_edges * sizeof(int));
+  job.offsets = (int*)calloc(job.num_blocks * job.num_shards, sizeof(int));
+  job.shard_start = (int*)malloc((job.num_shards + 1) * sizeof(int));
+  job.num_pairs = (int*)malloc(job.num_shards * sizeof(int));
+  job.shortest_edge = (float*)malloc(job.num_blocks * sizeof(float));
+  if(   job.edges == NULL || job.hashes == NULL || job.shards == NULL
+     || job.pairs == NULL || job.offsets == NULL || job.shard_start == NULL
+     || job.num_pairs == NULL || job.shortest_edge == NULL)
+    {
+      perror("stl_check_facets_exact");
+      exit(1);
+    }
+
+  /* Load the keys and count the edges of each block in each shard */
+  stl_parallel_run(job.num_blocks, stl_load_edges_block, &job);
+
+  /* Lay the shards out one after the other, with the blocks in order
+     inside each shard so the edges keep their order */
+  total = 0;
+  for(j = 0; j < job.num_shards; j++)
+    {
+      job.shard_start[j] = total;
+      for(i = 0; i < job.num_blocks; i++)
+	{
+	  k = job.offsets[i * job.num_shards + j];
+	  job.offsets[i * job.num_shards + j] = total;
+	  total += k;
+	}
+    }
+  job.shard_start[job.num_shards] = total;
+  stl_parallel_run(job.num_blocks, stl_shard_edges_block, &job);
+
+  stl_parallel_run(job.num_shards, stl_match_edges_shard, &job);
+
+  for(i = 0; i < job.num_blocks; i++)
+    {
+      stl->stats.shortest_edge = STL_MIN(job.shortest_edge[i],
+					 stl->stats.shortest_edge);
+    }
+  for(j = 0; j < job.num_shards; j++)
+    {
+      for(k = 0; k < job.num_pairs[j]; k++)
+	{
+	  i = job.shard_start[j] + 2 * k;
+	  stl_record_neighbors(stl, &job.edges[job.pairs[i]],
+			       &job.edges[job.pairs[i + 1]]);
+	}
+    }
+
+  free(job.edges);
+  free(job.hashes);
+  free(job.shards);
+  free(job.pairs);
+  free(job.offsets);
+  free(job.shard_start);
+  free(job.num_pairs);
+  free(job.shortest_edge);
+}
+
+static void
+stl_find_degenerate_block(void *arg, int block)
+{
+  stl_exact_job *job = (stl_exact_job*)arg;
+  int           end;
+  int           i;
+
+  end = STL_MIN((block + 1) * job->block_size, job->num_facets);
+  for(i = block * job->block_size; i < end; i++)
+    {
+      job->degenerate[i] = stl_facet_is_degenerate(&job->stl->facet_start[i]);
+    }
+}
+
+static void
+stl_load_edges_block(void *arg, int block)
+{
+  stl_exact_job *job = (stl_exact_job*)arg;
+  stl_facet     *facet;
+  int           *counts;
+  float         shortest_edge;
+  float         max_diff;
+  int           end;
+  int           e;
+  int           i;
+  int           j;
+
+  counts = job->offsets + block * job->num_shards;
+  shortest_edge = job->stl->stats.shortest_edge;
+  end = STL_MIN((block + 1) * job->block_size, job->num_facets);
+  for(i = block * job->block_size; i < end; i++)
+    {
+      facet = &job->stl->facet_start[i];
+      for(j = 0; j < 3; j++)
+	{
+	  e = 3 * i + j;
+	  job->edges[e].facet_number = i;
+	  job->edges[e].which_edge = j;
+	  max_diff = stl_load_edge_key(&job->edges[e], &facet->vertex[j],
+				       &facet->vertex[(j + 1) % 3]);
+	  if(job->stl->v_welded)
+	    {
+	      stl_load_edge_welded(job->stl, &job->edges[e]);
+	    }
+	  shortest_edge = STL_MIN(max_diff, shortest_edge);
+	  job->hashes[e].hash = stl_get_hash_for_edge(&job->edges[e]);
+	  job->hashes[e].edge = e;
+	  counts[job->hashes[e].hash >> job->shard_shift]++;
+	}
+    }
+  job->shortest_edge[block] = shortest_edge;
+}
+
+static void
+stl_shard_edges_block(void *arg, int block)
+{
+  stl_exact_job *job = (stl_exact_job*)arg;
+  int           *offsets;
+  int           end;
+  int           e;
+
+  offsets = job->offsets + block * job->num_shards;
+  end = 3 * STL_MIN((block + 1) * job->block_size, job->num_facets);
+  for(e = 3 * block * job->block_size; e < end; e++)
+    {
+      job->shards[offsets[job->hashes[e].hash >> job->shard_shift]++] =
+	job->hashes[e];
+    }
+}
+
+/* Matches the edges of one shard with a private table, following the
+   rules of insert_hash_edge().  The table holds positions in the shard,
+   whose hashes are already known. */
+static void
+stl_match_edges_shard(void *arg, int shard)
+{
+  stl_exact_job *job = (stl_exact_job*)arg;
+  stl_edge_sort *edges;
+  stl_hash_edge *edge;
+  int           *table;
+  int           *pairs;
+  int           count;
+  int           num_pairs;
+  unsigned      mask;
+  unsigned      slot;
+  unsigned      next;
+  unsigned      home;
+  int           i;
+
+  edges = job->shards + job->shard_start[shard];
+  count = job->shard_start[shard + 1] - job->shard_start[shard];
+  pairs = job->pairs + job->shard_start[shard];
+  num_pairs = 0;
+
+  for(mask = STL_EDGE_TABLE_MIN - 1; mask < 2 * (unsigned)count; 
+      mask = 2 * mask + 1);
+  table = (int*)malloc((mask + 1) * sizeof(int));
+  if(table == NULL)
+    {
+      perror("stl_check_facets_exact");
+      exit(1);
+    }
+  memset(table, -1, (mask + 1) * sizeof(int));
+
+  for(i = 0; i < count; i++)
+    {
+      edge = &job->edges[edges[i].edge];
+      for(slot = edges[i].hash & mask; table[slot] != -1;
+	  slot = (slot + 1) & mask)
+	{
+	  if(!stl_compare_function(edge, &job->edges[edges[table[slot]].edge]))
+	    {
+	      break;
+	    }
+	}
+      if(table[slot] == -1)
+	{
+	  /* No match.  This edge waits in the empty slot. */
+	  table[slot] = i;
+	  continue;
+	}
+
+      pairs[2 * num_pairs] = edges[i].edge;
+      pairs[2 * num_pairs + 1] = edges[table[slot]].edge;
+      num_pairs++;
+
+      /* Delete the matched edge, shifting back the entries after it */
+      for(next = (slot + 1) & mask; table[next] != -1;
+	  next = (next + 1) & mask)
+	{
+	  home = edges[table[next]].hash & mask;
+	  if(((next - home) & mask) >= ((next - slot) & mask))
+	    {
+	      table[slot] = table[next];
+	      slot = next;
+	    }
+	}
+      table[slot] = -1;
+    }
+
+  free(table);
+  job->num_pairs[shard] = num_pairs;
+}
+
+static int
+stl_facet_is_degenerate(stl_facet *facet)
+{
+  return (   !memcmp(&facet->vertex[0], &facet->vertex[1], sizeof(stl_vertex))
+	  || !memcmp(&facet->vertex[1], &facet->vertex[2], sizeof(stl_vertex))
+	  || !memcmp(&facet->vertex[0], &facet->vertex[2], sizeof(stl_vertex)));
 }
 
 static void
 stl_load_edge_exact(stl_file *stl, stl_hash_edge *edge,
 		    stl_vertex *a, stl_vertex *b)
+{
+  float max_diff;
+
+  max_diff = stl_load_edge_key(edge, a, b);
+  stl->stats.shortest_edge = STL_MIN(max_diff, stl->stats.shortest_edge);
+}
+
+/* Replaces the coordinates in the key of an edge by the indices of its
+   welded vertices, in the same order.  Two edges have equal keys exactly
+   when their coordinate keys are equal, and the indices are cheaper to
+   hash and compare. */
+static void
+stl_load_edge_welded(stl_file *stl, stl_hash_edge *edge)
+{
+  int *vertex;
+  int j;
+
+  vertex = stl->v_indices[edge->facet_number].vertex;
+  j = edge->which_edge % 3;
+  if(edge->which_edge < 3)
+    {
+      edge->key[0] = vertex[j];
+      edge->key[1] = vertex[(j + 1) % 3];
+    }
+  else
+    {
+      edge->key[0] = vertex[(j + 1) % 3];
+      edge->key[1] = vertex[j];
+    }
+  edge->key[2] = edge->key[3] = edge->key[4] = edge->key[5] = 0;
+}
+
+/* Loads the key of the edge from a to b with the vertex that is further
+   along its longest axis first.  Returns the length along that axis. */
+static float
+stl_load_edge_key(stl_hash_edge *edge, stl_vertex *a, stl_vertex *b)
 {
 
   float diff_x;
@@ -127,7 +680,6 @@ stl_load_edge_exact(stl_file *stl, stl_hash_edge *edge,
   diff_z = ABS(a->z - b->z);
   max_diff = STL_MAX(diff_x, diff_y);
   max_diff = STL_MAX(diff_z, max_diff);
-  stl->stats.shortest_edge = STL_MIN(max_diff, stl->stats.shortest_edge);
 
   if(diff_x == max_diff)
     {
@@ -171,19 +723,24 @@ stl_load_edge_exact(stl_file *stl, stl_hash_edge *edge,
 	  edge->which_edge += 3; /* this edge is loaded backwards */
 	}
     }
+  return max_diff;
 }
 
 static void
 stl_initialize_facet_check_exact(stl_file *stl)
 {
-  int i;
-
-  stl->stats.malloced = 0;
-  stl->stats.freed = 0;
-  stl->stats.collisions = 0;
+  stl_initialize_neighbors(stl);
 
+  /* Most edges find their neighbor soon after they are inserted, so start
+     small and let the table grow with the number of waiting edges.  A
+     small table stays in the cache on well ordered meshes. */
+  stl_initialize_edges(stl, 0);
+}
 
-  stl->M = 81397;
+static void
+stl_initialize_neighbors(stl_file *stl)
+{
+  int i;
 
   for(i = 0; i < stl->stats.number_of_facets ; i++)
     {
@@ -192,19 +749,98 @@ stl_initialize_facet_check_exact(stl_file *stl)
       stl->neighbors_start[i].neighbor[1] = -1;
       stl->neighbors_start[i].neighbor[2] = -1;
     }
+  stl_invalidate_open_edges(stl);
+  stl_invalidate_parts(stl);
+}
 
-  stl->heads = (stl_hash_edge**)calloc(stl->M, sizeof(*stl->heads));
-  if(stl->heads == NULL) perror("stl_initialize_facet_check_exact");
+/* Empties the edge table and makes room for about expected_edges
+   entries.  The table grows by itself if more are inserted.  The slots
+   left by an earlier check are reused when they are big enough, so the
+   nearby iterations and stl_fill_holes() don't allocate again. */
+static void
+stl_initialize_edges(stl_file *stl, int expected_edges)
+{
+  unsigned size;
+  unsigned i;
 
-  stl->tail = (stl_hash_edge*)malloc(sizeof(stl_hash_edge));
-  if(stl->tail == NULL) perror("stl_initialize_facet_check_exact");
+  stl->stats.malloced = 0;
+  stl->stats.freed = 0;
+  stl->stats.collisions = 0;
 
-  stl->tail->next = stl->tail;
+  /* Keep the table at most half full */
+  size = STL_EDGE_TABLE_MIN;
+  while(size < 2 * (unsigned)expected_edges && size < 0x40000000)
+    {
+      size *= 2;
+    }
 
-  for(i = 0; i < stl->M; i++)
+  if(stl->edges.capacity < size)
+    {
+      free(stl->edges.slots);
+      stl->edges.slots = (stl_hash_edge*)malloc(size * sizeof(stl_hash_edge));
+      if(stl->edges.slots == NULL)
+	{
+	  perror("stl_initialize_edges");
+	  exit(1);
+	}
+      stl->edges.capacity = size;
+    }
+  /* Only the first size slots are used, a small table stays in the cache
+     even if a larger one was needed before */
+  for(i = 0; i < size; i++)
     {
-      stl->heads[i] = stl->tail;
+      stl->edges.slots[i].facet_number = -1;
     }
+  stl->edges.mask = size - 1;
+  stl->edges.entries = 0;
+}
+
+/* Doubles the size of the edge table.  The old slots are reinserted in
+   probe order, starting just after an empty slot, so edges with the same
+   key stay in the order they were inserted. */
+static void
+stl_grow_edges(stl_file *stl)
+{
+  stl_hash_edge *old_slots;
+  unsigned      old_size;
+  unsigned      start;
+  unsigned      slot;
+  unsigned      i;
+  unsigned      j;
+
+  old_slots = stl->edges.slots;
+  old_size = stl->edges.mask + 1;
+  for(start = 0; old_slots[start].facet_number != -1; start++);
+
+  stl->edges.mask = 2 * old_size - 1;
+  stl->edges.capacity = 2 * old_size;
+  stl->edges.slots = (stl_hash_edge*)malloc(2 * old_size
+					    * sizeof(stl_hash_edge));
+  if(stl->edges.slots == NULL)
+    {
+      perror("stl_grow_edges");
+      exit(1);
+    }
+  for(i = 0; i <= stl->edges.mask; i++)
+    {
+      stl->edges.slots[i].facet_number = -1;
+    }
+
+  for(i = 1; i <= old_size; i++)
+    {
+      j = (start + i) & (old_size - 1);
+      if(old_slots[j].facet_number == -1)
+	{
+	  continue;
+	}
+      slot = stl_get_hash_for_edge(&old_slots[j]) & stl->edges.mask;
+      while(stl->edges.slots[slot].facet_number != -1)
+	{
+	  slot = (slot + 1) & stl->edges.mask;
+	}
+      stl->edges.slots[slot] = old_slots[j];
+    }
+  free(old_slots);
 }
 
 static void
@@ -212,80 +848,75 @@ insert_hash_edge(stl_file *stl, stl_hash_edge edge,
 		      void (*match_neighbors)(stl_file *stl, 
 		    stl_hash_edge *edge_a, stl_hash_edge *edge_b))
 {
-  stl_hash_edge *link;
-  stl_hash_edge *new_edge;
-  stl_hash_edge *temp;
-  int            chain_number;
-
-  chain_number = stl_get_hash_for_edge(stl->M, &edge);
-
-  link = stl->heads[chain_number];
+  stl_hash_edge *slots;
+  unsigned      mask;
+  unsigned      slot;
+  unsigned      next;
+  unsigned      home;
 
-  if(link == stl->tail)
+  if(2 * (stl->edges.entries + 1) > (int)(stl->edges.mask + 1))
     {
-      /* This list doesn't have any edges currently in it.  Add this one. */
-      new_edge = (stl_hash_edge*)malloc(sizeof(stl_hash_edge));
-      if(new_edge == NULL) perror("insert_hash_edge");
-      stl->stats.malloced++;
-      *new_edge = edge;
-      new_edge->next = stl->tail;
-      stl->heads[chain_number] = new_edge;
-      return;
-    }      
-  else  if(!stl_compare_function(&edge, link))
-    {
-      /* This is a match.  Record result in neighbors list. */
-      match_neighbors(stl, &edge, link);
-      /* Delete the matched edge from the list. */
-      stl->heads[chain_number] = link->next;
-      free(link);
-      stl->stats.freed++;
-      return;
+      stl_grow_edges(stl);
     }
-  else
-    {				/* Continue through the rest of the list */
-      for(;;)
+  slots = stl->edges.slots;
+  mask = stl->edges.mask;
+
+  /* Edges with the same key sit in insertion order along the probe
+     sequence, so the first match is the oldest waiting edge, just like
+     the head of a hash chain. */
+  for(slot = stl_get_hash_for_edge(&edge) & mask; 
+      slots[slot].facet_number != -1; slot = (slot + 1) & mask)
+    {
+      if(!stl_compare_function(&edge, &slots[slot]))
 	{
-	  if(link->next == stl->tail)
-	    {
-	      /* This is the last item in the list. Insert a new edge. */
-	      new_edge = (stl_hash_edge*)malloc(sizeof(stl_hash_edge));
-	      if(new_edge == NULL) perror("insert_hash_edge");
-	      stl->stats.malloced++;
-	      *new_edge = edge;
-	      new_edge->next = stl->tail;
-	      link->next = new_edge;
-	      stl->stats.collisions++;
-	      return;
-	    }
-	  else  if(!stl_compare_function(&edge, link->next))
-	    {
-	      /* This is a match.  Record result in neighbors list. */
-	      match_neighbors(stl, &edge, link->next);
-	      
-	      /* Delete the matched edge from the list. */
-	      temp = link->next;
-	      link->next = link->next->next;
-	      free(temp);
-	      stl->stats.freed++;
-	      return;
-	    }
-	  else
+	  /* This is a match.  Record result in neighbors list. */
+	  match_neighbors(stl, &edge, &slots[slot]);
+	  stl->edges.entries--;
+	  stl->stats.freed++;
+
+	  /* Delete the matched edge, shifting back the entries after it
+	     that would otherwise be cut off from their home slot.  This
+	     keeps their order along the probe sequence. */
+	  for(next = (slot + 1) & mask; slots[next].facet_number != -1;
+	      next = (next + 1) & mask)
 	    {
-	      /* This is not a match.  Go to the next link */
-	      link = link->next;
-	      stl->stats.collisions++;
+	      home = stl_get_hash_for_edge(&slots[next]) & mask;
+	      if(((next - home) & mask) >= ((next - slot) & mask))
+		{
+		  slots[slot] = slots[next];
+		  slot = next;
+		}
 	    }
+	  slots[slot].facet_number = -1;
+	  return;
 	}
+      stl->stats.collisions++;
     }
+
+  /* No match.  Insert the edge in the empty slot. */
+  slots[slot] = edge;
+  stl->edges.entries++;
+  stl->stats.malloced++;
 }
 
 
-static int
-stl_get_hash_for_edge(int M, stl_hash_edge *edge)
+/* Mixes all six words of the key so that nearby coordinates spread over
+   the whole table */
+static uint64_t
+stl_get_hash_for_edge(stl_hash_edge *edge)
 {
-  return ((edge->key[0] / 23 + edge->key[1] / 19 + edge->key[2] / 17
-	   + edge->key[3] /13  + edge->key[4] / 11 + edge->key[5] / 7 ) % M);
+  uint64_t h;
+  int      i;
+
+  h = 0;
+  for(i = 0; i < 6; i++)
+    {
+      h = (h ^ edge->key[i]) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 29;
+    }
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 32;
+  return h;
 }
 
 static int
@@ -302,14 +933,49 @@ stl_compare_function(stl_hash_edge *edge_a, stl_hash_edge *edge_b)
 }
 
 void
-stl_check_facets_nearby(stl_file *stl, float tolerance)
+stl_check_facets_nearby_grid(stl_file *stl, float tolerance)
 {
-  stl_hash_edge  edge[3];
-  stl_facet      facet;
+/* This function connects the same edges as stl_check_facets_nearby(), but
+ *  compares the real distance between the ends of the edges instead of
+ *  snapping them to a grid, so ends on either side of a cell boundary
+ *  still match.  Only the open edges are looked at.  Each one is paired
+ *  with the closest open edge of another facet whose ends both lie within
+ *  tolerance of its own, and the vertices are then fixed up exactly like
+ *  the nearby check does.
+ */
+
+  stl_grid_entry *entries;
+  int            *table;
+  unsigned       mask;
+  unsigned       slot;
+  int            num_entries;
+  int            num_open;
+  int            index;
+  int            edge_number;
+  int64_t        cell[3];
+  stl_vertex     *a;
+  stl_vertex     *b;
+  stl_vertex     *c;
+  stl_vertex     *d;
+  stl_hash_edge  edge_a;
+  stl_hash_edge  edge_b;
+  float          distance;
+  float          best_distance;
+  float          cell_size;
+  int            best;
+  int            best_reversed;
+  int            reversed;
+  int            facet;
+  int            other;
+  int            e;
   int            i;
   int            j;
+  int            k;
+  int            dx;
+  int            dy;
+  int            dz;
 
-
+  stl_flush_transform(stl);
   if(   (stl->stats.connected_facets_1_edge == stl->stats.number_of_facets)
      && (stl->stats.connected_facets_2_edge == stl->stats.number_of_facets)
      && (stl->stats.connected_facets_3_edge == stl->stats.number_of_facets))
@@ -317,30 +983,270 @@ stl_check_facets_nearby(stl_file *stl, float tolerance)
       /* No need to check any further.  All facets are connected */
       return;
     }
+  /* As in stl_check_facets_nearby(), no edge is longer than a tolerance
+     of 0, so none is matched */
+  if(tolerance <= 0)
+    {
+      return;
+    }
+  /* The cells may be larger than tolerance, but no more than
+     STL_GRID_CELL_MAX of them may span the mesh, or a tiny tolerance would
+     put every vertex in the last cell */
+  cell_size = STL_MAX(stl->stats.max.x - stl->stats.min.x,
+		      stl->stats.max.y - stl->stats.min.y);
+  cell_size = STL_MAX(cell_size, stl->stats.max.z - stl->stats.min.z);
+  cell_size = STL_MAX(tolerance, cell_size / (float)(STL_GRID_CELL_MAX / 2));
+
+  /* File both ends of every open edge under the cell of side tolerance
+     it lies in */
+  num_open = stl_update_open_edges(stl);
+  entries = (stl_grid_entry*)malloc(2 * STL_MAX(num_open, 1)
+				    * sizeof(stl_grid_entry));
+  if(entries == NULL)
+    {
+      perror("stl_check_facets_nearby_grid");
+      exit(1);
+    }
+  num_entries = 0;
+  for(e = 0; e < num_open; e++)
+    {
+      i = stl->open_edges[e] / 3;
+      j = stl->open_edges[e] % 3;
+      for(k = 0; k < 2; k++)
+	{
+	  a = &stl->facet_start[i].vertex[(j + k) % 3];
+	  entries[num_entries].cell[0] =
+	    stl_grid_cell(a->x, stl->stats.min.x, cell_size);
+	  entries[num_entries].cell[1] =
+	    stl_grid_cell(a->y, stl->stats.min.y, cell_size);
+	  entries[num_entries].cell[2] =
+	    stl_grid_cell(a->z, stl->stats.min.z, cell_size);
+	  entries[num_entries].edge = 3 * i + j;
+	  num_entries++;
+	}
+    }
 
-  stl_initialize_facet_check_nearby(stl);
+  /* Sort the entries by cell and index the first entry of each cell */
+  qsort(entries, num_entries, sizeof(stl_grid_entry),
+	stl_compare_grid_entries);
+  for(mask = STL_EDGE_TABLE_MIN - 1; mask < 2 * (unsigned)num_entries;
+      mask = 2 * mask + 1);
+  table = (int*)malloc((mask + 1) * sizeof(int));
+  if(table == NULL)
+    {
+      perror("stl_check_facets_nearby_grid");
+      exit(1);
+    }
+  memset(table, -1, (mask + 1) * sizeof(int));
+  for(i = 0; i < num_entries; i++)
+    {
+      if(i > 0 && !memcmp(entries[i].cell, entries[i - 1].cell,
+			  sizeof(entries[i].cell)))
+	{
+	  continue;
+	}
+      for(slot = stl_get_hash_for_cell(entries[i].cell) & mask;
+	  table[slot] != -1; slot = (slot + 1) & mask);
+      table[slot] = i;
+    }
 
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+  index = 0;
+  edge_number = -1;
+  while(stl_next_open_edge(stl, &index, &edge_number))
     {
-      facet = stl->facet_start[i];
-      for(j = 0; j < 3; j++)
+      i = edge_number / 3;
+      j = edge_number % 3;
+      a = &stl->facet_start[i].vertex[j];
+      b = &stl->facet_start[i].vertex[(j + 1) % 3];
+      if(stl_grid_distance(a, b) <= tolerance)
 	{
-	  if(stl->neighbors_start[i].neighbor[j] == -1)
+	  /* Both ends would be matched to the same point */
+	  continue;
+	}
+
+      /* Look through the cells around the first end for the closest
+	 open edge with both ends near this edge's ends */
+      best = -1;
+      best_reversed = 0;
+      best_distance = 0;
+      for(dx = -1; dx <= 1; dx++)
+	for(dy = -1; dy <= 1; dy++)
+	  for(dz = -1; dz <= 1; dz++)
 	    {
-	      edge[j].facet_number = i;
-	      edge[j].which_edge = j;
-	      if(stl_load_edge_nearby(stl, &edge[j], &facet.vertex[j], 
-				      &facet.vertex[(j + 1) % 3],
-				      tolerance))
+	      cell[0] = stl_grid_cell(a->x, stl->stats.min.x, cell_size) + dx;
+	      cell[1] = stl_grid_cell(a->y, stl->stats.min.y, cell_size) + dy;
+	      cell[2] = stl_grid_cell(a->z, stl->stats.min.z, cell_size) + dz;
+	      for(slot = stl_get_hash_for_cell(cell) & mask;
+		  table[slot] != -1
+		    && memcmp(entries[table[slot]].cell, cell,
+			      sizeof(cell));
+		  slot = (slot + 1) & mask);
+	      if(table[slot] == -1)
 		{
-		  /* only insert edges that have different keys */
-		  insert_hash_edge(stl, edge[j], stl_match_neighbors_nearby);
+		  continue;
+		}
+	      for(k = table[slot]; k < num_entries
+		    && !memcmp(entries[k].cell, cell, sizeof(cell)); k++)
+		{
+		  e = entries[k].edge;
+		  facet = e / 3;
+		  if(facet == i
+		     || stl->neighbors_start[facet].neighbor[e % 3] != -1)
+		    {
+		      continue;
+		    }
+		  c = &stl->facet_start[facet].vertex[e % 3];
+		  d = &stl->facet_start[facet].vertex[(e + 1) % 3];
+		  /* Facets that agree on their normals run along the
+		     shared edge in opposite directions */
+		  distance = STL_MAX(stl_grid_distance(a, d),
+				     stl_grid_distance(b, c));
+		  reversed = 1;
+		  if(distance > tolerance)
+		    {
+		      distance = STL_MAX(stl_grid_distance(a, c),
+					 stl_grid_distance(b, d));
+		      reversed = 0;
+		    }
+		  if(distance > tolerance)
+		    {
+		      continue;
+		    }
+		  if(best == -1 || distance < best_distance
+		     || (distance == best_distance && e < best))
+		    {
+		      best = e;
+		      best_distance = distance;
+		      best_reversed = reversed;
+		    }
 		}
 	    }
+      if(best == -1)
+	{
+	  continue;
 	}
+
+      /* Describe the pair the way stl_load_edge_nearby() would, with
+	 matching ends first, and let the nearby check do the rest */
+      other = best / 3;
+      edge_a.facet_number = i;
+      edge_a.which_edge = j;
+      edge_b.facet_number = other;
+      edge_b.which_edge = best % 3 + (best_reversed ? 3 : 0);
+      stl_match_neighbors_nearby(stl, &edge_a, &edge_b);
     }
 
-  stl_free_edges(stl);
+  free(table);
+  free(entries);
+}
+
+static int
+stl_compare_grid_entries(const void *a, const void *b)
+{
+  const stl_grid_entry *entry_a = (const stl_grid_entry*)a;
+  const stl_grid_entry *entry_b = (const stl_grid_entry*)b;
+  int                  i;
+
+  for(i = 0; i < 3; i++)
+    {
+      if(entry_a->cell[i] != entry_b->cell[i])
+	{
+	  return entry_a->cell[i] < entry_b->cell[i] ? -1 : 1;
+	}
+    }
+  return entry_a->edge - entry_b->edge;
+}
+
+/* The cell of side cell_size that value lies in along one axis.  A tiny
+   cell_size gives indices far beyond those of an int, so they are kept in
+   an int64_t.  They are clamped to STL_GRID_CELL_MAX in case a vertex
+   isn't finite; the cells at the ends then just hold more vertices, as the
+   edges in them are still matched by their real distance. */
+static int64_t
+stl_grid_cell(float value, float min, float cell_size)
+{
+  double cell;
+
+  cell = floor((value - min) / cell_size);
+  if(!(cell > -STL_GRID_CELL_MAX))
+    {
+      return -STL_GRID_CELL_MAX;
+    }
+  if(cell > STL_GRID_CELL_MAX)
+    {
+      return STL_GRID_CELL_MAX;
+    }
+  return (int64_t)cell;
+}
+
+static unsigned
+stl_get_hash_for_cell(const int64_t *cell)
+{
+  uint64_t h;
+  int      i;
+
+  h = 0;
+  for(i = 0; i < 3; i++)
+    {
+      h = (h ^ (uint64_t)cell[i]) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 29;
+    }
+  return (unsigned)(h ^ (h >> 32));
+}
+
+static float
+stl_grid_distance(stl_vertex *a, stl_vertex *b)
+{
+  return sqrt((a->x - b->x) * (a->x - b->x) + (a->y - b->y) * (a->y - b->y)
+	      + (a->z - b->z) * (a->z - b->z));
+}
+
+void
+stl_check_facets_nearby(stl_file *stl, float tolerance)
+{
+  stl_hash_edge  edge[3];
+  stl_facet      facet;
+  int            index;
+  int            edge_number;
+  int            last_facet;
+  int            i;
+  int            j;
+
+  stl_flush_transform(stl);
+  if(   (stl->stats.connected_facets_1_edge == stl->stats.number_of_facets)
+     && (stl->stats.connected_facets_2_edge == stl->stats.number_of_facets)
+     && (stl->stats.connected_facets_3_edge == stl->stats.number_of_facets))
+    {
+      /* No need to check any further.  All facets are connected */
+      return;
+    }
+
+  stl_initialize_facet_check_nearby(stl);
+
+  index = 0;
+  edge_number = -1;
+  last_facet = -1;
+  while(stl_next_open_edge(stl, &index, &edge_number))
+    {
+      i = edge_number / 3;
+      j = edge_number % 3;
+      if(i != last_facet)
+	{
+	  /* Work on a copy so that fixing the edges of this facet doesn't
+	     move the ones still to come */
+	  facet = stl->facet_start[i];
+	  last_facet = i;
+	}
+      edge[j].facet_number = i;
+      edge[j].which_edge = j;
+      if(stl_load_edge_nearby(stl, &edge[j], &facet.vertex[j], 
+			      &facet.vertex[(j + 1) % 3],
+			      tolerance))
+	{
+	  /* only insert edges that have different keys */
+	  insert_hash_edge(stl, edge[j], stl_match_neighbors_nearby);
+	}
+    }
 }
 
 static int
@@ -422,55 +1328,118 @@ stl_load_edge_nearby(stl_file *stl, stl_hash_edge *edge,
 }
 
 static void
-stl_free_edges(stl_file *stl)
+stl_initialize_facet_check_nearby(stl_file *stl)
 {
+  /*  tolerance = STL_MAX(stl->stats.shortest_edge, tolerance);*/
+  /*  tolerance = STL_MAX((stl->stats.bounding_diameter / 500000.0), tolerance);*/
+  /*  tolerance *= 0.5;*/
+
+  /* Only the edges without a neighbor go into the table */
+  stl_initialize_edges(stl, stl_update_open_edges(stl));
+}
+
+void
+stl_invalidate_open_edges(stl_file *stl)
+{
+  /* The allocation is kept for the next rebuild */
+  stl->num_open_edges = -1;
+}
+
+/* Brings stl->open_edges up to date and returns the number of open edges.
+   The list is rebuilt by scanning all facets only after something
+   invalidated it, like the exact check or removing a facet.  Otherwise
+   the edges that got a neighbor since the last call are just dropped, so
+   the nearby iterations cost as much as the edges that are still open.
+   The edges stay in the order of a scan over the facets either way. */
+static int
+stl_update_open_edges(stl_file *stl)
+{
+  int count;
+  int edge;
   int i;
-  stl_hash_edge *temp;
-  
-  if(stl->stats.malloced != stl->stats.freed)
+  int j;
+
+  if(stl->num_open_edges != -1)
     {
-      for(i = 0; i < stl->M; i++)
+      count = 0;
+      for(i = 0; i < stl->num_open_edges; i++)
 	{
-	  for(temp = stl->heads[i]; stl->heads[i] != stl->tail;
-	      temp = stl->heads[i])
+	  edge = stl->open_edges[i];
+	  if(stl->neighbors_start[edge / 3].neighbor[edge % 3] == -1)
 	    {
-	      stl->heads[i] = stl->heads[i]->next;
-	      free(temp);
-	      stl->stats.freed++;
+	      stl->open_edges[count++] = edge;
 	    }
 	}
+      stl->num_open_edges = count;
+      return count;
     }
-  free(stl->heads);
-  free(stl->tail);
-}
-	      
-static void
-stl_initialize_facet_check_nearby(stl_file *stl)
-{
-  int i;
-
-  stl->stats.malloced = 0;
-  stl->stats.freed = 0;
-  stl->stats.collisions = 0;
-
-  /*  tolerance = STL_MAX(stl->stats.shortest_edge, tolerance);*/
-  /*  tolerance = STL_MAX((stl->stats.bounding_diameter / 500000.0), tolerance);*/
-  /*  tolerance *= 0.5;*/
-
-  stl->M = 81397;
 
-  stl->heads = (stl_hash_edge**)calloc(stl->M, sizeof(*stl->heads));
-  if(stl->heads == NULL) perror("stl_initialize_facet_check_nearby");
+  count = 0;
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      count += ((stl->neighbors_start[i].neighbor[0] == -1) +
+		(stl->neighbors_start[i].neighbor[1] == -1) +
+		(stl->neighbors_start[i].neighbor[2] == -1));
+    }
+  if(stl->open_edges != NULL)
+    {
+      free(stl->open_edges);
+    }
+  stl->open_edges = (int*)malloc(STL_MAX(count, 1) * sizeof(int));
+  if(stl->open_edges == NULL)
+    {
+      perror("stl_update_open_edges");
+      exit(1);
+    }
+  count = 0;
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      for(j = 0; j < 3; j++)
+	{
+	  if(stl->neighbors_start[i].neighbor[j] == -1)
+	    {
+	      stl->open_edges[count++] = 3 * i + j;
+	    }
+	}
+    }
+  stl->num_open_edges = count;
+  return count;
+}
 
-  stl->tail = (stl_hash_edge*)malloc(sizeof(stl_hash_edge));
-  if(stl->tail == NULL) perror("stl_initialize_facet_check_nearby");
+/* Steps *edge (3 * facet + edge) to the next edge that is still open and
+   returns 0 when there is none left.  Start with *index = 0 and
+   *edge = -1 after stl_update_open_edges().  The list is walked while it
+   stays valid.  If a facet gets removed on the way, the walk goes on with
+   a plain scan over the facets after *edge, just like a loop over all
+   facets would. */
+static int
+stl_next_open_edge(stl_file *stl, int *index, int *edge)
+{
+  int e;
 
-  stl->tail->next = stl->tail;
+  if(stl->num_open_edges != -1)
+    {
+      while(*index < stl->num_open_edges)
+	{
+	  e = stl->open_edges[(*index)++];
+	  if(stl->neighbors_start[e / 3].neighbor[e % 3] == -1)
+	    {
+	      *edge = e;
+	      return 1;
+	    }
+	}
+      return 0;
+    }
 
-  for(i = 0; i < stl->M; i++)
+  for(e = *edge + 1; e < 3 * stl->stats.number_of_facets; e++)
     {
-      stl->heads[i] = stl->tail;
+      if(stl->neighbors_start[e / 3].neighbor[e % 3] == -1)
+	{
+	  *edge = e;
+	  return 1;
+	}
     }
+  return 0;
 }
 
 
@@ -482,6 +1451,8 @@ stl_record_neighbors(stl_file *stl,
   int i;
   int j;
 
+  stl_invalidate_parts(stl);
+
   /* Facet a's neighbor is facet b */
   stl->neighbors_start[edge_a->facet_number].neighbor[edge_a->which_edge % 3] =
     edge_b->facet_number;	/* sets the .neighbor part */
@@ -614,6 +1585,9 @@ stl_change_vertices(stl_file *stl, int facet_num, int vnot,
   int next_edge;
   int pivot_vertex;
 
+  /* The welded vertices no longer match the facets */
+  stl_invalidate_shared_vertices(stl);
+
   first_facet = facet_num;
   direction = 0;
 
@@ -659,7 +1633,7 @@ stl_change_vertices(stl_file *stl, int facet_num, int vnot,
       if(facet_num == first_facet)
 	{
 	  /* back to the beginning */
-	  printf("\
+	  fprintf(stderr, "\
 Back to the first facet changing vertices: probably a mobius part.\n\
 Try using a smaller tolerance or don't do a nearby check\n");
 	  return;
@@ -766,6 +1740,9 @@ stl_remove_facet(stl_file *stl, int facet_number)
   int j;
 
   stl->stats.facets_removed += 1;
+  /* The last facet moves into this one's place */
+  stl_invalidate_open_edges(stl);
+  stl_invalidate_parts(stl);
   /* Update list of connected edges */
   j = ((stl->neighbors_start[facet_number].neighbor[0] == -1) +
        (stl->neighbors_start[facet_number].neighbor[1] == -1) +
@@ -791,6 +1768,11 @@ stl_remove_facet(stl_file *stl, int facet_number)
   /* I could reallocate at this point, but it is not really necessary. */
   stl->neighbors_start[facet_number] =
     stl->neighbors_start[stl->stats.number_of_facets - 1];
+  if(stl->v_indices != NULL)
+    {
+      stl->v_indices[facet_number] =
+	stl->v_indices[stl->stats.number_of_facets - 1];
+    }
   stl->stats.number_of_facets -= 1;
   
   for(i = 0; i < 3; i++)
@@ -806,7 +1788,7 @@ stl_remove_facet(stl_file *stl, int facet_number)
 	  if(stl->neighbors_start[neighbor[i]].neighbor[(vnot[i] + 1)% 3] != 
 	     stl->stats.number_of_facets) 
 	    {
-	      printf("\
+	      fprintf(stderr, "\
 in stl_remove_facet: neighbor = %d numfacets = %d this is wrong\n",
 		  stl->neighbors_start[neighbor[i]].neighbor[(vnot[i] + 1)% 3],
 		     stl->stats.number_of_facets);
@@ -829,6 +1811,8 @@ stl_remove_unconnected_facets(stl_file *stl)
 
   int i;
   
+  stl_flush_transform(stl);
+
   /* remove degenerate facets */
   for(i = 0; i < stl->stats.number_of_facets; i++)
     {
@@ -881,7 +1865,7 @@ stl_remove_degenerate(stl_file *stl, int facet)
     {
       /* all 3 vertices are equal.  Just remove the facet.  I don't think*/
       /* this is really possible, but just in case... */
-      printf("removing a facet in stl_remove_degenerate\n");
+      fprintf(stderr, "removing a facet in stl_remove_degenerate\n");
 
       stl_remove_facet(stl, facet);
       return;
@@ -986,6 +1970,8 @@ stl_fill_holes(stl_file *stl)
   int j;
   int k;
 
+  stl_flush_transform(stl);
+
   /* Insert all unconnected edges into hash list */
   stl_initialize_facet_check_nearby(stl);
   for(i = 0; i < stl->stats.number_of_facets; i++)
@@ -1086,7 +2072,7 @@ stl_fill_holes(stl_file *stl)
 	      if(facet_num == first_facet)
 		{
 		  /* back to the beginning */
-		  printf("\
+		  fprintf(stderr, "\
 Back to the first facet filling holes: probably a mobius part.\n\
 Try using a smaller tolerance or don't do a nearby check\n");
                   return;
@@ -1121,4 +2107,9 @@ stl_add_facet(stl_file *stl, stl_facet *new_facet)
   stl->neighbors_start[stl->stats.number_of_facets].neighbor[1] = -1;
   stl->neighbors_start[stl->stats.number_of_facets].neighbor[2] = -1;
   stl->stats.number_of_facets += 1;
+
+  /* The new facet has no shared vertices */
+  stl_invalidate_shared_vertices(stl);
+  stl_invalidate_open_edges(stl);
+  stl_invalidate_parts(stl);
 }
@@ -27,21 +27,74 @@
 
 #include "stl.h"
 
+/* The normals of four facets at a time are found with AVX2 when the
+   processor has it */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STL_NORMALS_AVX2
+#include <immintrin.h>
+#endif
+
+/* Facets of the shells that one task of stl_fix_normal_directions()
+   orients, at least */
+#define STL_ORIENT_TASK_FACETS 4096
+
+/* State shared by the threads of stl_fix_normal_directions().  Runs of
+   whole shells are handed out as tasks. */
+typedef struct
+{
+  stl_file *stl;
+  char     *norm_sw;		/* one flag per facet, set once it is fixed */
+  int      *stack;		/* three entries per facet */
+  int      *seeds;		/* lowest facet of each shell */
+  int      *offsets;		/* start of each shell's part of stack */
+  int      *reversed;		/* facets reversed in each shell */
+  int      *open_changed;	/* per shell */
+  int      *tasks;		/* first shell of each task, and the end */
+  int      num_shells;
+  int      num_tasks;
+}stl_orient_job;
+
 static void stl_reverse_facet(stl_file *stl, int facet_num);
+static int stl_flip_facet(stl_file *stl, int facet_num);
+static int stl_orient_shell(stl_file *stl, int seed, char *norm_sw,
+			    int *stack, int *open_changed);
+static int stl_find_shells(stl_file *stl, stl_orient_job *job);
+static void stl_orient_shells_task(void *arg, int task);
 /* static float stl_calculate_area(stl_facet *facet); */
 static void stl_reverse_vector(float v[]);
 int stl_check_normal_vector(stl_file *stl, int facet_num, int normal_fix_flag);
+static int stl_check_calculated_normal(stl_file *stl, int facet_num,
+				       float normal[], int normal_fix_flag);
+static void stl_calculate_normals_scalar(float *normals, stl_facet *facets,
+					 int count);
+#ifdef STL_NORMALS_AVX2
+static void stl_calculate_normals_avx2(float *normals, stl_facet *facets,
+				       int count);
+#endif
 
 static void
 stl_reverse_facet(stl_file *stl, int facet_num)
+{
+  stl->stats.facets_reversed += 1;
+  if(stl_flip_facet(stl, facet_num))
+    {
+      /* An open edge changes its number */
+      stl_invalidate_open_edges(stl);
+    }
+}
+
+/* Reverses a facet without counting it.  Only the facet and its neighbors
+   are written to.  Returns 1 if an open edge of the facet changed its
+   number, which invalidates the open edge list. */
+static int
+stl_flip_facet(stl_file *stl, int facet_num)
 {
   stl_vertex tmp_vertex;
+  int tmp_index;
   /*  int tmp_neighbor;*/
   int neighbor[3];
   int vnot[3];
 
-  stl->stats.facets_reversed += 1;
-  
   neighbor[0] = stl->neighbors_start[facet_num].neighbor[0];
   neighbor[1] = stl->neighbors_start[facet_num].neighbor[1];
   neighbor[2] = stl->neighbors_start[facet_num].neighbor[2];
@@ -54,6 +107,12 @@ stl_reverse_facet(stl_file *stl, int facet_num)
   stl->facet_start[facet_num].vertex[0] = 
     stl->facet_start[facet_num].vertex[1];
   stl->facet_start[facet_num].vertex[1] = tmp_vertex;
+  if(stl->v_indices != NULL)
+    {
+      tmp_index = stl->v_indices[facet_num].vertex[0];
+      stl->v_indices[facet_num].vertex[0] = stl->v_indices[facet_num].vertex[1];
+      stl->v_indices[facet_num].vertex[1] = tmp_index;
+    }
 
   /* fix the vnots of the neighboring facets */
   if(neighbor[0] != -1)
@@ -84,131 +143,241 @@ stl_reverse_facet(stl_file *stl, int facet_num)
     (stl->neighbors_start[facet_num].which_vertex_not[1] + 3) % 6;
   stl->neighbors_start[facet_num].which_vertex_not[2] =
     (stl->neighbors_start[facet_num].which_vertex_not[2] + 3) % 6;
+
+  return (neighbor[1] == -1) != (neighbor[2] == -1);
 }
 
-void
-stl_fix_normal_directions(stl_file *stl)
+/* Orients the facets that can be reached from seed, which hasn't been
+   looked at yet, the same way as seed.  A facet is only pushed while one
+   of its neighbors is visited for the first time, so stack needs room for
+   three entries per facet of the shell.  Returns the number of facets
+   reversed and sets *open_changed if an open edge changed its number. */
+static int
+stl_orient_shell(stl_file *stl, int seed, char *norm_sw, int *stack,
+		 int *open_changed)
 {
-  char *norm_sw;
-  /*  int edge_num;*/
-  /*  int vnot;*/
-  int checked = 0;
+  int top;
+  int reversed;
   int facet_num;
-  /*  int next_facet;*/
-  int i;
+  int neighbor;
   int j;
-  struct stl_normal
-  {
-    int               facet_num;
-    struct stl_normal *next;
-  };
-  struct stl_normal *head;
-  struct stl_normal *tail;
-  struct stl_normal *newn;
-  struct stl_normal *temp;
-  
-  
-  /* Initialize linked list. */
-  head = (struct stl_normal*)malloc(sizeof(struct stl_normal));
-  if(head == NULL) perror("stl_fix_normal_directions");
-  tail = (struct stl_normal*)malloc(sizeof(struct stl_normal));
-  if(tail == NULL) perror("stl_fix_normal_directions");
-  head->next = tail;
-  tail->next = tail;
 
-  /* Initialize list that keeps track of already fixed facets. */
-  norm_sw = (char*)calloc(stl->stats.number_of_facets, sizeof(char));
-  if(norm_sw == NULL) perror("stl_fix_normal_directions");
-  
-
-  facet_num = 0;
+  top = 0;
+  reversed = 0;
+  facet_num = seed;
   /* If normal vector is not within tolerance and backwards:
-     Arbitrarily starts at face 0.  If this one is wrong, we're screwed.  Thankfully, the chances
+     Arbitrarily starts at the seed.  If this one is wrong, we're screwed.  Thankfully, the chances
      of it being wrong randomly are low if most of the triangles are right: */
-  if(stl_check_normal_vector(stl, 0, 0) == 2)
-    stl_reverse_facet(stl, 0);
-     
+  if(stl_check_normal_vector(stl, seed, 0) == 2)
+    {
+      *open_changed |= stl_flip_facet(stl, seed);
+      reversed++;
+    }
   /* Say that we've fixed this facet: */
-  norm_sw[facet_num] = 1;
-  checked++;
+  norm_sw[seed] = 1;
 
   for(;;)
     {
-      /* Add neighbors_to_list.
-         Add unconnected neighbors to the list:a  */
+      /* Add unconnected neighbors to the stack */
       for(j = 0; j < 3; j++)
 	{
+	  neighbor = stl->neighbors_start[facet_num].neighbor[j];
+	  /* If the facet has a neighbor that is -1, it means that edge isn't shared by another facet */
+	  if(neighbor == -1)
+	    {
+	      continue;
+	    }
 	  /* Reverse the neighboring facets if necessary. */
 	  if(stl->neighbors_start[facet_num].which_vertex_not[j] > 2)
 	    {
-	    /* If the facet has a neighbor that is -1, it means that edge isn't shared by another facet */
-	      if(stl->neighbors_start[facet_num].neighbor[j] != -1)
-		{
-		  stl_reverse_facet
-		    (stl, stl->neighbors_start[facet_num].neighbor[j]);
-		}
+	      *open_changed |= stl_flip_facet(stl, neighbor);
+	      reversed++;
 	    }
-    /* If this edge of the facet is connected: */
-	  if(stl->neighbors_start[facet_num].neighbor[j] != -1)
+	  /* If we haven't fixed this facet yet, add it to the stack: */
+	  if(norm_sw[neighbor] != 1)
 	    {
-        /* If we haven't fixed this facet yet, add it to the list: */
-	      if(norm_sw[stl->neighbors_start[facet_num].neighbor[j]] != 1)
-		{
-		  /* Add node to beginning of list. */
-		  newn = (struct stl_normal*)malloc(sizeof(struct stl_normal));
-		  if(newn == NULL) perror("stl_fix_normal_directions");
-		  newn->facet_num = stl->neighbors_start[facet_num].neighbor[j];
-		  newn->next = head->next;
-		  head->next = newn;
-		}
+	      stack[top++] = neighbor;
 	    }
 	}
-      /* Get next facet to fix from top of list. */
-      if(head->next != tail)
+      /* All of the facets in this part have been fixed. */
+      if(top == 0)
+	{
+	  return reversed;
+	}
+      /* Get next facet to fix from top of stack.  It may be there more
+	 than once and then is looked at again, as it always was. */
+      facet_num = stack[--top];
+      norm_sw[facet_num] = 1;
+    }
+}
+
+/* Finds the shells of the stl, the groups of facets that stl_orient_shell()
+   visits from the lowest unvisited facet on.  These are the parts that
+   stl_label_parts() finds, as long as every neighbor names the facet
+   back.  Returns 0 if one doesn't, as a shell could then not get around
+   the whole of its part. */
+static int
+stl_find_shells(stl_file *stl, stl_orient_job *job)
+{
+  stl_neighbors *neighbors;
+  int           neighbor;
+  int           offset;
+  int           size;
+  int           part;
+  int           i;
+  int           j;
+
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      for(j = 0; j < 3; j++)
 	{
-	  facet_num = head->next->facet_num;	  
-	  if(norm_sw[facet_num] != 1) /* If facet is in list mutiple times */
+	  neighbor = stl->neighbors_start[i].neighbor[j];
+	  if(neighbor == -1)
+	    {
+	      continue;
+	    }
+	  neighbors = &stl->neighbors_start[neighbor];
+	  if(   neighbors->neighbor[0] != i && neighbors->neighbor[1] != i
+	     && neighbors->neighbor[2] != i)
 	    {
-	      norm_sw[facet_num] = 1; /* Record this one as being fixed. */
-	      checked++;
+	      return 0;
 	    }
-	  temp = head->next;	/* Delete this facet from the list. */
-	  head->next = head->next->next;
-	  free(temp);
 	}
-      else  /* if we ran out of facets to fix: */
+    }
+
+  stl_label_parts(stl);
+  job->num_shells = stl->stats.number_of_parts;
+  /* Count the facets of each part into offsets first */
+  for(part = 0; part < job->num_shells; part++)
+    {
+      job->offsets[part] = 0;
+    }
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      part = stl->part_ids[i];
+      if(job->offsets[part] == 0)
+	{
+	  job->seeds[part] = i;
+	}
+      job->offsets[part]++;
+    }
+
+  job->num_tasks = 0;
+  offset = 0;
+  for(part = 0; part < job->num_shells; part++)
+    {
+      if(offset >= 3 * STL_ORIENT_TASK_FACETS * job->num_tasks)
+	{
+	  job->tasks[job->num_tasks++] = part;
+	}
+      size = job->offsets[part];
+      job->offsets[part] = offset;
+      offset += 3 * size;
+    }
+  job->tasks[job->num_tasks] = job->num_shells;
+  return 1;
+}
+
+static void
+stl_orient_shells_task(void *arg, int task)
+{
+  stl_orient_job *job = (stl_orient_job*)arg;
+  int            shell;
+
+  for(shell = job->tasks[task]; shell < job->tasks[task + 1]; shell++)
+    {
+      job->reversed[shell] =
+	stl_orient_shell(job->stl, job->seeds[shell], job->norm_sw,
+			 &job->stack[job->offsets[shell]],
+			 &job->open_changed[shell]);
+    }
+}
+
+void
+stl_fix_normal_directions(stl_file *stl)
+{
+  stl_orient_job job;
+  int            open_changed;
+  int            num_parts;
+  int            next;
+  int            i;
+
+  stl_flush_transform(stl);
+  if(stl->stats.number_of_facets == 0)
+    {
+      return;
+    }
+
+  /* Initialize list that keeps track of already fixed facets. */
+  job.stl = stl;
+  job.norm_sw = (char*)calloc(stl->stats.number_of_facets, sizeof(char));
+  job.stack = (int*)malloc(3 * stl->stats.number_of_facets * sizeof(int));
+  if(job.norm_sw == NULL || job.stack == NULL)
+    {
+      perror("stl_fix_normal_directions");
+      exit(1);
+    }
+
+  open_changed = 0;
+  num_parts = 0;
+  if(stl_get_threads() > 1)
+    {
+      job.seeds = (int*)malloc(stl->stats.number_of_facets * sizeof(int));
+      job.offsets = (int*)malloc(stl->stats.number_of_facets * sizeof(int));
+      job.tasks = (int*)malloc((stl->stats.number_of_facets + 1)
+			       * sizeof(int));
+      if(job.seeds == NULL || job.offsets == NULL || job.tasks == NULL)
+	{
+	  perror("stl_fix_normal_directions");
+	  exit(1);
+	}
+      if(stl_find_shells(stl, &job) && job.num_tasks > 1)
 	{
-	  /* All of the facets in this part have been fixed. */
-	  stl->stats.number_of_parts += 1;
-	  if(checked >= stl->stats.number_of_facets)
+	  /* Each shell is oriented on its own, just as it would be in turn */
+	  job.reversed = (int*)malloc(job.num_shells * sizeof(int));
+	  job.open_changed = (int*)calloc(job.num_shells, sizeof(int));
+	  if(job.reversed == NULL || job.open_changed == NULL)
 	    {
-	      /* All of the facets have been checked.  Bail out. */
-	      break;
+	      perror("stl_fix_normal_directions");
+	      exit(1);
 	    }
-	  else
+	  stl_parallel_run(job.num_tasks, stl_orient_shells_task, &job);
+	  for(i = 0; i < job.num_shells; i++)
 	    {
-	      /* There is another part here.  Find it and continue. */
-	      for(i = 0; i < stl->stats.number_of_facets; i++)
-		{
-		  if(norm_sw[i] == 0)
-		    {	  /* This is the first facet of the next part. */
-		      facet_num = i;
-		      if(stl_check_normal_vector(stl, i, 0) == 2)
-			{
-			  stl_reverse_facet(stl, i);
-			}
-		      
-		      norm_sw[facet_num] = 1;
-		      checked++;
-		      break;
-		    }
-		}
+	      stl->stats.facets_reversed += job.reversed[i];
+	      open_changed |= job.open_changed[i];
 	    }
+	  num_parts = job.num_shells;
+	  free(job.reversed);
+	  free(job.open_changed);
+	  /* Marks every facet as oriented, so the loop below finds none */
+	  memset(job.norm_sw, 1, stl->stats.number_of_facets);
 	}
+      free(job.seeds);
+      free(job.offsets);
+      free(job.tasks);
+    }
+
+  /* The next part starts at the first facet not fixed yet.  Facets are
+     never unmarked, so the search goes on from where it stopped. */
+  for(next = 0; next < stl->stats.number_of_facets; next++)
+    {
+      if(job.norm_sw[next] == 0)
+	{
+	  stl->stats.facets_reversed +=
+	    stl_orient_shell(stl, next, job.norm_sw, job.stack, &open_changed);
+	  num_parts++;
+	}
+    }
+  stl->stats.number_of_parts = num_parts;
+
+  if(open_changed)
+    {
+      /* An open edge changed its number */
+      stl_invalidate_open_edges(stl);
     }
-  free(head);
-  free(tail);
-  free(norm_sw);
+  free(job.norm_sw);
+  free(job.stack);
 }
 
 int
@@ -220,14 +389,23 @@ stl_check_normal_vector(stl_file *stl, int facet_num, int normal_fix_flag)
   /* Returns 4 if the status is unknown. */
   
   float normal[3];
+
+  stl_calculate_normal(normal, &stl->facet_start[facet_num]);
+  stl_normalize_vector(normal);
+  return stl_check_calculated_normal(stl, facet_num, normal, normal_fix_flag);
+}
+
+/* Does the work of stl_check_normal_vector() with the normal that the
+   vertices of the facet give already found */
+static int
+stl_check_calculated_normal(stl_file *stl, int facet_num, float normal[],
+			    int normal_fix_flag)
+{
   float test_norm[3];
   stl_facet *facet;
 
   facet = &stl->facet_start[facet_num];
 
-  stl_calculate_normal(normal, facet);
-  stl_normalize_vector(normal);
-  
   if(   (ABS(normal[0] - facet->normal.x) < 0.001)
      && (ABS(normal[1] - facet->normal.y) < 0.001)
      && (ABS(normal[2] - facet->normal.z) < 0.001))
@@ -332,31 +510,162 @@ void stl_normalize_vector(float v[])
   v[2] *= factor;
 }
 
+/* Puts the normalized normals of count facets from facets into normals,
+   three floats each.  They are the same, bit for bit, as
+   stl_calculate_normal() followed by stl_normalize_vector() gives. */
+void
+stl_calculate_normals(float *normals, stl_facet *facets, int count)
+{
+#ifdef STL_NORMALS_AVX2
+  if(__builtin_cpu_supports("avx2"))
+    {
+      stl_calculate_normals_avx2(normals, facets, count);
+      return;
+    }
+#endif
+  stl_calculate_normals_scalar(normals, facets, count);
+}
+
+static void
+stl_calculate_normals_scalar(float *normals, stl_facet *facets, int count)
+{
+  int i;
+
+  for(i = 0; i < count; i++)
+    {
+      stl_calculate_normal(&normals[3 * i], &facets[i]);
+      stl_normalize_vector(&normals[3 * i]);
+    }
+}
+
+#ifdef STL_NORMALS_AVX2
+/* Loads one coordinate of four facets that follow each other */
+#define STL_GATHER(FIELD)						\
+  _mm_i32gather_ps(&facets[i].FIELD, offsets, 1)
+
+/* The double cast of the first product in stl_calculate_normal() is
+   undone by rounding it to float, which AVX2 can only do after the
+   subtraction is in double too.  FMA isn't enabled, so none of the
+   operations are fused and every rounding happens as in the scalar
+   code. */
+__attribute__((target("avx2")))
+static void
+stl_calculate_normals_avx2(float *normals, stl_facet *facets, int count)
+{
+  __m128i offsets;
+  __m128  x0, y0, z0;
+  __m128  v1[3];
+  __m128  v2[3];
+  __m128  normal[3];
+  __m256d first;
+  __m256d second;
+  __m256d n[3];
+  __m256d length;
+  __m256d factor;
+  __m256d too_short;
+  __m256d min_normal_length;
+  float   out[3][4];
+  int     i;
+  int     j;
+  int     k;
+
+  offsets = _mm_setr_epi32(0, sizeof(stl_facet), 2 * sizeof(stl_facet),
+			   3 * sizeof(stl_facet));
+  min_normal_length = _mm256_set1_pd((float)0.000000000001);
+  for(i = 0; i + 4 <= count; i += 4)
+    {
+      x0 = STL_GATHER(vertex[0].x);
+      y0 = STL_GATHER(vertex[0].y);
+      z0 = STL_GATHER(vertex[0].z);
+      v1[0] = _mm_sub_ps(STL_GATHER(vertex[1].x), x0);
+      v1[1] = _mm_sub_ps(STL_GATHER(vertex[1].y), y0);
+      v1[2] = _mm_sub_ps(STL_GATHER(vertex[1].z), z0);
+      v2[0] = _mm_sub_ps(STL_GATHER(vertex[2].x), x0);
+      v2[1] = _mm_sub_ps(STL_GATHER(vertex[2].y), y0);
+      v2[2] = _mm_sub_ps(STL_GATHER(vertex[2].z), z0);
+
+      for(j = 0; j < 3; j++)
+	{
+	  first = _mm256_mul_pd(_mm256_cvtps_pd(v1[(j + 1) % 3]),
+				_mm256_cvtps_pd(v2[(j + 2) % 3]));
+	  first = _mm256_cvtps_pd(_mm256_cvtpd_ps(first));
+	  second = _mm256_mul_pd(_mm256_cvtps_pd(v1[(j + 2) % 3]),
+				 _mm256_cvtps_pd(v2[(j + 1) % 3]));
+	  normal[j] = _mm256_cvtpd_ps(_mm256_sub_pd(first, second));
+	  n[j] = _mm256_cvtps_pd(normal[j]);
+	}
+
+      length = _mm256_sqrt_pd(
+	_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(n[0], n[0]),
+				    _mm256_mul_pd(n[1], n[1])),
+		      _mm256_mul_pd(n[2], n[2])));
+      too_short = _mm256_cmp_pd(length, min_normal_length, _CMP_LT_OQ);
+      factor = _mm256_div_pd(_mm256_set1_pd(1.0), length);
+      for(j = 0; j < 3; j++)
+	{
+	  _mm_storeu_ps(out[j], _mm256_cvtpd_ps(
+	    _mm256_andnot_pd(too_short, _mm256_mul_pd(n[j], factor))));
+	}
+      for(k = 0; k < 4; k++)
+	{
+	  for(j = 0; j < 3; j++)
+	    {
+	      normals[3 * (i + k) + j] = out[j][k];
+	    }
+	}
+    }
+  stl_calculate_normals_scalar(&normals[3 * i], &facets[i], count - i);
+}
+#undef STL_GATHER
+#endif
+
 void
 stl_fix_normal_values(stl_file *stl)
 {
+  float normals[3 * STL_NORMAL_BLOCK_FACETS];
+  int first;
+  int count;
   int i;
   
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+  stl_flush_transform(stl);
+  for(first = 0; first < stl->stats.number_of_facets;
+      first += STL_NORMAL_BLOCK_FACETS)
     {
-      stl_check_normal_vector(stl, i, 1);
+      count = STL_MIN(STL_NORMAL_BLOCK_FACETS,
+		      stl->stats.number_of_facets - first);
+      stl_calculate_normals(normals, &stl->facet_start[first], count);
+      for(i = 0; i < count; i++)
+	{
+	  stl_check_calculated_normal(stl, first + i, &normals[3 * i], 1);
+	}
     }
 }
 
 void
 stl_reverse_all_facets(stl_file *stl)
 {
+  float normals[3 * STL_NORMAL_BLOCK_FACETS];
+  int first;
+  int count;
   int i;
-  float normal[3];
   
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+  stl_flush_transform(stl);
+  for(first = 0; first < stl->stats.number_of_facets;
+      first += STL_NORMAL_BLOCK_FACETS)
     {
-      stl_reverse_facet(stl, i);
-      stl_calculate_normal(normal, &stl->facet_start[i]);
-      stl_normalize_vector(normal);
-      stl->facet_start[i].normal.x = normal[0];
-      stl->facet_start[i].normal.y = normal[1];
-      stl->facet_start[i].normal.z = normal[2];
+      count = STL_MIN(STL_NORMAL_BLOCK_FACETS,
+		      stl->stats.number_of_facets - first);
+      for(i = first; i < first + count; i++)
+	{
+	  stl_reverse_facet(stl, i);
+	}
+      stl_calculate_normals(normals, &stl->facet_start[first], count);
+      for(i = 0; i < count; i++)
+	{
+	  stl->facet_start[first + i].normal.x = normals[3 * i];
+	  stl->facet_start[first + i].normal.y = normals[3 * i + 1];
+	  stl->facet_start[first + i].normal.z = normals[3 * i + 2];
+	}
     }
 }
 
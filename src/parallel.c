@@ -0,0 +1,147 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *  
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/hroncok/admesh/issues
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stl.h"
+#include "config.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+/* Number of threads the library may use.  The default of 1 keeps
+   everything on the calling thread. */
+static int stl_threads = 1;
+
+void
+stl_set_threads(int threads)
+{
+  if(threads <= 0)
+    {
+      /* Use all of the processors */
+      threads = 1;
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+      threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      if(threads <= 0) threads = 1;
+#endif
+    }
+#ifndef HAVE_PTHREAD
+  threads = 1;
+#endif
+  stl_threads = threads;
+}
+
+int
+stl_get_threads(void)
+{
+  return stl_threads;
+}
+
+#ifdef HAVE_PTHREAD
+typedef struct
+{
+  void            (*func)(void *arg, int task);
+  void            *arg;
+  int             tasks;
+  int             next_task;
+  pthread_mutex_t lock;
+} stl_parallel_job;
+
+static void *
+stl_parallel_worker(void *data)
+{
+  stl_parallel_job *job = (stl_parallel_job*)data;
+  int task;
+
+  for(;;)
+    {
+      pthread_mutex_lock(&job->lock);
+      task = job->next_task++;
+      pthread_mutex_unlock(&job->lock);
+      if(task >= job->tasks)
+	{
+	  break;
+	}
+      job->func(job->arg, task);
+    }
+  return NULL;
+}
+#endif
+
+/* Calls func(arg, task) for every task in 0 .. tasks - 1, spread over up
+   to stl_get_threads() threads.  The calling thread takes part and the
+   function returns once all of the tasks are done.  Tasks are handed out
+   in order, but may finish in any order. */
+void
+stl_parallel_run(int tasks, void (*func)(void *arg, int task), void *arg)
+{
+  int i;
+#ifdef HAVE_PTHREAD
+  stl_parallel_job job;
+  pthread_t        *threads;
+  int              num_threads;
+  int              started;
+
+  num_threads = STL_MIN(stl_threads, tasks);
+  if(num_threads > 1)
+    {
+      threads = (pthread_t*)malloc((num_threads - 1) * sizeof(pthread_t));
+      if(threads != NULL)
+	{
+	  job.func = func;
+	  job.arg = arg;
+	  job.tasks = tasks;
+	  job.next_task = 0;
+	  pthread_mutex_init(&job.lock, NULL);
+
+	  /* If a thread can't be started the others just do more tasks */
+	  for(started = 0; started < num_threads - 1; started++)
+	    {
+	      if(pthread_create(&threads[started], NULL,
+				stl_parallel_worker, &job) != 0)
+		{
+		  break;
+		}
+	    }
+	  stl_parallel_worker(&job);
+	  for(i = 0; i < started; i++)
+	    {
+	      pthread_join(threads[i], NULL);
+	    }
+
+	  pthread_mutex_destroy(&job.lock);
+	  free(threads);
+	  return;
+	}
+    }
+#endif
+
+  for(i = 0; i < tasks; i++)
+    {
+      func(arg, i);
+    }
+}
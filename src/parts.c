@@ -0,0 +1,307 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/hroncok/admesh/issues
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "stl.h"
+
+/* Smallest block of facets that one task of stl_label_parts() joins */
+#define STL_PARTS_BLOCK_FACETS 65536
+
+/* State shared by the threads of stl_label_parts().  Each facet starts
+   out as a set of its own, and parent leads from a facet towards the
+   lowest facet of its set. */
+typedef struct
+{
+  stl_file *stl;
+  int      *parent;
+  int      *cross;		/* edges to other blocks, 3 * facet + edge */
+  int      *num_cross;		/* such edges found in each block */
+  int      block_size;
+}stl_parts_job;
+
+static int stl_find_part(int *parent, int facet);
+static void stl_join_parts(int *parent, int a, int b);
+static void stl_join_block(void *arg, int block);
+static void stl_find_roots_block(void *arg, int block);
+
+/* Returns the lowest facet of the set of facet, halving the path to it */
+static int
+stl_find_part(int *parent, int facet)
+{
+  while(parent[facet] != facet)
+    {
+      parent[facet] = parent[parent[facet]];
+      facet = parent[facet];
+    }
+  return facet;
+}
+
+static void
+stl_join_parts(int *parent, int a, int b)
+{
+  a = stl_find_part(parent, a);
+  b = stl_find_part(parent, b);
+  if(a < b)
+    {
+      parent[b] = a;
+    }
+  else
+    {
+      parent[a] = b;
+    }
+}
+
+/* Joins the facets of a block that are neighbors, and saves the edges that
+   lead out of the block for later.  Sets only ever grow within a block
+   here, so the path halving doesn't touch the other blocks. */
+static void
+stl_join_block(void *arg, int block)
+{
+  stl_parts_job *job = (stl_parts_job*)arg;
+  int           first;
+  int           last;
+  int           neighbor;
+  int           *cross;
+  int           num_cross;
+  int           i;
+  int           j;
+
+  first = block * job->block_size;
+  last = STL_MIN(first + job->block_size, job->stl->stats.number_of_facets);
+  cross = job->cross + 3 * first;
+  num_cross = 0;
+  for(i = first; i < last; i++)
+    {
+      job->parent[i] = i;
+    }
+  for(i = first; i < last; i++)
+    {
+      for(j = 0; j < 3; j++)
+	{
+	  neighbor = job->stl->neighbors_start[i].neighbor[j];
+	  if(neighbor == -1)
+	    {
+	      continue;
+	    }
+	  if(neighbor >= first && neighbor < last)
+	    {
+	      stl_join_parts(job->parent, i, neighbor);
+	    }
+	  else
+	    {
+	      cross[num_cross++] = 3 * i + j;
+	    }
+	}
+    }
+  job->num_cross[block] = num_cross;
+}
+
+/* Puts the lowest facet of the part of each facet of a block into
+   part_ids.  Nothing is written to parent, which the other blocks read. */
+static void
+stl_find_roots_block(void *arg, int block)
+{
+  stl_parts_job *job = (stl_parts_job*)arg;
+  int           first;
+  int           last;
+  int           facet;
+  int           i;
+
+  first = block * job->block_size;
+  last = STL_MIN(first + job->block_size, job->stl->stats.number_of_facets);
+  for(i = first; i < last; i++)
+    {
+      for(facet = i; job->parent[facet] != facet; facet = job->parent[facet]);
+      job->stl->part_ids[i] = facet;
+    }
+}
+
+/* Labels the facets connected through their neighbors, which one of the
+   checks must have found, with the number of their part.  The parts are
+   numbered from 0 in the order of their lowest facet, so the labels
+   don't depend on the number of threads.  The result is kept in
+   stl->part_ids until the neighbors change, and the number of parts goes
+   into stl->stats.number_of_parts. */
+void
+stl_label_parts(stl_file *stl)
+{
+  stl_parts_job job;
+  int           num_blocks;
+  int           block;
+  int           edge;
+  int           i;
+
+  if(stl->num_parts >= 0)
+    {
+      stl->stats.number_of_parts = stl->num_parts;
+      return;
+    }
+
+  stl->part_ids = (int*)realloc(stl->part_ids,
+				STL_MAX(stl->stats.number_of_facets, 1)
+				* sizeof(int));
+  job.stl = stl;
+  job.parent = (int*)malloc(STL_MAX(stl->stats.number_of_facets, 1)
+			    * sizeof(int));
+  if(stl->part_ids == NULL || job.parent == NULL)
+    {
+      perror("stl_label_parts");
+      exit(1);
+    }
+
+  /* Every thread joins the facets of a few blocks, and then the edges
+     between the blocks are joined here */
+  job.block_size = STL_MAX(STL_PARTS_BLOCK_FACETS,
+			   stl->stats.number_of_facets
+			   / (4 * stl_get_threads()) + 1);
+  num_blocks = (stl->stats.number_of_facets + job.block_size - 1)
+    / job.block_size;
+  job.cross = (int*)malloc(STL_MAX(3 * stl->stats.number_of_facets, 1)
+			   * sizeof(int));
+  job.num_cross = (int*)malloc(STL_MAX(num_blocks, 1) * sizeof(int));
+  if(job.cross == NULL || job.num_cross == NULL)
+    {
+      perror("stl_label_parts");
+      exit(1);
+    }
+  stl_parallel_run(num_blocks, stl_join_block, &job);
+  for(block = 0; block < num_blocks; block++)
+    {
+      for(i = 0; i < job.num_cross[block]; i++)
+	{
+	  edge = job.cross[3 * block * job.block_size + i];
+	  stl_join_parts(job.parent, edge / 3,
+			 stl->neighbors_start[edge / 3].neighbor[edge % 3]);
+	}
+    }
+  stl_parallel_run(num_blocks, stl_find_roots_block, &job);
+
+  /* The lowest facet of each part is met first and numbers it */
+  stl->stats.number_of_parts = 0;
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      if(stl->part_ids[i] == i)
+	{
+	  stl->part_ids[i] = stl->stats.number_of_parts++;
+	}
+      else
+	{
+	  stl->part_ids[i] = stl->part_ids[stl->part_ids[i]];
+	}
+    }
+
+  free(job.cross);
+  free(job.num_cross);
+  free(job.parent);
+  stl->num_parts = stl->stats.number_of_parts;
+}
+
+void
+stl_invalidate_parts(stl_file *stl)
+{
+  /* The allocation is kept for the next labeling */
+  stl->num_parts = -1;
+}
+
+/* Finds the number of facets and open edges, the bounding box, the volume
+   and the surface area of every part in one pass over the facets.  The
+   parts are those of stl_label_parts(), so the neighbors must have been
+   found.  The result goes into stl->part_stats, one entry per part, and
+   stays there until the next call. */
+void
+stl_calculate_part_stats(stl_file *stl)
+{
+  stl_part_stats *part;
+  stl_mass       *mass;
+  stl_vertex     *origin;
+  stl_facet      *facet;
+  int            num_parts;
+  int            next_part;
+  int            id;
+  int            i;
+  int            j;
+
+  stl_flush_transform(stl);
+  stl_label_parts(stl);
+  num_parts = stl->stats.number_of_parts;
+
+  stl->part_stats = (stl_part_stats*)
+    realloc(stl->part_stats, STL_MAX(num_parts, 1) * sizeof(stl_part_stats));
+  mass = (stl_mass*)malloc(STL_MAX(num_parts, 1) * sizeof(stl_mass));
+  origin = (stl_vertex*)malloc(STL_MAX(num_parts, 1) * sizeof(stl_vertex));
+  if(stl->part_stats == NULL || mass == NULL || origin == NULL)
+    {
+      perror("stl_calculate_part_stats");
+      exit(1);
+    }
+  stl->num_part_stats = num_parts;
+
+  /* The parts are numbered in the order of their lowest facet, so a part
+     is new exactly when its number comes up for the first time */
+  next_part = 0;
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      facet = &stl->facet_start[i];
+      id = stl->part_ids[i];
+      part = &stl->part_stats[id];
+      if(id == next_part)
+	{
+	  part->facets = 0;
+	  part->open_edges = 0;
+	  part->min = part->max = facet->vertex[0];
+	  stl_mass_clear(&mass[id]);
+	  /* Sums taken near the part lose less to rounding */
+	  origin[id] = facet->vertex[0];
+	  next_part++;
+	}
+
+      part->facets++;
+      for(j = 0; j < 3; j++)
+	{
+	  if(stl->neighbors_start[i].neighbor[j] == -1)
+	    {
+	      part->open_edges++;
+	    }
+	  part->min.x = STL_MIN(part->min.x, facet->vertex[j].x);
+	  part->min.y = STL_MIN(part->min.y, facet->vertex[j].y);
+	  part->min.z = STL_MIN(part->min.z, facet->vertex[j].z);
+	  part->max.x = STL_MAX(part->max.x, facet->vertex[j].x);
+	  part->max.y = STL_MAX(part->max.y, facet->vertex[j].y);
+	  part->max.z = STL_MAX(part->max.z, facet->vertex[j].z);
+	}
+      stl_mass_add_facet(&mass[id], &origin[id], facet);
+    }
+
+  for(i = 0; i < num_parts; i++)
+    {
+      stl->part_stats[i].volume =
+	(mass[i].sum[STL_MASS_VOLUME] + mass[i].compensation[STL_MASS_VOLUME])
+	/ 6.0;
+      stl->part_stats[i].surface_area =
+	(mass[i].sum[STL_MASS_AREA] + mass[i].compensation[STL_MASS_AREA])
+	/ 2.0;
+    }
+  free(mass);
+  free(origin);
+}
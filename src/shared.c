@@ -22,9 +22,20 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "stl.h"
 
+static unsigned stl_get_hash_for_vertex(const stl_vertex *vertex);
+static void stl_drop_unused_vertices(stl_file *stl);
+static void stl_put_shared_vertex(stl_stream *s, stl_file *stl, int vertex);
+static void stl_put_vertex_indices(stl_stream *s, stl_file *stl, int facet,
+				   int base, const char *separator);
+static void stl_put_off_vertices(stl_stream *s, void *arg, int first, int last);
+static void stl_put_off_facets(stl_stream *s, void *arg, int first, int last);
+static void stl_put_obj_vertices(stl_stream *s, void *arg, int first, int last);
+static void stl_put_obj_facets(stl_stream *s, void *arg, int first, int last);
+
 void
 stl_invalidate_shared_vertices(stl_file *stl)
 {
@@ -38,6 +49,178 @@ stl_invalidate_shared_vertices(stl_file *stl)
         free(stl->v_shared);
         stl->v_shared = NULL;
       }
+    stl->v_welded = 0;
+}
+
+/* Gives every distinct vertex of the facets an index, in the order the
+   vertices first appear.  Vertices are the same if all of their bits are,
+   as in stl_check_facets_exact(), which then matches edges by the pair of
+   indices.  The indices stay valid until the facets are moved or changed;
+   everything that does so invalidates or updates them. */
+void
+stl_weld_vertices(stl_file *stl)
+{
+  unsigned *table;
+  unsigned size;
+  unsigned slot;
+  unsigned k;
+  int      num_vertices;
+  int      i;
+  int      j;
+
+  stl_flush_transform(stl);
+  stl_invalidate_shared_vertices(stl);
+
+  stl->v_indices = (v_indices_struct*)
+    malloc(stl->stats.number_of_facets * sizeof(v_indices_struct));
+  if(stl->v_indices == NULL) perror("stl_weld_vertices");
+  stl->stats.shared_malloced = STL_MAX(stl->stats.number_of_facets / 2, 1024);
+  stl->v_shared = (stl_vertex*)
+    malloc(stl->stats.shared_malloced * sizeof(stl_vertex));
+  if(stl->v_shared == NULL) perror("stl_weld_vertices");
+  num_vertices = 0;
+
+  /* Closed meshes have about half as many vertices as facets.  The table
+     of indices is kept at most half full. */
+  size = 1024;
+  while(size < 2 * (unsigned)stl->stats.shared_malloced)
+    {
+      size *= 2;
+    }
+  table = (unsigned*)malloc(size * sizeof(unsigned));
+  if(table == NULL)
+    {
+      perror("stl_weld_vertices");
+      exit(1);
+    }
+  memset(table, 0xFF, size * sizeof(unsigned));
+
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      for(j = 0; j < 3; j++)
+	{
+	  for(slot = stl_get_hash_for_vertex(&stl->facet_start[i].vertex[j])
+		& (size - 1);
+	      table[slot] != (unsigned)-1; slot = (slot + 1) & (size - 1))
+	    {
+	      if(!memcmp(&stl->v_shared[table[slot]],
+			 &stl->facet_start[i].vertex[j], sizeof(stl_vertex)))
+		{
+		  break;
+		}
+	    }
+	  if(table[slot] != (unsigned)-1)
+	    {
+	      stl->v_indices[i].vertex[j] = table[slot];
+	      continue;
+	    }
+
+	  /* A new vertex */
+	  if(num_vertices == stl->stats.shared_malloced)
+	    {
+	      stl->stats.shared_malloced *= 2;
+	      stl->v_shared = (stl_vertex*)realloc(stl->v_shared,
+			   stl->stats.shared_malloced * sizeof(stl_vertex));
+	      if(stl->v_shared == NULL) perror("stl_weld_vertices");
+	    }
+	  stl->v_shared[num_vertices] = stl->facet_start[i].vertex[j];
+	  stl->v_indices[i].vertex[j] = num_vertices;
+	  table[slot] = num_vertices;
+	  num_vertices++;
+
+	  if(2 * (unsigned)num_vertices > size)
+	    {
+	      /* Double the table and put the vertices back in */
+	      size *= 2;
+	      table = (unsigned*)realloc(table, size * sizeof(unsigned));
+	      if(table == NULL)
+		{
+		  perror("stl_weld_vertices");
+		  exit(1);
+		}
+	      memset(table, 0xFF, size * sizeof(unsigned));
+	      for(slot = 0; slot < (unsigned)num_vertices; slot++)
+		{
+		  for(k = stl_get_hash_for_vertex(&stl->v_shared[slot])
+			& (size - 1);
+		      table[k] != (unsigned)-1; k = (k + 1) & (size - 1));
+		  table[k] = slot;
+		}
+	    }
+	}
+    }
+  free(table);
+
+  stl->stats.shared_vertices = num_vertices;
+  stl->v_welded = 1;
+}
+
+static unsigned
+stl_get_hash_for_vertex(const stl_vertex *vertex)
+{
+  uint32_t words[3];
+  uint64_t h;
+  int      i;
+
+  memcpy(words, vertex, sizeof(words));
+  h = 0;
+  for(i = 0; i < 3; i++)
+    {
+      h = (h ^ words[i]) * 0x9E3779B97F4A7C15ULL;
+      h ^= h >> 29;
+    }
+  return (unsigned)(h ^ (h >> 32));
+}
+
+/* Removes the welded vertices that only facets removed since have used,
+   keeping the others in the same order, so that they aren't written out
+   on their own */
+static void
+stl_drop_unused_vertices(stl_file *stl)
+{
+  int *new_index;
+  int num_vertices;
+  int i;
+  int j;
+
+  new_index = (int*)malloc(STL_MAX(stl->stats.shared_vertices, 1)
+			   * sizeof(int));
+  if(new_index == NULL)
+    {
+      perror("stl_generate_shared_vertices");
+      exit(1);
+    }
+  memset(new_index, 0, stl->stats.shared_vertices * sizeof(int));
+  for(i = 0; i < stl->stats.number_of_facets; i++)
+    {
+      for(j = 0; j < 3; j++)
+	{
+	  new_index[stl->v_indices[i].vertex[j]] = 1;
+	}
+    }
+
+  num_vertices = 0;
+  for(i = 0; i < stl->stats.shared_vertices; i++)
+    {
+      if(new_index[i])
+	{
+	  stl->v_shared[num_vertices] = stl->v_shared[i];
+	  new_index[i] = num_vertices++;
+	}
+    }
+  if(num_vertices < stl->stats.shared_vertices)
+    {
+      for(i = 0; i < stl->stats.number_of_facets; i++)
+	{
+	  for(j = 0; j < 3; j++)
+	    {
+	      stl->v_indices[i].vertex[j] =
+		new_index[stl->v_indices[i].vertex[j]];
+	    }
+	}
+      stl->stats.shared_vertices = num_vertices;
+    }
+  free(new_index);
 }
 
 void
@@ -54,6 +237,14 @@ stl_generate_shared_vertices(stl_file *stl)
   int next_facet;
   int reversed;
   
+  stl_flush_transform(stl);
+  /* Vertices welded by stl_weld_vertices() are already shared */
+  if(stl->v_welded)
+    {
+      stl_drop_unused_vertices(stl);
+      return;
+    }
+
   /* make sure this function is idempotent and does not leak memory */
   stl_invalidate_shared_vertices(stl);
   
@@ -163,42 +354,81 @@ stl_generate_shared_vertices(stl_file *stl)
     }
 }
 
+/* Writes shared vertex number vertex as "%f %f %f" */
+static void
+stl_put_shared_vertex(stl_stream *s, stl_file *stl, int vertex)
+{
+  stl_stream_put_float_f(s, stl->v_shared[vertex].x);
+  stl_stream_puts(s, " ");
+  stl_stream_put_float_f(s, stl->v_shared[vertex].y);
+  stl_stream_puts(s, " ");
+  stl_stream_put_float_f(s, stl->v_shared[vertex].z);
+}
+
+/* Writes the three vertex indices of facet, counted from base */
+static void
+stl_put_vertex_indices(stl_stream *s, stl_file *stl, int facet,
+		       int base, const char *separator)
+{
+  stl_stream_put_int(s, stl->v_indices[facet].vertex[0] + base);
+  stl_stream_puts(s, separator);
+  stl_stream_put_int(s, stl->v_indices[facet].vertex[1] + base);
+  stl_stream_puts(s, separator);
+  stl_stream_put_int(s, stl->v_indices[facet].vertex[2] + base);
+}
+
+/* The lines of the vertices and facets of an OFF file, from first to
+   last - 1, for stl_stream_put_parallel() */
+static void
+stl_put_off_vertices(stl_stream *s, void *arg, int first, int last)
+{
+  stl_file *stl = (stl_file*)arg;
+  int      i;
+
+  for(i = first; i < last; i++)
+    {
+      stl_stream_puts(s, "\t");
+      stl_put_shared_vertex(s, stl, i);
+      stl_stream_puts(s, "\n");
+    }
+}
+
+static void
+stl_put_off_facets(stl_stream *s, void *arg, int first, int last)
+{
+  stl_file *stl = (stl_file*)arg;
+  int      i;
+
+  for(i = first; i < last; i++)
+    {
+      stl_stream_puts(s, "\t3 ");
+      stl_put_vertex_indices(s, stl, i, 0, " ");
+      stl_stream_puts(s, "\n");
+    }
+}
+
 void
 stl_write_off(stl_file *stl, char *file)
 {
-  int i;
   FILE      *fp;
-  char      *error_msg;
+  stl_stream s;
   
+  stl_flush_transform(stl);
+
+  fp = stl_open_output(file, "stl_write_off");
   
-  /* Open the file */
-  fp = fopen(file, "w");
-  if(fp == NULL)
-    {
-      error_msg = (char*)
-	malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
-      sprintf(error_msg, "stl_write_ascii: Couldn't open %s for writing",
-	      file);
-      perror(error_msg);
-      free(error_msg);
-      exit(1);
-    }
-  
-  fprintf(fp, "OFF\n");
-  fprintf(fp, "%d %d 0\n",
-	  stl->stats.shared_vertices, stl->stats.number_of_facets);
+  stl_stream_open(&s, fp);
+  stl_stream_puts(&s, "OFF\n");
+  stl_stream_put_int(&s, stl->stats.shared_vertices);
+  stl_stream_puts(&s, " ");
+  stl_stream_put_int(&s, stl->stats.number_of_facets);
+  stl_stream_puts(&s, " 0\n");
 
-  for(i = 0; i < stl->stats.shared_vertices; i++)
-    {
-      fprintf(fp, "\t%f %f %f\n",
-	      stl->v_shared[i].x, stl->v_shared[i].y, stl->v_shared[i].z);
-    }
-  for(i = 0; i < stl->stats.number_of_facets; i++)
-    {
-      fprintf(fp, "\t3 %d %d %d\n", stl->v_indices[i].vertex[0],
-	      stl->v_indices[i].vertex[1], stl->v_indices[i].vertex[2]);
-    }
-  fclose(fp);
+  stl_stream_put_parallel(&s, stl->stats.shared_vertices,
+			  stl_put_off_vertices, stl);
+  stl_stream_put_parallel(&s, stl->stats.number_of_facets,
+			  stl_put_off_facets, stl);
+  stl_stream_close(&s);
 }
 
 void
@@ -206,80 +436,97 @@ stl_write_vrml(stl_file *stl, char *file)
 {
   int i;
   FILE      *fp;
-  char      *error_msg;
-  
+  stl_stream s;
   
-  /* Open the file */
-  fp = fopen(file, "w");
-  if(fp == NULL)
-    {
-      error_msg = (char*)
-	malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
-      sprintf(error_msg, "stl_write_ascii: Couldn't open %s for writing",
-	      file);
-      perror(error_msg);
-      free(error_msg);
-      exit(1);
-    }
+  stl_flush_transform(stl);
+
+  fp = stl_open_output(file, "stl_write_vrml");
   
-  fprintf(fp, "#VRML V1.0 ascii\n\n");
-  fprintf(fp, "Separator {\n");
-  fprintf(fp, "\tDEF STLShape ShapeHints {\n");
-  fprintf(fp, "\t\tvertexOrdering COUNTERCLOCKWISE\n");
-  fprintf(fp, "\t\tfaceType CONVEX\n");
-  fprintf(fp, "\t\tshapeType SOLID\n");
-  fprintf(fp, "\t\tcreaseAngle 0.0\n");
-  fprintf(fp, "\t}\n");
-  fprintf(fp, "\tDEF STLModel Separator {\n");
-  fprintf(fp, "\t\tDEF STLColor Material {\n");
-  fprintf(fp, "\t\t\temissiveColor 0.700000 0.700000 0.000000\n");
-  fprintf(fp, "\t\t}\n");
-  fprintf(fp, "\t\tDEF STLVertices Coordinate3 {\n");
-  fprintf(fp, "\t\t\tpoint [\n");
+  stl_stream_open(&s, fp);
+  stl_stream_puts(&s, "#VRML V1.0 ascii\n\n");
+  stl_stream_puts(&s, "Separator {\n");
+  stl_stream_puts(&s, "\tDEF STLShape ShapeHints {\n");
+  stl_stream_puts(&s, "\t\tvertexOrdering COUNTERCLOCKWISE\n");
+  stl_stream_puts(&s, "\t\tfaceType CONVEX\n");
+  stl_stream_puts(&s, "\t\tshapeType SOLID\n");
+  stl_stream_puts(&s, "\t\tcreaseAngle 0.0\n");
+  stl_stream_puts(&s, "\t}\n");
+  stl_stream_puts(&s, "\tDEF STLModel Separator {\n");
+  stl_stream_puts(&s, "\t\tDEF STLColor Material {\n");
+  stl_stream_puts(&s, "\t\t\temissiveColor 0.700000 0.700000 0.000000\n");
+  stl_stream_puts(&s, "\t\t}\n");
+  stl_stream_puts(&s, "\t\tDEF STLVertices Coordinate3 {\n");
+  stl_stream_puts(&s, "\t\t\tpoint [\n");
 
   for(i = 0; i < (stl->stats.shared_vertices - 1); i++)
     {
-      fprintf(fp, "\t\t\t\t%f %f %f,\n",
-	      stl->v_shared[i].x, stl->v_shared[i].y, stl->v_shared[i].z);
+      stl_stream_puts(&s, "\t\t\t\t");
+      stl_put_shared_vertex(&s, stl, i);
+      stl_stream_puts(&s, ",\n");
     }
-  fprintf(fp, "\t\t\t\t%f %f %f]\n",
-	  stl->v_shared[i].x, stl->v_shared[i].y, stl->v_shared[i].z);
-  fprintf(fp, "\t\t}\n");
-  fprintf(fp, "\t\tDEF STLTriangles IndexedFaceSet {\n");
-  fprintf(fp, "\t\t\tcoordIndex [\n");
+  stl_stream_puts(&s, "\t\t\t\t");
+  stl_put_shared_vertex(&s, stl, i);
+  stl_stream_puts(&s, "]\n");
+  stl_stream_puts(&s, "\t\t}\n");
+  stl_stream_puts(&s, "\t\tDEF STLTriangles IndexedFaceSet {\n");
+  stl_stream_puts(&s, "\t\t\tcoordIndex [\n");
 
   for(i = 0; i < (stl->stats.number_of_facets - 1); i++)
     {
-      fprintf(fp, "\t\t\t\t%d, %d, %d, -1,\n", stl->v_indices[i].vertex[0],
-	      stl->v_indices[i].vertex[1], stl->v_indices[i].vertex[2]);
+      stl_stream_puts(&s, "\t\t\t\t");
+      stl_put_vertex_indices(&s, stl, i, 0, ", ");
+      stl_stream_puts(&s, ", -1,\n");
+    }
+  stl_stream_puts(&s, "\t\t\t\t");
+  stl_put_vertex_indices(&s, stl, i, 0, ", ");
+  stl_stream_puts(&s, ", -1]\n");
+  stl_stream_puts(&s, "\t\t}\n");
+  stl_stream_puts(&s, "\t}\n");
+  stl_stream_puts(&s, "}\n");
+  stl_stream_close(&s);
+}
+
+/* The same for an OBJ file, whose indices count from 1 */
+static void
+stl_put_obj_vertices(stl_stream *s, void *arg, int first, int last)
+{
+  stl_file *stl = (stl_file*)arg;
+  int      i;
+
+  for(i = first; i < last; i++)
+    {
+      stl_stream_puts(s, "v ");
+      stl_put_shared_vertex(s, stl, i);
+      stl_stream_puts(s, "\n");
+    }
+}
+
+static void
+stl_put_obj_facets(stl_stream *s, void *arg, int first, int last)
+{
+  stl_file *stl = (stl_file*)arg;
+  int      i;
+
+  for(i = first; i < last; i++)
+    {
+      stl_stream_puts(s, "f ");
+      stl_put_vertex_indices(s, stl, i, 1, " ");
+      stl_stream_puts(s, "\n");
     }
-  fprintf(fp, "\t\t\t\t%d, %d, %d, -1]\n", stl->v_indices[i].vertex[0],
-	  stl->v_indices[i].vertex[1], stl->v_indices[i].vertex[2]);
-  fprintf(fp, "\t\t}\n");
-  fprintf(fp, "\t}\n");
-  fprintf(fp, "}\n");
-  fclose(fp);
 }
 
 void stl_write_obj (stl_file *stl, char *file) {
-    int i;
+    stl_stream s;
     
-    /* Open the file */
-    FILE* fp = fopen(file, "w");
-    if (fp == NULL) {
-        char* error_msg = (char*)malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
-        sprintf(error_msg, "stl_write_ascii: Couldn't open %s for writing", file);
-        perror(error_msg);
-        free(error_msg);
-        exit(1);
-    }
+    stl_flush_transform(stl);
+
+    FILE* fp = stl_open_output(file, "stl_write_obj");
     
-    for (i = 0; i < stl->stats.shared_vertices; i++) {
-        fprintf(fp, "v %f %f %f\n", stl->v_shared[i].x, stl->v_shared[i].y, stl->v_shared[i].z);
-    }
-    for (i = 0; i < stl->stats.number_of_facets; i++) {
-        fprintf(fp, "f %d %d %d\n", stl->v_indices[i].vertex[0]+1, stl->v_indices[i].vertex[1]+1, stl->v_indices[i].vertex[2]+1);
-    }
+    stl_stream_open(&s, fp);
+    stl_stream_put_parallel(&s, stl->stats.shared_vertices,
+                            stl_put_obj_vertices, stl);
+    stl_stream_put_parallel(&s, stl->stats.number_of_facets,
+                            stl_put_obj_facets, stl);
     
-    fclose(fp);
+    stl_stream_close(&s);
 }
@@ -32,6 +32,7 @@
 #define STL_MIN_FILE_SIZE      284
 #define ASCII_LINES_PER_FACET  7
 #define SIZEOF_EDGE_SORT       24
+#define STL_NORMAL_BLOCK_FACETS 256	/* facets per stl_calculate_normals() */
 
 typedef struct 
 {
@@ -71,9 +72,19 @@ typedef struct stl_hash_edge
   unsigned       key[6];
   int            facet_number;
   int            which_edge;
-  struct stl_hash_edge  *next;
 }stl_hash_edge;
 
+/* Edges waiting for a neighbor, kept in an open addressing table with
+   linear probing.  Slots with a facet_number of -1 are empty.  The slots
+   are reused by every check on the stl and freed by stl_close(). */
+typedef struct
+{
+  stl_hash_edge *slots;
+  unsigned      capacity;	/* number of slots allocated */
+  unsigned      mask;		/* number of slots in use - 1, a power of 2 */
+  int           entries;
+}stl_edge_table;
+
 typedef struct
 {
   int   neighbor[3];
@@ -96,6 +107,9 @@ typedef struct
   float         bounding_diameter;
   float         shortest_edge;
   float         volume;
+  float         surface_area;
+  stl_vertex    center_of_mass;
+  float         inertia[3][3];	/* about center_of_mass, for density 1 */
   unsigned      number_of_blocks;
   int           connected_edges;
   int           connected_facets_1_edge;
@@ -121,17 +135,94 @@ typedef struct
   int           shared_malloced;
 }stl_stats;  
 
+/* Sums for the mass properties of a set of facets, see util.c */
+#define STL_MASS_VOLUME        0
+#define STL_MASS_AREA          1
+#define STL_MASS_FIRST         2	/* three first moments */
+#define STL_MASS_SECOND        5	/* six second moments, xx xy xz yy yz zz */
+#define STL_MASS_SUMS          11
+
+typedef struct
+{
+  double        sum[STL_MASS_SUMS];
+  double        compensation[STL_MASS_SUMS];
+}stl_mass;
+
+/* What stl_calculate_part_stats() finds for each part */
+typedef struct
+{
+  int           facets;
+  int           open_edges;
+  stl_vertex    min;
+  stl_vertex    max;
+  float         volume;		/* negative when the part is inside out */
+  float         surface_area;
+}stl_part_stats;
+
+/* Buffered text output, see stream.c.  A stream without a file keeps
+   everything in buf. */
 typedef struct
 {
   FILE          *fp;
+  char          *buf;
+  size_t        used;
+  size_t        size;
+}stl_stream;
+
+/* Output that takes the facets a block at a time, see stl_io.c */
+#define STL_WRITER_BINARY      0
+#define STL_WRITER_ASCII       1
+#define STL_WRITER_DXF         2
+
+typedef struct
+{
+  int           format;		/* one of the STL_WRITER_ values */
+  FILE          *fp;		/* binary output */
+  unsigned char *buf;		/* binary records being packed */
+  stl_stream    s;		/* ASCII and DXF output */
+  const char    *label;
+  int           num_facets;	/* facets written so far */
+  int           header_facets;	/* count in the binary header, -1 if not
+				   known yet */
+  int           held;		/* binary records wait in s for the count */
+}stl_writer;
+
+/* Compression of a file, found from its magic number when read and from
+   its extension when written */
+#define STL_COMPRESS_NONE      0
+#define STL_COMPRESS_GZIP      1
+#define STL_COMPRESS_ZSTD      2
+
+/* The first bytes of a file written by stl_write_cache() */
+#define STL_CACHE_MAGIC        "ADMCACHE"
+
+/* Facets read and written per block by the streaming conversion */
+#define STL_CONVERT_BLOCK_FACETS 16384
+
+typedef struct
+{
+  FILE          *fp;
+  void          *reader;	/* set by stl_open_blocks() */
+  unsigned char *pushback;	/* read ahead from a pipe, NULL for a file */
+  size_t        pushback_pos;
+  size_t        pushback_len;
   stl_facet     *facet_start;
   stl_edge      *edge_start;
-  stl_hash_edge **heads;
-  stl_hash_edge *tail;
-  int           M;
+  stl_edge_table edges;
   stl_neighbors *neighbors_start;
   v_indices_struct *v_indices;
   stl_vertex    *v_shared;
+  int           v_welded;	/* v_shared holds each distinct vertex once */
+  int           checked;	/* the neighbors are what the checks found */
+  int           *open_edges;	/* 3 * facet + edge of the open edges */
+  int           num_open_edges;	/* -1 when open_edges must be rebuilt */
+  int           *part_ids;	/* part of each facet, see stl_label_parts() */
+  int           num_parts;	/* -1 when part_ids must be redone */
+  stl_part_stats *part_stats;	/* see stl_calculate_part_stats() */
+  int           num_part_stats;
+  float         trafo[12];	/* transformation not yet applied */
+  int           trafo_pending;	/* trafo isn't the identity */
+  int           size_pending;	/* the size must be found after trafo */
   stl_stats     stats;
 }stl_file;
 
@@ -141,11 +232,35 @@ extern void stl_close(stl_file *stl);
 extern void stl_stats_out(stl_file *stl, FILE *file, char *input_file);
 extern void stl_print_edges(stl_file *stl, FILE *file);
 extern void stl_print_neighbors(stl_file *stl, char *file);
+extern FILE *stl_open_output(const char *file, const char *caller);
+extern void stl_close_output(FILE *fp, const char *caller);
+extern int stl_compression_of(const unsigned char *buf, size_t len);
+extern int stl_compression_for(const char *file);
+extern long stl_decompressed_size(FILE *raw, int format, long file_size);
+extern FILE *stl_open_decompressor(FILE *raw, int format,
+				   const unsigned char *prefix, size_t len);
+extern FILE *stl_open_compressor(FILE *raw, int format);
 extern void stl_write_ascii(stl_file *stl, const char *file, const char *label);
 extern void stl_write_binary(stl_file *stl, const char *file, const char *label);
+extern void stl_writer_open_binary(stl_writer *w, const char *file,
+				   const char *label, int num_facets);
+extern void stl_writer_open_ascii(stl_writer *w, const char *file,
+				  const char *label);
+extern void stl_writer_open_dxf(stl_writer *w, const char *file,
+				const char *label);
+extern void stl_writer_put(stl_writer *w, const stl_facet *facets,
+			   int count);
+extern void stl_writer_close(stl_writer *w);
 extern void stl_check_facets_exact(stl_file *stl);
+extern void stl_check_facets_exact_sort(stl_file *stl);
 extern void stl_check_facets_nearby(stl_file *stl, float tolerance);
+extern void stl_check_facets_nearby_grid(stl_file *stl, float tolerance);
+extern void stl_invalidate_open_edges(stl_file *stl);
 extern void stl_remove_unconnected_facets(stl_file *stl);
+extern void stl_label_parts(stl_file *stl);
+extern void stl_invalidate_parts(stl_file *stl);
+extern void stl_calculate_part_stats(stl_file *stl);
+extern void stl_write_part_stats(stl_file *stl, char *file);
 extern void stl_write_vertex(stl_file *stl, int facet, int vertex);
 extern void stl_write_facet(stl_file *stl, char *label, int facet);
 extern void stl_write_edge(stl_file *stl, char *label, stl_hash_edge edge);
@@ -166,21 +281,64 @@ extern void stl_rotate_z(stl_file *stl, float angle);
 extern void stl_mirror_xy(stl_file *stl);
 extern void stl_mirror_yz(stl_file *stl);
 extern void stl_mirror_xz(stl_file *stl);
+extern void stl_trafo_identity(float *trafo3x4);
+extern void stl_trafo_rotate(float *trafo3x4, int axis, float angle);
+extern void stl_trafo_scale(float *trafo3x4, float versor[3]);
+extern void stl_transform(stl_file *stl, float *trafo3x4);
+extern void stl_flush_transform(stl_file *stl);
+extern void stl_transform_facets(const float *trafo3x4, stl_facet *facets,
+				 int count, stl_vertex *min, stl_vertex *max);
 extern void stl_open_merge(stl_file *stl, char *file);
 extern void stl_invalidate_shared_vertices(stl_file *stl);
 extern void stl_generate_shared_vertices(stl_file *stl);
+extern void stl_weld_vertices(stl_file *stl);
 extern void stl_write_obj(stl_file *stl, char *file);
+extern void stl_write_cache(stl_file *stl, char *file);
+extern int stl_is_cache(const char *file);
+extern void stl_read_cache(stl_file *stl, char *file);
 extern void stl_write_off(stl_file *stl, char *file);
 extern void stl_write_dxf(stl_file *stl, char *file, char *label);
 extern void stl_write_vrml(stl_file *stl, char *file);
 extern void stl_calculate_normal(float normal[], stl_facet *facet);
 extern void stl_normalize_vector(float v[]);
+extern void stl_calculate_normals(float *normals, stl_facet *facets,
+				  int count);
 extern void stl_calculate_volume(stl_file *stl);
+extern void stl_calculate_stats_blocks(stl_file *stl);
+extern void stl_mass_clear(stl_mass *mass);
+extern void stl_mass_add_facet(stl_mass *mass, const stl_vertex *origin,
+			       const stl_facet *facet);
+extern void stl_mass_merge(stl_mass *mass, const stl_mass *from);
+extern void stl_mass_to_stats(const stl_mass *mass, const stl_vertex *origin,
+			      stl_stats *stats);
 
 extern void stl_initialize(stl_file *stl);
 extern void stl_count_facets(stl_file *stl, char *file);
 extern void stl_allocate(stl_file *stl);
 extern void stl_read(stl_file *stl, int first_facet, int first);
+extern void stl_open_blocks(stl_file *stl, char *file);
+extern int stl_read_block(stl_file *stl, stl_facet *facets, int max);
+extern void stl_rewind_blocks(stl_file *stl);
+extern void stl_scan_blocks(stl_file *stl);
+extern void stl_flush_blocks(stl_file *stl);
 extern void stl_facet_stats(stl_file *stl, stl_facet facet, int first);
 extern void stl_reallocate(stl_file *stl);
 extern void stl_get_size(stl_file *stl);
+
+extern void stl_stream_open(stl_stream *s, FILE *fp);
+extern void stl_stream_flush(stl_stream *s);
+extern void stl_stream_close(stl_stream *s);
+extern void stl_stream_write(stl_stream *s, const char *data, size_t length);
+extern void stl_stream_puts(stl_stream *s, const char *str);
+extern void stl_stream_put_int(stl_stream *s, int value);
+extern void stl_stream_put_float_f(stl_stream *s, float value);
+extern void stl_stream_put_float_e(stl_stream *s, float value);
+extern void stl_stream_put_parallel(stl_stream *s, int count,
+				    void (*func)(stl_stream *s, void *arg,
+						 int first, int last),
+				    void *arg);
+
+extern void stl_set_threads(int threads);
+extern int stl_get_threads(void);
+extern void stl_parallel_run(int tasks, void (*func)(void *arg, int task),
+			     void *arg);
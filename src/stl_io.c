@@ -31,8 +31,12 @@
 #define SEEK_END 2
 #endif
 
-static void stl_put_little_int(FILE *fp, int value);
-static void stl_put_little_float(FILE *fp, float value_in);
+/* Facets assembled in memory per fwrite() by stl_write_binary() */
+#define STL_WRITE_BLOCK_FACETS 8192
+
+static void stl_put_little_int(unsigned char *buf, int value);
+static void stl_encode_facet(unsigned char *buf, const stl_facet *facet);
+static void stl_put_ascii_facets(stl_stream *s, void *arg, int first, int last);
 
 void
 stl_print_edges(stl_file *stl, FILE *file)
@@ -55,11 +59,20 @@ stl_print_edges(stl_file *stl, FILE *file)
 void
 stl_stats_out(stl_file *stl, FILE *file, char *input_file)
 {
+  stl_part_stats *part;
+  int            i;
+
   /* this is here for Slic3r, without our config.h
      it won't use this part of the code anyway */
   #ifndef VERSION
   #define VERSION "unknown"
   #endif
+
+  /* Only the size is printed from what the transformations change */
+  if(stl->size_pending || stl->reader != NULL)
+    {
+      stl_flush_transform(stl);
+    }
   fprintf(file, "\n\
 ================= Results produced by ADMesh version " VERSION " ================\n");
   fprintf(file, "\
@@ -86,6 +99,25 @@ Header             : %s\n", stl->stats.header);
   
   fprintf(file, "\
 ========= Facet Status ========== Original ============ Final ====\n");
+  if(stl->reader != NULL)
+    {
+      /* Nothing is known about the neighbors of facets that were read a
+	 block at a time, see stl_calculate_stats_blocks() */
+      fprintf(file, "\
+Number of facets                 : %5d               %5d\n",
+	      stl->stats.original_num_facets, stl->stats.number_of_facets);
+      fprintf(file,
+"=== Processing Statistics ===     ===== Other Statistics =====\n");
+      fprintf(file, "\
+Degenerate facets     : %5d        Volume   : % f\n",
+	      stl->stats.degenerate_facets, stl->stats.volume);
+      fprintf(file, "\
+Shortest edge         : % f    Area     : % f\n",
+	      stl->stats.shortest_edge, stl->stats.surface_area);
+      fprintf(file, "\
+Bounding diameter     : % f\n", stl->stats.bounding_diameter);
+      return;
+    }
   fprintf(file, "\
 Number of facets                 : %5d               %5d\n", 
 	  stl->stats.original_num_facets, stl->stats.number_of_facets);
@@ -126,53 +158,24 @@ Facets reversed       : %5d\n", stl->stats.facets_reversed);
 Backwards edges       : %5d\n", stl->stats.backwards_edges);
   fprintf(file, "\
 Normals fixed         : %5d\n", stl->stats.normals_fixed);
-}
 
-void
-stl_write_ascii(stl_file *stl, const char *file, const char *label)
-{
-  int       i;
-  FILE      *fp;
-  char      *error_msg;
-  
-  
-  /* Open the file */
-  fp = fopen(file, "w");
-  if(fp == NULL)
+  if(stl->part_stats != NULL)
     {
-      error_msg = (char*)
-	malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
-      sprintf(error_msg, "stl_write_ascii: Couldn't open %s for writing",
-	      file);
-      perror(error_msg);
-      free(error_msg);
-      exit(1);
-    }
-  
-  fprintf(fp, "solid  %s\n", label);
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
-    {
-      fprintf(fp, "  facet normal % .8E % .8E % .8E\n",
-	      stl->facet_start[i].normal.x, stl->facet_start[i].normal.y,
-	      stl->facet_start[i].normal.z);
-      fprintf(fp, "    outer loop\n");
-      fprintf(fp, "      vertex % .8E % .8E % .8E\n",
-	      stl->facet_start[i].vertex[0].x, stl->facet_start[i].vertex[0].y,
-	      stl->facet_start[i].vertex[0].z);
-      fprintf(fp, "      vertex % .8E % .8E % .8E\n",
-	      stl->facet_start[i].vertex[1].x, stl->facet_start[i].vertex[1].y,
-	      stl->facet_start[i].vertex[1].z);
-      fprintf(fp, "      vertex % .8E % .8E % .8E\n",
-	      stl->facet_start[i].vertex[2].x, stl->facet_start[i].vertex[2].y,
-	      stl->facet_start[i].vertex[2].z);
-      fprintf(fp, "    endloop\n");
-      fprintf(fp, "  endfacet\n");
+      fprintf(file, "\
+============================== Parts ==============================\n");
+      fprintf(file, "\
+ Part  Facets  Open edges        Volume          Area\n");
+      for(i = 0; i < stl->num_part_stats; i++)
+	{
+	  part = &stl->part_stats[i];
+	  fprintf(file, "%5d %7d %11d % 13f % 13f\n",
+		  i, part->facets, part->open_edges, part->volume,
+		  part->surface_area);
+	  fprintf(file, "      Min % f % f % f, Max % f % f % f\n",
+		  part->min.x, part->min.y, part->min.z,
+		  part->max.x, part->max.y, part->max.z);
+	}
     }
-  
-  fprintf(fp, "endsolid  %s\n", label);
-  
-  fclose(fp);
 }
 
 void
@@ -180,20 +183,8 @@ stl_print_neighbors(stl_file *stl, char *file)
 {
   int i;
   FILE *fp;
-  char *error_msg;
 
-  /* Open the file */
-  fp = fopen(file, "w");
-  if(fp == NULL)
-    {
-      error_msg = (char*)
-	malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
-      sprintf(error_msg, "stl_print_neighbors: Couldn't open %s for writing",
-	      file);
-      perror(error_msg);
-      free(error_msg);
-      exit(1);
-    }
+  fp = stl_open_output(file, "stl_print_neighbors");
 
   for(i = 0; i < stl->stats.number_of_facets; i++)
     {
@@ -206,100 +197,391 @@ stl_print_neighbors(stl_file *stl, char *file)
 	      stl->neighbors_start[i].neighbor[2],
 	      (int)stl->neighbors_start[i].which_vertex_not[2]);
     }
-    fclose(fp);
+  stl_close_output(fp, "stl_print_neighbors");
 }
 
+/* Writes what stl_calculate_part_stats() found as comma separated values,
+   one line for each part after a line with the names of the columns */
+void
+stl_write_part_stats(stl_file *stl, char *file)
+{
+  stl_part_stats *part;
+  FILE           *fp;
+  int            i;
+
+  fp = stl_open_output(file, "stl_write_part_stats");
+
+  fprintf(fp, "part,facets,open_edges,volume,surface_area,"
+	  "min_x,min_y,min_z,max_x,max_y,max_z\n");
+  for(i = 0; i < stl->num_part_stats; i++)
+    {
+      part = &stl->part_stats[i];
+      fprintf(fp, "%d,%d,%d,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g,%.9g\n",
+	      i, part->facets, part->open_edges, part->volume,
+	      part->surface_area, part->min.x, part->min.y, part->min.z,
+	      part->max.x, part->max.y, part->max.z);
+    }
+  stl_close_output(fp, "stl_write_part_stats");
+}
+
+/* Stores value as 4 little-endian bytes */
 static void
-stl_put_little_int(FILE *fp, int value_in)
+stl_put_little_int(unsigned char *buf, int value)
 {
-  int new_value;
-  union 
+  buf[0] = value & 0xFF;
+  buf[1] = (value >> 0x08) & 0xFF;
+  buf[2] = (value >> 0x10) & 0xFF;
+  buf[3] = (value >> 0x18) & 0xFF;
+}
+
+/* Packs facet into a little-endian 50 byte facet record */
+static void
+stl_encode_facet(unsigned char *buf, const stl_facet *facet)
+{
+#ifdef WORDS_BIGENDIAN
+  unsigned char *p;
+  unsigned char tmp;
+  int           i;
+#endif
+
+  memcpy(buf, &facet->normal, sizeof(stl_normal));
+  memcpy(buf + sizeof(stl_normal), facet->vertex, 3 * sizeof(stl_vertex));
+  memcpy(buf + SIZEOF_STL_FACET - sizeof(stl_extra), facet->extra,
+	 sizeof(stl_extra));
+#ifdef WORDS_BIGENDIAN
+  /* Swap the normal and the vertices (12 floats in a row) into
+     little-endian order */
+  p = buf;
+  for(i = 0; i < 12; i++, p += 4)
     {
-      int  int_value;
-      char char_value[4];
-    } value;
-  
-  value.int_value = value_in;
-  
-  new_value  = value.char_value[0] & 0xFF;
-  new_value |= (value.char_value[1] & 0xFF) << 0x08;
-  new_value |= (value.char_value[2] & 0xFF) << 0x10;
-  new_value |= (value.char_value[3] & 0xFF) << 0x18;
-  fwrite(&new_value, sizeof(int), 1, fp);
+      tmp = p[0]; p[0] = p[3]; p[3] = tmp;
+      tmp = p[1]; p[1] = p[2]; p[2] = tmp;
+    }
+#endif
 }
 
+/* Writes facets first .. last - 1 of the array arg the way
+   stl_write_ascii() does */
 static void
-stl_put_little_float(FILE *fp, float value_in)
+stl_put_ascii_facets(stl_stream *s, void *arg, int first, int last)
 {
-  int new_value;
-  union 
+  const stl_facet *facets = (const stl_facet*)arg;
+  int             i;
+  int             j;
+
+  for(i = first; i < last; i++)
     {
-      float float_value;
-      char  char_value[4];
-    } value;
-  
-  value.float_value = value_in;
-  
-  new_value  = value.char_value[0] & 0xFF;
-  new_value |= (value.char_value[1] & 0xFF) << 0x08;
-  new_value |= (value.char_value[2] & 0xFF) << 0x10;
-  new_value |= (value.char_value[3] & 0xFF) << 0x18;
-  fwrite(&new_value, sizeof(int), 1, fp);
+      stl_stream_puts(s, "  facet normal ");
+      stl_stream_put_float_e(s, facets[i].normal.x);
+      stl_stream_puts(s, " ");
+      stl_stream_put_float_e(s, facets[i].normal.y);
+      stl_stream_puts(s, " ");
+      stl_stream_put_float_e(s, facets[i].normal.z);
+      stl_stream_puts(s, "\n    outer loop\n");
+      for(j = 0; j < 3; j++)
+	{
+	  stl_stream_puts(s, "      vertex ");
+	  stl_stream_put_float_e(s, facets[i].vertex[j].x);
+	  stl_stream_puts(s, " ");
+	  stl_stream_put_float_e(s, facets[i].vertex[j].y);
+	  stl_stream_puts(s, " ");
+	  stl_stream_put_float_e(s, facets[i].vertex[j].z);
+	  stl_stream_puts(s, "\n");
+	}
+      stl_stream_puts(s, "    endloop\n  endfacet\n");
+    }
 }
 
+/* Writes the DXF 3DFACE entities of count facets */
+static void
+stl_put_dxf_facets(stl_stream *s, const stl_facet *facets, int count)
+{
+  int i;
+  int j;
+  /* group codes of the x, y and z of the four corners of a 3DFACE */
+  static const char *codes[4][3] =
+    {
+      {"10\n", "\n20\n", "\n30\n"},
+      {"11\n", "\n21\n", "\n31\n"},
+      {"12\n", "\n22\n", "\n32\n"},
+      {"13\n", "\n23\n", "\n33\n"}
+    };
 
-void
-stl_write_binary(stl_file *stl, const char *file, const char *label)
+  for(i = 0; i < count; i++)
+    {
+      stl_stream_puts(s, "0\n3DFACE\n8\n0\n");
+      for(j = 0; j < 4; j++)
+	{
+	  /* The fourth corner repeats the third one */
+	  stl_stream_puts(s, codes[j][0]);
+	  stl_stream_put_float_f(s, facets[i].vertex[STL_MIN(j, 2)].x);
+	  stl_stream_puts(s, codes[j][1]);
+	  stl_stream_put_float_f(s, facets[i].vertex[STL_MIN(j, 2)].y);
+	  stl_stream_puts(s, codes[j][2]);
+	  stl_stream_put_float_f(s, facets[i].vertex[STL_MIN(j, 2)].z);
+	  stl_stream_puts(s, "\n");
+	}
+    }
+}
+
+/* Opens file for writing, or returns stdout if file is "-".  A file
+   named *.gz or *.zst is compressed on the way.  A failure is reported as
+   coming from caller. */
+FILE *
+stl_open_output(const char *file, const char *caller)
 {
-  FILE      *fp;
-  int       i;
-  char      *error_msg;
+  FILE *fp;
+  int  format;
+  char *error_msg;
 
-  
-  /* Open the file */
+  if(strcmp(file, "-") == 0)
+    {
+      return stdout;
+    }
   fp = fopen(file, "w");
   if(fp == NULL)
     {
       error_msg = (char*)
 	malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
-      sprintf(error_msg, "stl_write_binary: Couldn't open %s for writing",
-	      file);
+      sprintf(error_msg, "%s: Couldn't open %s for writing", caller, file);
       perror(error_msg);
       free(error_msg);
       exit(1);
     }
+  format = stl_compression_for(file);
+  if(format != STL_COMPRESS_NONE)
+    {
+      fp = stl_open_compressor(fp, format);
+    }
+  return fp;
+}
 
-  fprintf(fp, "%s", label);
-  for(i = strlen(label); i < LABEL_SIZE; i++) putc(0, fp);
+/* Closes what stl_open_output() opened.  stdout is only flushed. */
+void
+stl_close_output(FILE *fp, const char *caller)
+{
+  if((fp == stdout ? fflush(fp) : fclose(fp)) != 0)
+    {
+      perror(caller);
+      exit(1);
+    }
+}
 
-  fseek(fp, LABEL_SIZE, SEEK_SET);
+static void
+stl_writer_open_file(stl_writer *w, const char *file, const char *caller)
+{
+  w->fp = stl_open_output(file, caller);
+  w->buf = NULL;
+  w->num_facets = 0;
+  w->header_facets = 0;
+  w->held = 0;
+}
 
-  stl_put_little_int(fp, stl->stats.number_of_facets);
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+/* Writes the header of a binary STL file that has num_facets facets */
+static void
+stl_put_binary_header(stl_writer *w, int num_facets)
+{
+  /* The label is cut or padded with zeros to LABEL_SIZE */
+  memset(w->buf, 0, LABEL_SIZE);
+  memcpy(w->buf, w->label, STL_MIN(strlen(w->label), LABEL_SIZE));
+  stl_put_little_int(w->buf + LABEL_SIZE, num_facets);
+  if(fwrite(w->buf, 1, HEADER_SIZE, w->fp) != HEADER_SIZE)
     {
-      stl_put_little_float(fp, stl->facet_start[i].normal.x);
-      stl_put_little_float(fp, stl->facet_start[i].normal.y);
-      stl_put_little_float(fp, stl->facet_start[i].normal.z);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[0].x);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[0].y);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[0].z);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[1].x);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[1].y);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[1].z);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[2].x);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[2].y);
-      stl_put_little_float(fp, stl->facet_start[i].vertex[2].z);
-      fputc(stl->facet_start[i].extra[0], fp);
-      fputc(stl->facet_start[i].extra[1], fp);
+      perror("Cannot write header");
+      exit(1);
     }
-  
-  fclose(fp);
+}
+
+/* Starts a binary STL file.  The header says num_facets, and is put right
+   by stl_writer_close() if some other number of facets is written.  If
+   num_facets is -1, as it isn't known yet, and the output is a pipe that
+   can't be put right afterwards, the records are held back in memory
+   until the end. */
+void
+stl_writer_open_binary(stl_writer *w, const char *file, const char *label,
+		       int num_facets)
+{
+  stl_writer_open_file(w, file, "stl_write_binary");
+  w->format = STL_WRITER_BINARY;
+  w->label = label;
+
+  /* The records are packed into one buffer and written a block at a
+     time, rather than a few bytes per call */
+  w->buf = (unsigned char*)malloc(STL_WRITE_BLOCK_FACETS * SIZEOF_STL_FACET);
+  if(w->buf == NULL)
+    {
+      perror("stl_write_binary");
+      exit(1);
+    }
+
+  w->header_facets = num_facets;
+  if(num_facets < 0 && ftell(w->fp) < 0)
+    {
+      w->held = 1;
+      stl_stream_open(&w->s, NULL);
+      return;
+    }
+  stl_put_binary_header(w, STL_MAX(num_facets, 0));
+}
+
+void
+stl_writer_open_ascii(stl_writer *w, const char *file, const char *label)
+{
+  stl_writer_open_file(w, file, "stl_write_ascii");
+  w->format = STL_WRITER_ASCII;
+  w->label = label;
+
+  stl_stream_open(&w->s, w->fp);
+  stl_stream_puts(&w->s, "solid  ");
+  stl_stream_puts(&w->s, label);
+  stl_stream_puts(&w->s, "\n");
+}
+
+void
+stl_writer_open_dxf(stl_writer *w, const char *file, const char *label)
+{
+  stl_writer_open_file(w, file, "stl_write_dxf");
+  w->format = STL_WRITER_DXF;
+  w->label = label;
+
+  stl_stream_open(&w->s, w->fp);
+  stl_stream_puts(&w->s, "999\n");
+  stl_stream_puts(&w->s, label);
+  stl_stream_puts(&w->s, "\n");
+  stl_stream_puts(&w->s, "0\nSECTION\n2\nHEADER\n0\nENDSEC\n");
+  stl_stream_puts(&w->s, "0\nSECTION\n2\nTABLES\n0\nTABLE\n2\nLAYER\n70\n1\n\
+0\nLAYER\n2\n0\n70\n0\n62\n7\n6\nCONTINUOUS\n0\nENDTAB\n0\nENDSEC\n");
+  stl_stream_puts(&w->s, "0\nSECTION\n2\nBLOCKS\n0\nENDSEC\n");
+  stl_stream_puts(&w->s, "0\nSECTION\n2\nENTITIES\n");
+}
+
+/* Writes the next count facets */
+void
+stl_writer_put(stl_writer *w, const stl_facet *facets, int count)
+{
+  int block;
+  int i;
+  int j;
+
+  if(w->format == STL_WRITER_BINARY)
+    {
+      for(i = 0; i < count; i += block)
+	{
+	  block = STL_MIN(STL_WRITE_BLOCK_FACETS, count - i);
+	  for(j = 0; j < block; j++)
+	    {
+	      stl_encode_facet(w->buf + (size_t)j * SIZEOF_STL_FACET,
+			       &facets[i + j]);
+	    }
+	  if(w->held)
+	    {
+	      stl_stream_write(&w->s, (const char*)w->buf,
+			       (size_t)block * SIZEOF_STL_FACET);
+	    }
+	  else if(fwrite(w->buf, SIZEOF_STL_FACET, block, w->fp)
+		  != (size_t)block)
+	    {
+	      perror("Cannot write facet");
+	      exit(1);
+	    }
+	}
+    }
+  else if(w->format == STL_WRITER_ASCII)
+    {
+      stl_stream_put_parallel(&w->s, count, stl_put_ascii_facets,
+			      (void*)facets);
+    }
+  else
+    {
+      stl_put_dxf_facets(&w->s, facets, count);
+    }
+  w->num_facets += count;
+}
+
+/* Finishes the file.  A binary header that has the wrong number of
+   facets is written again, which needs a file that can seek. */
+void
+stl_writer_close(stl_writer *w)
+{
+  unsigned char count[NUM_FACET_SIZE];
+
+  if(w->format == STL_WRITER_BINARY)
+    {
+      if(w->held)
+	{
+	  stl_put_binary_header(w, w->num_facets);
+	  if(fwrite(w->s.buf, 1, w->s.used, w->fp) != w->s.used)
+	    {
+	      perror("Cannot write facet");
+	      exit(1);
+	    }
+	  stl_stream_close(&w->s);
+	}
+      else if(w->num_facets != w->header_facets)
+	{
+	  stl_put_little_int(count, w->num_facets);
+	  if(fseek(w->fp, LABEL_SIZE, SEEK_SET) != 0
+	     || fwrite(count, 1, NUM_FACET_SIZE, w->fp) != NUM_FACET_SIZE)
+	    {
+	      perror("stl_write_binary: Cannot write the number of facets");
+	      exit(1);
+	    }
+	}
+      free(w->buf);
+      stl_close_output(w->fp, "stl_write_binary");
+    }
+  else if(w->format == STL_WRITER_ASCII)
+    {
+      stl_stream_puts(&w->s, "endsolid  ");
+      stl_stream_puts(&w->s, w->label);
+      stl_stream_puts(&w->s, "\n");
+      stl_stream_close(&w->s);
+    }
+  else
+    {
+      stl_stream_puts(&w->s, "0\nENDSEC\n0\nEOF\n");
+      stl_stream_close(&w->s);
+    }
+  w->fp = NULL;
+}
+
+void
+stl_write_binary(stl_file *stl, const char *file, const char *label)
+{
+  stl_writer w;
+
+  stl_flush_transform(stl);
+  stl_writer_open_binary(&w, file, label, stl->stats.number_of_facets);
+  stl_writer_put(&w, stl->facet_start, stl->stats.number_of_facets);
+  stl_writer_close(&w);
+}
+
+void
+stl_write_ascii(stl_file *stl, const char *file, const char *label)
+{
+  stl_writer w;
+
+  stl_flush_transform(stl);
+  stl_writer_open_ascii(&w, file, label);
+  stl_writer_put(&w, stl->facet_start, stl->stats.number_of_facets);
+  stl_writer_close(&w);
+}
+
+void
+stl_write_dxf(stl_file *stl, char *file, char *label)
+{
+  stl_writer w;
+
+  stl_flush_transform(stl);
+  stl_writer_open_dxf(&w, file, label);
+  stl_writer_put(&w, stl->facet_start, stl->stats.number_of_facets);
+  stl_writer_close(&w);
 }
 
 void
 stl_write_vertex(stl_file *stl, int facet, int vertex)
 {
+  stl_flush_transform(stl);
   printf("  vertex %d/%d % .8E % .8E % .8E\n", vertex, facet,
 	 stl->facet_start[facet].vertex[vertex].x,
 	 stl->facet_start[facet].vertex[vertex].y,
@@ -349,25 +631,15 @@ stl_write_quad_object(stl_file *stl, char *file)
   FILE      *fp;
   int       i;
   int       j;
-  char      *error_msg;
   stl_vertex connect_color;
   stl_vertex uncon_1_color;
   stl_vertex uncon_2_color;
   stl_vertex uncon_3_color;
   stl_vertex color;
   
-  /* Open the file */
-  fp = fopen(file, "w");
-  if(fp == NULL)
-    {
-      error_msg = (char*)
-	malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
-      sprintf(error_msg, "stl_write_quad_object: Couldn't open %s for writing",
-	      file);
-      perror(error_msg);
-      free(error_msg);
-      exit(1);
-    }
+  stl_flush_transform(stl);
+
+  fp = stl_open_output(file, "stl_write_quad_object");
 
   connect_color.x = 0.0;
   connect_color.y = 0.0;
@@ -421,56 +693,5 @@ stl_write_quad_object(stl_file *stl, char *file)
 	      stl->facet_start[i].vertex[2].y, 
 	      stl->facet_start[i].vertex[2].z, color.x, color.y, color.z);
     }
-  fclose(fp);
-}
-  
-void
-stl_write_dxf(stl_file *stl, char *file, char *label)
-{
-  int       i;
-  FILE      *fp;
-  char      *error_msg;
-  
-  
-  /* Open the file */
-  fp = fopen(file, "w");
-  if(fp == NULL)
-    {
-      error_msg = (char*)
-	malloc(81 + strlen(file)); /* Allow 80 chars+file size for message */
-      sprintf(error_msg, "stl_write_ascii: Couldn't open %s for writing",
-	      file);
-      perror(error_msg);
-      free(error_msg);
-      exit(1);
-    }
-  
-  fprintf(fp, "999\n%s\n", label);
-  fprintf(fp, "0\nSECTION\n2\nHEADER\n0\nENDSEC\n");
-  fprintf(fp, "0\nSECTION\n2\nTABLES\n0\nTABLE\n2\nLAYER\n70\n1\n\
-0\nLAYER\n2\n0\n70\n0\n62\n7\n6\nCONTINUOUS\n0\nENDTAB\n0\nENDSEC\n");
-  fprintf(fp, "0\nSECTION\n2\nBLOCKS\n0\nENDSEC\n");
-  
-  fprintf(fp, "0\nSECTION\n2\nENTITIES\n");
-
-  for(i = 0; i < stl->stats.number_of_facets; i++)
-    {
-      fprintf(fp, "0\n3DFACE\n8\n0\n");
-      fprintf(fp, "10\n%f\n20\n%f\n30\n%f\n",
-	      stl->facet_start[i].vertex[0].x, stl->facet_start[i].vertex[0].y,
-	      stl->facet_start[i].vertex[0].z);
-      fprintf(fp, "11\n%f\n21\n%f\n31\n%f\n",
-	      stl->facet_start[i].vertex[1].x, stl->facet_start[i].vertex[1].y,
-	      stl->facet_start[i].vertex[1].z);
-      fprintf(fp, "12\n%f\n22\n%f\n32\n%f\n",
-	      stl->facet_start[i].vertex[2].x, stl->facet_start[i].vertex[2].y,
-	      stl->facet_start[i].vertex[2].z);
-      fprintf(fp, "13\n%f\n23\n%f\n33\n%f\n",
-	      stl->facet_start[i].vertex[2].x, stl->facet_start[i].vertex[2].y,
-	      stl->facet_start[i].vertex[2].z);
-    }
-  
-  fprintf(fp, "0\nENDSEC\n0\nEOF\n");
-  
-  fclose(fp);
+  stl_close_output(fp, "stl_write_quad_object");
 }
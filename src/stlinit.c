@@ -23,9 +23,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <float.h>
+#include <stdint.h>
 #include <math.h>
 
 #include "stl.h"
+#include "config.h"
+
+#ifdef HAVE_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
 
 #if !defined(SEEK_SET)
 #define SEEK_SET 0
@@ -33,14 +43,107 @@
 #define SEEK_END 2
 #endif
 
+/* Number of facets read per fread() when the file can't be mapped */
+#define STL_READ_BLOCK_FACETS 4096
+
+/* Most facets allocated up front for a binary pipe, whose header can't be
+   checked.  More are allocated as they are read. */
+#define STL_PIPE_GUESS_FACETS (1 << 20)
+
+/* Initial size of the window the ASCII parser reads the file through */
+#define STL_ASCII_BUFFER_SIZE 65536
+
+#define STL_ASCII_IS_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+/* Smallest ASCII file that is worth parsing on several threads */
+#define STL_ASCII_PARALLEL_SIZE (4 * 1024 * 1024)
+
+/* State of the ASCII STL tokenizer */
+typedef struct
+{
+  FILE       *fp;		/* NULL if all of the input is in buf */
+  char       *buf;
+  size_t     size;		/* bytes allocated for buf */
+  size_t     pos;		/* next byte to look at */
+  size_t     end;		/* end of the data in buf */
+  int        line;		/* line and column of buf[pos] */
+  int        column;
+  const char *token;		/* the last token read, not terminated */
+  size_t     token_len;
+  int        token_line;
+  int        token_column;
+  const char *expected;		/* what was wanted when parsing failed */
+} stl_ascii_reader;
+
+/* Facets parsed by one thread out of a slice of a mapped ASCII file */
+typedef struct
+{
+  const char *start;
+  size_t     length;
+  stl_facet  *facets;
+  int        number_of_facets;
+  int        facets_malloced;
+  stl_vertex max;
+  stl_vertex min;
+  int        failed;
+} stl_ascii_chunk;
+
+/* Where stl_read_block() is in the file between calls */
+typedef struct
+{
+  stl_ascii_reader ascii;
+  unsigned char    *buf;	/* binary records being unpacked */
+  int              header_facets; /* what the header of a binary pipe
+				     said, to check at the end, or -1 */
+  float            *stages;	/* trafos flushed before stl->trafo */
+  int              num_stages;
+  int              sized;	/* the stats hold the size, which is
+				   only known after a pass */
+  int              facets_read;
+  int              done;
+} stl_block_reader;
+
+static void stl_refuse_cache(const char *file, const char *caller);
+static void stl_count_pipe(stl_file *stl, long size);
+static size_t stl_read_some(stl_file *stl, unsigned char *buf, size_t size);
+static int stl_read_bytes(stl_file *stl, unsigned char *buf, size_t size);
+static void stl_read_binary(stl_file *stl, int first_facet, int first);
+static void stl_read_binary_pipe(stl_file *stl, unsigned char *buf,
+				 int first_facet, int first);
+static void stl_decode_binary(stl_file *stl, const unsigned char *buf,
+			      int first_facet, int count, int first);
+static void stl_decode_facet(stl_facet *facet, const unsigned char *buf);
+static void stl_read_ascii(stl_file *stl, int first_facet, int first);
+#ifdef HAVE_MMAP
+static int stl_read_ascii_parallel(stl_file *stl, int first_facet, int first);
+#endif
+static void stl_extend_bounds(stl_vertex *max, stl_vertex *min,
+			      const stl_facet *facet);
+static void stl_size_from_bounds(stl_file *stl);
+static void stl_stage_blocks(stl_file *stl, stl_block_reader *reader);
+static int stl_trafo_mirrors(const float *trafo3x4);
+static void stl_reverse_block(stl_facet *facets, int count);
+static void stl_ascii_init(stl_ascii_reader *r, FILE *fp);
+static void stl_ascii_skip_line(stl_ascii_reader *r);
+static void stl_ascii_start(stl_file *stl, stl_ascii_reader *r);
+static int stl_ascii_next_facet(stl_ascii_reader *r, stl_facet *facet);
+static void stl_ascii_error(stl_ascii_reader *r);
+
 void
 stl_open(stl_file *stl, char *file)
 {
   stl_initialize(stl);
+  if(stl_is_cache(file))
+    {
+      stl_read_cache(stl, file);
+      return;
+    }
   stl_count_facets(stl, file);
   stl_allocate(stl);
   stl_read(stl, 0, 1);
   fclose(stl->fp);
+  free(stl->pushback);
+  stl->pushback = NULL;
 }
 
 
@@ -57,27 +160,57 @@ stl_initialize(stl_file *stl)
   stl->stats.original_num_facets = 0;
   stl->stats.number_of_facets = 0;
   stl->stats.volume = -1.0;
+  stl->stats.surface_area = -1.0;
   
+  stl->reader = NULL;
+  stl->pushback = NULL;
+  stl->pushback_pos = 0;
+  stl->pushback_len = 0;
   stl->neighbors_start = NULL;
   stl->facet_start = NULL;
   stl->v_indices = NULL;
   stl->v_shared = NULL;
+  stl->v_welded = 0;
+  stl->checked = 0;
+  stl->open_edges = NULL;
+  stl->num_open_edges = -1;
+  stl->part_ids = NULL;
+  stl->num_parts = -1;
+  stl->part_stats = NULL;
+  stl->num_part_stats = 0;
+  stl_trafo_identity(stl->trafo);
+  stl->trafo_pending = 0;
+  stl->size_pending = 0;
+  stl->edges.slots = NULL;
+  stl->edges.capacity = 0;
 }
 
+/* Opens file, or takes stdin if file is "-", and finds out its type, its
+   header and, for a binary file, the number of facets.  A pipe can't go
+   back to the start, so the bytes looked at to find this out are kept in
+   stl->pushback for stl_read() to use first. */
 void
 stl_count_facets(stl_file *stl, char *file)
 {
   long           file_size;
+  long           size;
   int            header_num_facets;
   int            num_facets;
-  int            i, j;
+  int            format;
+  int            i;
   size_t         s;
   unsigned char  chtest[128];
-  int            num_lines = 1;
   char           *error_msg;
 
   /* Open the file */
-  stl->fp = fopen(file, "r");
+  if(strcmp(file, "-") == 0)
+    {
+      stl->fp = stdin;
+    }
+  else
+    {
+      stl->fp = fopen(file, "r");
+    }
   if(stl->fp == NULL)
     {
       error_msg = (char*)
@@ -89,8 +222,24 @@ stl_count_facets(stl_file *stl, char *file)
       exit(1);
     }
   /* Find size of file */
-  fseek(stl->fp, 0, SEEK_END);
+  if(fseek(stl->fp, 0, SEEK_END) != 0)
+    {
+      stl_count_pipe(stl, -1);
+      return;
+    }
   file_size = ftell(stl->fp);
+
+  /* A compressed file is read through a decompressor, which can't tell
+     the size either */
+  rewind(stl->fp);
+  format = stl_compression_of(chtest, fread(chtest, 1, 4, stl->fp));
+  if(format != STL_COMPRESS_NONE)
+    {
+      size = stl_decompressed_size(stl->fp, format, file_size);
+      stl->fp = stl_open_decompressor(stl->fp, format, NULL, 0);
+      stl_count_pipe(stl, size);
+      return;
+    }
   
   /* Check for binary or ASCII file */
   fseek(stl->fp, HEADER_SIZE, SEEK_SET);
@@ -106,8 +255,11 @@ stl_count_facets(stl_file *stl, char *file)
 	{
 	  stl->stats.type = binary;
 	  /* close and reopen with binary flag (needed on Windows) */
-	  fclose(stl->fp);
-	  stl->fp = fopen(file, "rb");
+	  if(stl->fp != stdin)
+	    {
+	      fclose(stl->fp);
+	      stl->fp = fopen(file, "rb");
+	    }
 	  break;
 	}
     }
@@ -127,10 +279,12 @@ stl_count_facets(stl_file *stl, char *file)
       num_facets = (file_size - HEADER_SIZE) / SIZEOF_STL_FACET;
 
       /* Read the header */
-      if (fread(stl->stats.header, LABEL_SIZE, 1, stl->fp) > 79)
-      {
-        stl->stats.header[80] = '\0';
-      }
+      if(fread(stl->stats.header, LABEL_SIZE, 1, stl->fp) != 1)
+	{
+	  perror("stl_count_facets");
+	  exit(1);
+	}
+      stl->stats.header[80] = '\0';
 
       /* Read the int following the header.  This should contain # of facets */
       if((!fread(&header_num_facets, sizeof(int), 1, stl->fp)) || (num_facets != header_num_facets))
@@ -142,47 +296,142 @@ stl_count_facets(stl_file *stl, char *file)
   /* Otherwise, if the .STL file is ASCII, then do the following */
   else
     {
-      /* Find the number of facets */
-      j = 0;
-      for(i = 0; i < file_size ; i++)
-	{
-	  j++;
-	  if(getc(stl->fp) == '\n')
-	    {
-	      if(j > 4) /* don't count short lines */
-		{
-		  num_lines++;
-		}
-	      j = 0;
-	    }
-	}
-      rewind(stl->fp);
-
-      /* Get the header */
+      /* Get the header.  The facets are counted by stl_read() while it
+	 parses them, so the file only has to be read once. */
       for(i = 0; 
 	  (i < 80) && (stl->stats.header[i] = getc(stl->fp)) != '\n'; i++);
       stl->stats.header[i] = '\0'; /* Lose the '\n' */
       stl->stats.header[80] = '\0';
       
-      num_facets = num_lines / ASCII_LINES_PER_FACET;
+      num_facets = 0;
     }
   stl->stats.number_of_facets += num_facets;
   stl->stats.original_num_facets = stl->stats.number_of_facets;
 }
 
+/* Stops with an error if file is a cache, which only stl_open() reads */
+static void
+stl_refuse_cache(const char *file, const char *caller)
+{
+  if(stl_is_cache(file))
+    {
+      fprintf(stderr, "%s: %s is an ADMesh cache, which can only be opened "
+	      "on its own\n", caller, file);
+      exit(1);
+    }
+}
+
+/* Does what stl_count_facets() does for a pipe, which has no size to
+   check.  The number of facets in a binary header is only used to guess
+   how many to allocate; stl_read() reads them all up to the end of the
+   input.  A better guess is the size the data will have, if it is known
+   from a compressed file.  Compressed data is found here too, and read
+   on through a decompressor. */
+static void
+stl_count_pipe(stl_file *stl, long size)
+{
+  int    num_facets;
+  int    format;
+  size_t i;
+
+  stl->pushback = (unsigned char*)malloc(HEADER_SIZE + 128);
+  if(stl->pushback == NULL)
+    {
+      perror("stl_count_facets");
+      exit(1);
+    }
+  stl->pushback_len = fread(stl->pushback, 1, HEADER_SIZE + 128, stl->fp);
+  stl->pushback_pos = 0;
+  format = stl_compression_of(stl->pushback, stl->pushback_len);
+  if(format != STL_COMPRESS_NONE)
+    {
+      stl->fp = stl_open_decompressor(stl->fp, format, stl->pushback,
+				      stl->pushback_len);
+      free(stl->pushback);
+      stl->pushback = NULL;
+      stl_count_pipe(stl, -1);
+      return;
+    }
+  /* A cache has to be mapped or seeked in, so it can only be a file */
+  if(stl->pushback_len >= strlen(STL_CACHE_MAGIC)
+     && memcmp(stl->pushback, STL_CACHE_MAGIC, strlen(STL_CACHE_MAGIC)) == 0)
+    {
+      fprintf(stderr, "An ADMesh cache can't be read from a pipe or "
+	      "decompressed\n");
+      exit(1);
+    }
+  if(stl->pushback_len <= HEADER_SIZE)
+    {
+      fprintf(stderr, "The input is an empty file\n");
+      exit(1);
+    }
+
+  stl->stats.type = ascii;
+  for(i = HEADER_SIZE; i < stl->pushback_len; i++)
+    {
+      if(stl->pushback[i] > 127)
+	{
+	  stl->stats.type = binary;
+	  break;
+	}
+    }
+
+  if(stl->stats.type == binary)
+    {
+      memcpy(stl->stats.header, stl->pushback, LABEL_SIZE);
+      stl->stats.header[80] = '\0';
+      /* Read like the int following the header of a file */
+      memcpy(&num_facets, stl->pushback + LABEL_SIZE, sizeof(int));
+      if(num_facets < 0)
+	{
+	  fprintf(stderr, "The input has a negative number of facets, %d, "
+		  "in its header\n", num_facets);
+	  exit(1);
+	}
+      if(size >= HEADER_SIZE && (size - HEADER_SIZE) % SIZEOF_STL_FACET == 0)
+	{
+	  stl->stats.number_of_facets += (size - HEADER_SIZE) / SIZEOF_STL_FACET;
+	}
+      else
+	{
+	  stl->stats.number_of_facets += STL_MIN(num_facets,
+						 STL_PIPE_GUESS_FACETS);
+	}
+      stl->pushback_pos = HEADER_SIZE;
+    }
+  else
+    {
+      for(i = 0; i < 80 && stl->pushback[i] != '\n'; i++)
+	{
+	  stl->stats.header[i] = stl->pushback[i];
+	}
+      stl->stats.header[i] = '\0';
+      stl->stats.header[80] = '\0';
+    }
+  stl->stats.original_num_facets = stl->stats.number_of_facets;
+}
+
 void
 stl_allocate(stl_file *stl)
 {
   /*  Allocate memory for the entire .STL file */
-  stl->facet_start = (stl_facet*)calloc(stl->stats.number_of_facets, 
-			    sizeof(stl_facet));
-  if(stl->facet_start == NULL) perror("stl_initialize");
+  stl->facet_start = (stl_facet*)
+    calloc(STL_MAX(stl->stats.number_of_facets, 1), sizeof(stl_facet));
+  if(stl->facet_start == NULL)
+    {
+      perror("stl_initialize");
+      exit(1);
+    }
   stl->stats.facets_malloced = stl->stats.number_of_facets;
 
   /* Allocate memory for the neighbors list */
   stl->neighbors_start = (stl_neighbors*)
-    calloc(stl->stats.number_of_facets, sizeof(stl_neighbors));
-  if(stl->facet_start == NULL) perror("stl_initialize");
+    calloc(STL_MAX(stl->stats.number_of_facets, 1), sizeof(stl_neighbors));
+  if(stl->neighbors_start == NULL)
+    {
+      perror("stl_initialize");
+      exit(1);
+    }
 }
 
 void
@@ -193,6 +442,9 @@ stl_open_merge(stl_file *stl, char *file_to_merge)
   FILE *origFp;
   stl_file stl_to_merge;  
   
+  /* The facets read now aren't to be transformed */
+  stl_flush_transform(stl);
+
   /* Record how many facets we have so far from the first file.  We will start putting
      facets in the next position.  Since we're 0-indexed, it'l be the same position. */
   num_facets_so_far = stl->stats.number_of_facets;
@@ -204,12 +456,16 @@ stl_open_merge(stl_file *stl, char *file_to_merge)
   
   /* Initialize the sturucture with zero stats, header info and sizes: */
   stl_initialize(&stl_to_merge);
+  stl_refuse_cache(file_to_merge, "stl_open_merge");
   stl_count_facets(&stl_to_merge, file_to_merge);
   
   /* Copy what we need to into stl so that we can read the file_to_merge directly into it
      using stl_read:  Save the rest of the valuable info: */
   stl->stats.type=stl_to_merge.stats.type;
   stl->fp=stl_to_merge.fp;
+  stl->pushback=stl_to_merge.pushback;
+  stl->pushback_pos=stl_to_merge.pushback_pos;
+  stl->pushback_len=stl_to_merge.pushback_len;
   
   /* Add the number of facets we already have in stl with what we we found in stl_to_merge but 
      haven't read yet. */
@@ -223,16 +479,25 @@ stl_open_merge(stl_file *stl, char *file_to_merge)
      that this isn't our first time so we should augment stats like min and max 
      instead of erasing them. */
   stl_read(stl, num_facets_so_far, 0);
+  /* The new facets have no shared vertices or neighbors yet */
+  stl_invalidate_shared_vertices(stl);
+  stl_invalidate_parts(stl);
+  stl->checked = 0;
   
   /* Restore the stl information we overwrote (for stl_read) so that it still accurately
      reflects the subject part: */
+  fclose(stl->fp);
   stl->stats.type=origStlType;
   stl->fp=origFp;
+  free(stl->pushback);
+  stl->pushback=NULL;
 }
 
 extern void
 stl_reallocate(stl_file *stl)
 {
+  int old_facets = stl->stats.facets_malloced;
+
   /*  Reallocate more memory for the .STL file(s) */
   stl->facet_start = (stl_facet*)realloc(stl->facet_start, stl->stats.number_of_facets *
 			     sizeof(stl_facet));
@@ -244,6 +509,14 @@ stl_reallocate(stl_file *stl)
     realloc(stl->neighbors_start, stl->stats.number_of_facets *
 	    sizeof(stl_neighbors));
   if(stl->facet_start == NULL) perror("stl_initialize");
+  /* The new neighbors are cleared like those from stl_allocate(), as
+     reversing a facet touches them even when no check ran */
+  if(stl->neighbors_start != NULL && stl->stats.number_of_facets > old_facets)
+    {
+      memset(stl->neighbors_start + old_facets, 0,
+	     (stl->stats.number_of_facets - old_facets)
+	     * sizeof(stl_neighbors));
+    }
 }
 
 
@@ -253,55 +526,20 @@ stl_reallocate(stl_file *stl)
 void
 stl_read(stl_file *stl, int first_facet, int first)
 {
-  stl_facet facet;
-  int   i;
-
   if(stl->stats.type == binary)
     {
-      fseek(stl->fp, HEADER_SIZE, SEEK_SET);
+      stl_read_binary(stl, first_facet, first);
     }
   else
     {
-      rewind(stl->fp);
-      /* Skip the first line of the file */
-      while(getc(stl->fp) != '\n');
+      stl_read_ascii(stl, first_facet, first);
     }
+  stl_size_from_bounds(stl);
+}
 
-  for(i = first_facet; i < stl->stats.number_of_facets; i++)
-    {
-      if(stl->stats.type == binary)
-	/* Read a single facet from a binary .STL file */
-	{
-	    /* we assume little-endian architecture! */
-        if (fread(&facet.normal, sizeof(stl_normal), 1, stl->fp) \
-            + fread(&facet.vertex, sizeof(stl_vertex), 3, stl->fp) \
-            + fread(&facet.extra, sizeof(char), 2, stl->fp) != 6)
-	  {
-	    perror("Cannot read facet");
-	    exit(1);
-	  }
-	}
-      else
-	/* Read a single facet from an ASCII .STL file */
-	{
-      	  if((fscanf(stl->fp, "%*s %*s %f %f %f\n", &facet.normal.x, &facet.normal.y, &facet.normal.z) + \
-	     fscanf(stl->fp, "%*s %*s") + \
-	     fscanf(stl->fp, "%*s %f %f %f\n", &facet.vertex[0].x, &facet.vertex[0].y,  &facet.vertex[0].z) + \
-	     fscanf(stl->fp, "%*s %f %f %f\n", &facet.vertex[1].x, &facet.vertex[1].y,  &facet.vertex[1].z) + \
-	     fscanf(stl->fp, "%*s %f %f %f\n", &facet.vertex[2].x, &facet.vertex[2].y,  &facet.vertex[2].z) + \
-	     fscanf(stl->fp, "%*s") + \
-	     fscanf(stl->fp, "%*s")) != 12)
-	  {
-	    perror("Something is syntactically very wrong with this ASCII STL!");
-	    exit(1);
-	  }
-	}
-      /* Write the facet into memory. */
-      stl->facet_start[i] = facet;
-      
-      stl_facet_stats(stl, facet, first);
-      first = 0;
-    }
+static void
+stl_size_from_bounds(stl_file *stl)
+{
     stl->stats.size.x = stl->stats.max.x - stl->stats.min.x;
     stl->stats.size.y = stl->stats.max.y - stl->stats.min.y;
     stl->stats.size.z = stl->stats.max.z - stl->stats.min.z;
@@ -312,61 +550,1247 @@ stl_read(stl_file *stl, int first_facet, int first)
         );
 }
 
+/* Opens file to be read a block of facets at a time by stl_read_block(),
+   without keeping all of them in memory.  Only the header and the type
+   are known at first, and for a binary file the number of facets.  That
+   of a binary pipe is -1 until the end is read, as the header can't be
+   checked. */
 void
-stl_facet_stats(stl_file *stl, stl_facet facet, int first)
+stl_open_blocks(stl_file *stl, char *file)
 {
-    float diff_x;
-    float diff_y;
-    float diff_z;
-    float max_diff;
-      /* while we are going through all of the facets, let's find the  */
-      /* maximum and minimum values for x, y, and z  */
-
-      /* Initialize the max and min values the first time through*/
-    if (first) {
-	  stl->stats.max.x = facet.vertex[0].x;
-	  stl->stats.min.x = facet.vertex[0].x;
-	  stl->stats.max.y = facet.vertex[0].y;
-	  stl->stats.min.y = facet.vertex[0].y;
-	  stl->stats.max.z = facet.vertex[0].z;
-	  stl->stats.min.z = facet.vertex[0].z;
-	  
-	  diff_x = ABS(facet.vertex[0].x - facet.vertex[1].x);
-	  diff_y = ABS(facet.vertex[0].y - facet.vertex[1].y);
-	  diff_z = ABS(facet.vertex[0].z - facet.vertex[1].z);
-	  max_diff = STL_MAX(diff_x, diff_y);
-	  max_diff = STL_MAX(diff_z, max_diff);
-	  stl->stats.shortest_edge = max_diff;
+  stl_block_reader *reader;
 
-	  first = 0;
+  stl_initialize(stl);
+  stl_refuse_cache(file, "stl_open_blocks");
+  stl_count_facets(stl, file);
+  reader = (stl_block_reader*)calloc(1, sizeof(stl_block_reader));
+  if(reader == NULL)
+    {
+      perror("stl_open_blocks");
+      exit(1);
+    }
+  reader->header_facets = -1;
+  if(stl->stats.type == binary)
+    {
+      reader->buf = (unsigned char*)malloc(STL_READ_BLOCK_FACETS
+					   * SIZEOF_STL_FACET);
+      if(reader->buf == NULL)
+	{
+	  perror("stl_open_blocks");
+	  exit(1);
 	}
-    
-      /* now find the max and min values */
-      stl->stats.max.x = STL_MAX(stl->stats.max.x, facet.vertex[0].x);
-      stl->stats.min.x = STL_MIN(stl->stats.min.x, facet.vertex[0].x);
-      stl->stats.max.y = STL_MAX(stl->stats.max.y, facet.vertex[0].y);
-      stl->stats.min.y = STL_MIN(stl->stats.min.y, facet.vertex[0].y);
-      stl->stats.max.z = STL_MAX(stl->stats.max.z, facet.vertex[0].z);
-      stl->stats.min.z = STL_MIN(stl->stats.min.z, facet.vertex[0].z);
+      if(stl->pushback != NULL)
+	{
+	  memcpy(&reader->header_facets, stl->pushback + LABEL_SIZE,
+		 sizeof(int));
+	  stl->stats.number_of_facets = -1;
+	  stl->stats.original_num_facets = -1;
+	}
+    }
+  else
+    {
+      stl_ascii_start(stl, &reader->ascii);
+    }
+  stl->reader = reader;
+}
 
-      stl->stats.max.x = STL_MAX(stl->stats.max.x, facet.vertex[1].x);
-      stl->stats.min.x = STL_MIN(stl->stats.min.x, facet.vertex[1].x);
-      stl->stats.max.y = STL_MAX(stl->stats.max.y, facet.vertex[1].y);
-      stl->stats.min.y = STL_MIN(stl->stats.min.y, facet.vertex[1].y);
-      stl->stats.max.z = STL_MAX(stl->stats.max.z, facet.vertex[1].z);
-      stl->stats.min.z = STL_MIN(stl->stats.min.z, facet.vertex[1].z);
+/* Goes back to the first facet of a file opened by stl_open_blocks().  A
+   pipe can only be read once, but a compressed file can be decompressed
+   again. */
+void
+stl_rewind_blocks(stl_file *stl)
+{
+  stl_block_reader *reader = (stl_block_reader*)stl->reader;
 
-      stl->stats.max.x = STL_MAX(stl->stats.max.x, facet.vertex[2].x);
-      stl->stats.min.x = STL_MIN(stl->stats.min.x, facet.vertex[2].x);
-      stl->stats.max.y = STL_MAX(stl->stats.max.y, facet.vertex[2].y);
-      stl->stats.min.y = STL_MIN(stl->stats.min.y, facet.vertex[2].y);
-      stl->stats.max.z = STL_MAX(stl->stats.max.z, facet.vertex[2].z);
-      stl->stats.min.z = STL_MIN(stl->stats.min.z, facet.vertex[2].z);
+  if(reader->facets_read == 0 && !reader->done)
+    {
+      return;
+    }
+  if(stl->pushback != NULL)
+    {
+      if(fseek(stl->fp, 0, SEEK_SET) != 0)
+	{
+	  fprintf(stderr, "stl_rewind_blocks: Can't read a pipe twice\n");
+	  exit(1);
+	}
+      free(stl->pushback);
+      stl->pushback = NULL;
+    }
+  if(stl->stats.type == binary)
+    {
+      if(fseek(stl->fp, HEADER_SIZE, SEEK_SET) != 0)
+	{
+	  perror("stl_rewind_blocks");
+	  exit(1);
+	}
+    }
+  else
+    {
+      free(reader->ascii.buf);
+      stl_ascii_start(stl, &reader->ascii);
+    }
+  reader->facets_read = 0;
+  reader->done = 0;
 }
 
+/* Does what stl_flush_transform() does for a file opened by
+   stl_open_blocks().  Where a mesh in memory would have a transformation
+   that changes the size applied to its facets, it is kept as a step of
+   its own instead.  stl_read_block() rounds the facets to floats after
+   every step, so both write the same facets.  The size is found by
+   reading all of the facets once. */
 void
-stl_close(stl_file *stl)
+stl_flush_blocks(stl_file *stl)
+{
+  stl_block_reader *reader = (stl_block_reader*)stl->reader;
+
+  if(stl->size_pending && stl->trafo_pending)
+    {
+      stl_stage_blocks(stl, reader);
+    }
+  if(stl->size_pending || !reader->sized)
+    {
+      stl_scan_blocks(stl);
+    }
+  stl->size_pending = 0;
+}
+
+/* Keeps what is waiting in stl->trafo as a step of its own */
+static void
+stl_stage_blocks(stl_file *stl, stl_block_reader *reader)
+{
+  reader->stages = (float*)realloc(reader->stages,
+				   (reader->num_stages + 1) * 12
+				   * sizeof(float));
+  if(reader->stages == NULL)
+    {
+      perror("stl_stage_blocks");
+      exit(1);
+    }
+  memcpy(reader->stages + 12 * reader->num_stages, stl->trafo,
+	 12 * sizeof(float));
+  reader->num_stages++;
+  stl_trafo_identity(stl->trafo);
+  stl->trafo_pending = 0;
+}
+
+/* Whether trafo3x4 turns the mesh inside out */
+static int
+stl_trafo_mirrors(const float *trafo3x4)
+{
+  double det;
+
+  det = trafo3x4[0] * ((double)trafo3x4[5] * trafo3x4[10]
+		       - (double)trafo3x4[6] * trafo3x4[9])
+    - trafo3x4[1] * ((double)trafo3x4[4] * trafo3x4[10]
+		     - (double)trafo3x4[6] * trafo3x4[8])
+    + trafo3x4[2] * ((double)trafo3x4[4] * trafo3x4[9]
+		     - (double)trafo3x4[5] * trafo3x4[8]);
+  return det < 0.0;
+}
+
+/* Reverses count facets the way stl_reverse_all_facets() does.  There are
+   no neighbors to fix up, as the facets are on their own here. */
+static void
+stl_reverse_block(stl_facet *facets, int count)
+{
+  float      normals[3 * STL_NORMAL_BLOCK_FACETS];
+  stl_vertex tmp_vertex;
+  int        first;
+  int        block;
+  int        i;
+
+  for(first = 0; first < count; first += block)
+    {
+      block = STL_MIN(STL_NORMAL_BLOCK_FACETS, count - first);
+      for(i = first; i < first + block; i++)
+	{
+	  tmp_vertex = facets[i].vertex[0];
+	  facets[i].vertex[0] = facets[i].vertex[1];
+	  facets[i].vertex[1] = tmp_vertex;
+	}
+      stl_calculate_normals(normals, &facets[first], block);
+      for(i = 0; i < block; i++)
+	{
+	  facets[first + i].normal.x = normals[3 * i];
+	  facets[first + i].normal.y = normals[3 * i + 1];
+	  facets[first + i].normal.z = normals[3 * i + 2];
+	}
+    }
+}
+
+/* Reads up to max of the next facets into facets, transformed by the
+   steps stl_flush_blocks() kept and what is waiting in stl->trafo, and
+   returns how many were read, 0 at the end of the file.  A
+   transformation that mirrors would leave the facets inside out, so they
+   are reversed, like stl_calculate_volume() would do for a mesh in
+   memory.  The stats that stl_facet_stats() keeps are
+   gathered on the way, and at the end number_of_facets is the number of
+   facets read. */
+int
+stl_read_block(stl_file *stl, stl_facet *facets, int max)
 {
+  stl_block_reader *reader = (stl_block_reader*)stl->reader;
+  size_t           n;
+  int              count;
+  int              block;
+  int              status;
+  int              mirrors;
+  int              i;
+
+  if(reader->done)
+    {
+      return 0;
+    }
+
+  count = 0;
+  if(stl->stats.type == binary && stl->stats.original_num_facets < 0)
+    {
+      /* A pipe is read up to its end, whatever the header said */
+      for(; count < max; count += block)
+	{
+	  block = STL_MIN(STL_READ_BLOCK_FACETS, max - count);
+	  n = stl_read_some(stl, reader->buf, (size_t)block * SIZEOF_STL_FACET);
+	  if(n % SIZEOF_STL_FACET != 0)
+	    {
+	      fprintf(stderr, "The input has the wrong size.\n");
+	      exit(1);
+	    }
+	  for(i = 0; i < (int)(n / SIZEOF_STL_FACET); i++)
+	    {
+	      stl_decode_facet(&facets[count + i],
+			       reader->buf + (size_t)i * SIZEOF_STL_FACET);
+	    }
+	  if(n < (size_t)block * SIZEOF_STL_FACET)
+	    {
+	      count += n / SIZEOF_STL_FACET;
+	      break;
+	    }
+	}
+      if(ferror(stl->fp))
+	{
+	  perror("Cannot read facet");
+	  exit(1);
+	}
+    }
+  else if(stl->stats.type == binary)
+    {
+      max = STL_MIN(max, stl->stats.original_num_facets
+		    - reader->facets_read);
+      for(; count < max; count += block)
+	{
+	  block = STL_MIN(STL_READ_BLOCK_FACETS, max - count);
+	  if(!stl_read_bytes(stl, reader->buf,
+			     (size_t)block * SIZEOF_STL_FACET))
+	    {
+	      perror("Cannot read facet");
+	      exit(1);
+	    }
+	  for(i = 0; i < block; i++)
+	    {
+	      stl_decode_facet(&facets[count + i],
+			       reader->buf + (size_t)i * SIZEOF_STL_FACET);
+	    }
+	}
+    }
+  else
+    {
+      memset(facets, 0, max * sizeof(stl_facet));
+      while(count < max
+	    && (status = stl_ascii_next_facet(&reader->ascii,
+					      &facets[count])) > 0)
+	{
+	  count++;
+	}
+      if(count < max && status < 0)
+	{
+	  stl_ascii_error(&reader->ascii);
+	}
+    }
+
+  mirrors = 0;
+  for(i = 0; i < reader->num_stages; i++)
+    {
+      stl_transform_facets(reader->stages + 12 * i, facets, count,
+			   NULL, NULL);
+      mirrors ^= stl_trafo_mirrors(reader->stages + 12 * i);
+    }
+  if(stl->trafo_pending)
+    {
+      stl_transform_facets(stl->trafo, facets, count, NULL, NULL);
+      mirrors ^= stl_trafo_mirrors(stl->trafo);
+    }
+  if(mirrors)
+    {
+      stl_reverse_block(facets, count);
+    }
+  for(i = 0; i < count; i++)
+    {
+      stl_facet_stats(stl, facets[i], reader->facets_read + i == 0);
+    }
+  reader->facets_read += count;
+
+  if(count == 0)
+    {
+      if(reader->header_facets >= 0
+	 && reader->header_facets != reader->facets_read)
+	{
+	  fprintf(stderr, "Warning: File size doesn't match number of "
+		  "facets in the header\n");
+	}
+      reader->header_facets = -1;
+      reader->done = 1;
+      stl->stats.number_of_facets = reader->facets_read;
+      stl->stats.original_num_facets = reader->facets_read;
+      stl_size_from_bounds(stl);
+      reader->sized = 1;
+    }
+  return count;
+}
+
+/* Reads all of the facets of a file opened by stl_open_blocks() once, for
+   the stats that stl_read_block() gathers, and goes back to the first
+   facet */
+void
+stl_scan_blocks(stl_file *stl)
+{
+  stl_facet *facets;
+
+  facets = (stl_facet*)malloc(STL_CONVERT_BLOCK_FACETS * sizeof(stl_facet));
+  if(facets == NULL)
+    {
+      perror("stl_scan_blocks");
+      exit(1);
+    }
+  while(stl_read_block(stl, facets, STL_CONVERT_BLOCK_FACETS) > 0);
+  free(facets);
+  stl_rewind_blocks(stl);
+}
+
+/* Reads up to size bytes into buf, taking what stl_count_facets() kept of
+   a pipe first, and returns how many were read */
+static size_t
+stl_read_some(stl_file *stl, unsigned char *buf, size_t size)
+{
+  size_t n;
+
+  n = 0;
+  if(stl->pushback != NULL)
+    {
+      n = STL_MIN(size, stl->pushback_len - stl->pushback_pos);
+      memcpy(buf, stl->pushback + stl->pushback_pos, n);
+      stl->pushback_pos += n;
+    }
+  return n + fread(buf + n, 1, size - n, stl->fp);
+}
+
+/* Reads size bytes into buf.  Returns 0 if the input ends before that. */
+static int
+stl_read_bytes(stl_file *stl, unsigned char *buf, size_t size)
+{
+  return stl_read_some(stl, buf, size) == size;
+}
+
+/* Reads the binary facets following the header.  The whole file is mapped
+   into memory if possible, so the facets are decoded straight out of the
+   page cache in one pass.  Otherwise they are read in large blocks. */
+static void
+stl_read_binary(stl_file *stl, int first_facet, int first)
+{
+  unsigned char *buf;
+  int   count;
+  int   block;
+  int   i;
+#ifdef HAVE_MMAP
+  void  *map;
+  size_t map_size;
+#endif
+
+  count = stl->stats.number_of_facets - first_facet;
+  if(count <= 0 && stl->pushback == NULL)
+    {
+      return;
+    }
+
+#ifdef HAVE_MMAP
+  map_size = HEADER_SIZE + (size_t)count * SIZEOF_STL_FACET;
+  map = MAP_FAILED;
+  if(stl->pushback == NULL)
+    {
+      map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fileno(stl->fp), 0);
+    }
+  if(map != MAP_FAILED)
+    {
+#ifdef MADV_SEQUENTIAL
+      madvise(map, map_size, MADV_SEQUENTIAL);
+#endif
+      stl_decode_binary(stl, (unsigned char*)map + HEADER_SIZE,
+			first_facet, count, first);
+      munmap(map, map_size);
+      return;
+    }
+#endif
+
+  /* Fall back to reading the file through stdio */
+  buf = (unsigned char*)malloc(STL_READ_BLOCK_FACETS * SIZEOF_STL_FACET);
+  if(buf == NULL)
+    {
+      perror("stl_read");
+      exit(1);
+    }
+  if(stl->pushback != NULL)
+    {
+      stl_read_binary_pipe(stl, buf, first_facet, first);
+      free(buf);
+      return;
+    }
+  fseek(stl->fp, HEADER_SIZE, SEEK_SET);
+  for(i = 0; i < count; i += block)
+    {
+      block = STL_MIN(STL_READ_BLOCK_FACETS, count - i);
+      if(!stl_read_bytes(stl, buf, (size_t)block * SIZEOF_STL_FACET))
+	{
+	  perror("Cannot read facet");
+	  exit(1);
+	}
+      stl_decode_binary(stl, buf, first_facet + i, block, first);
+      first = 0;
+    }
+  free(buf);
+}
+
+/* Reads the binary facets of a pipe into buf a block at a time, up to the
+   end of the input, making room for more facets than the header said
+   there would be if it has to */
+static void
+stl_read_binary_pipe(stl_file *stl, unsigned char *buf, int first_facet,
+		     int first)
+{
+  size_t n;
+  int    header_num_facets;
+  int    block;
+  int    i;
+
+  memcpy(&header_num_facets, stl->pushback + LABEL_SIZE, sizeof(int));
+  for(i = first_facet; ; i += block)
+    {
+      n = stl_read_some(stl, buf, STL_READ_BLOCK_FACETS * SIZEOF_STL_FACET);
+      if(n % SIZEOF_STL_FACET != 0)
+	{
+	  fprintf(stderr, "The input has the wrong size.\n");
+	  exit(1);
+	}
+      block = n / SIZEOF_STL_FACET;
+      if(block == 0)
+	{
+	  break;
+	}
+      if(i + block > stl->stats.facets_malloced)
+	{
+	  stl->stats.number_of_facets =
+	    STL_MAX(2 * stl->stats.facets_malloced, i + block);
+	  stl_reallocate(stl);
+	}
+      stl_decode_binary(stl, buf, i, block, first);
+      first = 0;
+    }
+  if(ferror(stl->fp))
+    {
+      perror("Cannot read facet");
+      exit(1);
+    }
+  if(i - first_facet != header_num_facets)
+    {
+      fprintf(stderr, "Warning: File size doesn't match number of "
+	      "facets in the header\n");
+    }
+  stl->stats.number_of_facets = i;
+  if(first_facet == 0)
+    {
+      stl->stats.original_num_facets = i;
+    }
+}
+
+/* Unpacks one little-endian 50 byte facet record */
+static void
+stl_decode_facet(stl_facet *facet, const unsigned char *buf)
+{
+#ifdef WORDS_BIGENDIAN
+  unsigned char *p;
+  unsigned char tmp;
+  int           i;
+#endif
+
+  memcpy(&facet->normal, buf, sizeof(stl_normal));
+  memcpy(facet->vertex, buf + sizeof(stl_normal), 3 * sizeof(stl_vertex));
+  memcpy(facet->extra, buf + SIZEOF_STL_FACET - sizeof(stl_extra),
+	 sizeof(stl_extra));
+#ifdef WORDS_BIGENDIAN
+  /* Swap the normal and the vertices (12 floats in a row) into host order */
+  p = (unsigned char*)facet;
+  for(i = 0; i < 12; i++, p += 4)
+    {
+      tmp = p[0]; p[0] = p[3]; p[3] = tmp;
+      tmp = p[1]; p[1] = p[2]; p[2] = tmp;
+    }
+#endif
+}
+
+/* Unpacks count facet records from buf into facet_start, starting at facet
+   first_facet, and finds the max and min values in the same pass. */
+static void
+stl_decode_binary(stl_file *stl, const unsigned char *buf,
+		  int first_facet, int count, int first)
+{
+  stl_facet  *facet;
+  stl_vertex max;
+  stl_vertex min;
+  int        i;
+
+  i = 0;
+  if(first)
+    {
+      /* Let stl_facet_stats() initialize the stats from the first facet */
+      stl_decode_facet(&stl->facet_start[first_facet], buf);
+      stl_facet_stats(stl, stl->facet_start[first_facet], first);
+      i = 1;
+    }
+
+  max = stl->stats.max;
+  min = stl->stats.min;
+  for(; i < count; i++)
+    {
+      facet = &stl->facet_start[first_facet + i];
+      stl_decode_facet(facet, buf + (size_t)i * SIZEOF_STL_FACET);
+      stl_extend_bounds(&max, &min, facet);
+    }
+  stl->stats.max = max;
+  stl->stats.min = min;
+}
+
+/* Grows the max and min values to include the vertices of facet */
+static void
+stl_extend_bounds(stl_vertex *max, stl_vertex *min, const stl_facet *facet)
+{
+  int j;
+
+  for(j = 0; j < 3; j++)
+    {
+      max->x = STL_MAX(max->x, facet->vertex[j].x);
+      min->x = STL_MIN(min->x, facet->vertex[j].x);
+      max->y = STL_MAX(max->y, facet->vertex[j].y);
+      min->y = STL_MIN(min->y, facet->vertex[j].y);
+      max->z = STL_MAX(max->z, facet->vertex[j].z);
+      min->z = STL_MIN(min->z, facet->vertex[j].z);
+    }
+}
+
+/* Refills the reader's window, keeping the unread bytes.  Returns 0 at the
+   end of the input. */
+static int
+stl_ascii_fill(stl_ascii_reader *r)
+{
+  size_t n;
+
+  if(r->fp == NULL)
+    {
+      return 0;
+    }
+  if(r->pos > 0)
+    {
+      memmove(r->buf, r->buf + r->pos, r->end - r->pos);
+      r->end -= r->pos;
+      r->pos = 0;
+    }
+  if(r->end == r->size)
+    {
+      /* A single token fills the whole window */
+      r->size *= 2;
+      r->buf = (char*)realloc(r->buf, r->size);
+      if(r->buf == NULL)
+	{
+	  perror("stl_read");
+	  exit(1);
+	}
+    }
+  n = fread(r->buf + r->end, 1, r->size - r->end, r->fp);
+  r->end += n;
+  return n > 0;
+}
+
+static void
+stl_ascii_init(stl_ascii_reader *r, FILE *fp)
+{
+  r->fp = fp;
+  r->size = STL_ASCII_BUFFER_SIZE;
+  r->buf = (char*)malloc(r->size);
+  if(r->buf == NULL)
+    {
+      perror("stl_read");
+      exit(1);
+    }
+  r->pos = 0;
+  r->end = 0;
+  r->line = 1;
+  r->column = 1;
+  r->token = r->buf;
+  r->token_len = 0;
+  r->token_line = 1;
+  r->token_column = 1;
+  r->expected = NULL;
+}
+
+/* Sets up r to parse the facets of stl->fp from the start, past the line
+   that holds the header */
+static void
+stl_ascii_start(stl_file *stl, stl_ascii_reader *r)
+{
+  if(stl->pushback != NULL)
+    {
+      /* A pipe can't be rewound, but its first bytes were kept */
+      stl_ascii_init(r, stl->fp);
+      r->end = stl->pushback_len - stl->pushback_pos;
+      memcpy(r->buf, stl->pushback + stl->pushback_pos, r->end);
+      stl->pushback_pos = stl->pushback_len;
+    }
+  else
+    {
+      rewind(stl->fp);
+      stl_ascii_init(r, stl->fp);
+    }
+  stl_ascii_skip_line(r);
+}
+
+#ifdef HAVE_MMAP
+/* Sets up a reader for input that is entirely in memory */
+static void
+stl_ascii_init_memory(stl_ascii_reader *r, const char *buf, size_t length)
+{
+  r->fp = NULL;
+  r->buf = (char*)buf;
+  r->size = length;
+  r->pos = 0;
+  r->end = length;
+  r->line = 1;
+  r->column = 1;
+  r->token = buf;
+  r->token_len = 0;
+  r->token_line = 1;
+  r->token_column = 1;
+  r->expected = NULL;
+}
+#endif
+
+/* Skips everything up to and including the next newline */
+static void
+stl_ascii_skip_line(stl_ascii_reader *r)
+{
+  for(;;)
+    {
+      if(r->pos == r->end && !stl_ascii_fill(r))
+	{
+	  return;
+	}
+      if(r->buf[r->pos++] == '\n')
+	{
+	  r->line++;
+	  r->column = 1;
+	  return;
+	}
+      r->column++;
+    }
+}
+
+/* Reads the next white space separated token.  Returns 0 at the end of
+   the input. */
+static int
+stl_ascii_next_token(stl_ascii_reader *r)
+{
+  size_t start;
+  size_t i;
+  size_t len;
+
+  /* Skip white space */
+  for(;;)
+    {
+      if(r->pos == r->end && !stl_ascii_fill(r))
+	{
+	  r->token_len = 0;
+	  r->token_line = r->line;
+	  r->token_column = r->column;
+	  return 0;
+	}
+      if(r->buf[r->pos] == '\n')
+	{
+	  r->line++;
+	  r->column = 1;
+	}
+      else if(STL_ASCII_IS_SPACE(r->buf[r->pos]))
+	{
+	  r->column++;
+	}
+      else
+	{
+	  break;
+	}
+      r->pos++;
+    }
+
+  /* Find the end of the token, refilling if it runs past the window */
+  start = r->pos;
+  i = start;
+  for(;;)
+    {
+      while(i < r->end && !STL_ASCII_IS_SPACE(r->buf[i]))
+	{
+	  i++;
+	}
+      if(i < r->end)
+	{
+	  break;
+	}
+      len = i - start;
+      if(!stl_ascii_fill(r))
+	{
+	  break;
+	}
+      start = r->pos;
+      i = start + len;
+    }
+
+  r->token = r->buf + start;
+  r->token_len = i - start;
+  r->token_line = r->line;
+  r->token_column = r->column;
+  r->column += (int)r->token_len;
+  r->pos = i;
+  return 1;
+}
+
+/* Case insensitive comparison of the last token with a keyword */
+static int
+stl_ascii_is(stl_ascii_reader *r, const char *keyword)
+{
+  size_t i;
+
+  for(i = 0; i < r->token_len; i++)
+    {
+      if(keyword[i] == '\0' || 
+	 tolower((unsigned char)r->token[i]) != keyword[i])
+	{
+	  return 0;
+	}
+    }
+  return keyword[i] == '\0';
+}
+
+/* Reports the token a parse failed on and quits */
+static void
+stl_ascii_error(stl_ascii_reader *r)
+{
+  if(r->token_len == 0)
+    {
+      fprintf(stderr, "\
+ASCII STL syntax error at line %d, column %d: expected %s, found end of file\n",
+	      r->token_line, r->token_column, r->expected);
+    }
+  else
+    {
+      fprintf(stderr, "\
+ASCII STL syntax error at line %d, column %d: expected %s, found '%.*s'\n",
+	      r->token_line, r->token_column, r->expected,
+	      (int)STL_MIN(r->token_len, 40), r->token);
+    }
+  exit(1);
+}
+
+static int
+stl_ascii_expect(stl_ascii_reader *r, const char *keyword, const char *quoted)
+{
+  if(!stl_ascii_next_token(r) || !stl_ascii_is(r, keyword))
+    {
+      r->expected = quoted;
+      return 0;
+    }
+  return 1;
+}
+
+/* Converts a decimal number to the nearest float, like strtof() does.
+   Numbers with up to 19 significant digits and a small decimal exponent are
+   converted with a single exact-or-correctly-rounded double operation;
+   everything else is handed to strtof().  Returns 0 if s is not a number. */
+static int
+stl_parse_float(const char *s, size_t len, float *value)
+{
+  static const double powers[] =
+    {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+  const char *p;
+  const char *end;
+  uint64_t   mantissa = 0;
+  int        digits = 0;
+  int        any_digits = 0;
+  int        exponent = 0;
+  int        e;
+  int        negative = 0;
+  int        exp_negative;
+  double     d;
+  char       tmp[64];
+  char       *tmp_end;
+  union
+    {
+      double   d;
+      uint64_t u;
+    } bits;
+
+  p = s;
+  end = s + len;
+  if(p < end && (*p == '-' || *p == '+'))
+    {
+      negative = (*p == '-');
+      p++;
+    }
+  for(; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+      if(digits == 19)
+	goto slow;
+      mantissa = mantissa * 10 + (*p - '0');
+      digits += (mantissa != 0);
+      any_digits = 1;
+    }
+  if(p < end && *p == '.')
+    {
+      for(p++; p < end && *p >= '0' && *p <= '9'; p++)
+	{
+	  if(digits == 19)
+	    goto slow;
+	  mantissa = mantissa * 10 + (*p - '0');
+	  digits += (mantissa != 0);
+	  exponent--;
+	  any_digits = 1;
+	}
+    }
+  if(!any_digits)
+    goto slow;
+  if(p < end && (*p == 'e' || *p == 'E'))
+    {
+      p++;
+      exp_negative = 0;
+      if(p < end && (*p == '-' || *p == '+'))
+	{
+	  exp_negative = (*p == '-');
+	  p++;
+	}
+      if(p == end)
+	goto slow;
+      for(e = 0; p < end && *p >= '0' && *p <= '9'; p++)
+	{
+	  if(e < 10000)
+	    e = e * 10 + (*p - '0');
+	}
+      exponent += exp_negative ? -e : e;
+    }
+  if(p != end)
+    goto slow;
+
+  if(mantissa == 0)
+    {
+      *value = negative ? -0.0f : 0.0f;
+      return 1;
+    }
+  if(mantissa > ((uint64_t)1 << 53) || exponent < -22 || exponent > 22)
+    goto slow;
+
+  /* Both operands are exact, so d is the correctly rounded double */
+  d = (double)mantissa;
+  if(exponent < 0)
+    d /= powers[-exponent];
+  else
+    d *= powers[exponent];
+
+  /* Rounding d to float would round twice if d landed exactly halfway
+     between two floats */
+  bits.d = d;
+  if((bits.u & 0x1FFFFFFF) == 0x10000000 || d < FLT_MIN || d > FLT_MAX)
+    goto slow;
+
+  *value = (float)(negative ? -d : d);
+  return 1;
+
+ slow:
+  if(len == 0 || len >= sizeof(tmp))
+    {
+      return 0;
+    }
+  memcpy(tmp, s, len);
+  tmp[len] = '\0';
+  *value = strtof(tmp, &tmp_end);
+  return tmp_end == tmp + len;
+}
+
+static int
+stl_ascii_read_float(stl_ascii_reader *r, float *value)
+{
+  if(!stl_ascii_next_token(r)
+     || !stl_parse_float(r->token, r->token_len, value))
+    {
+      r->expected = "a number";
+      return 0;
+    }
+  return 1;
+}
+
+static int
+stl_ascii_read_vector(stl_ascii_reader *r, float *x, float *y, float *z)
+{
+  return stl_ascii_read_float(r, x)
+    && stl_ascii_read_float(r, y)
+    && stl_ascii_read_float(r, z);
+}
+
+/* Parses the next "facet normal ... endfacet" block, skipping the solid and
+   endsolid lines around it.  Returns 1 if a facet was read, 0 at the end of
+   the input and -1 if the input doesn't parse. */
+static int
+stl_ascii_next_facet(stl_ascii_reader *r, stl_facet *facet)
+{
+  for(;;)
+    {
+      if(!stl_ascii_next_token(r))
+	{
+	  return 0;
+	}
+      if(!stl_ascii_is(r, "endsolid") && !stl_ascii_is(r, "solid"))
+	{
+	  break;
+	}
+      /* The rest of the line is the name of the solid */
+      stl_ascii_skip_line(r);
+    }
+  if(!stl_ascii_is(r, "facet"))
+    {
+      r->expected = "'facet'";
+      return -1;
+    }
+
+  if(   stl_ascii_expect(r, "normal", "'normal'")
+     && stl_ascii_read_vector(r, &facet->normal.x, &facet->normal.y,
+			      &facet->normal.z)
+     && stl_ascii_expect(r, "outer", "'outer'")
+     && stl_ascii_expect(r, "loop", "'loop'")
+     && stl_ascii_expect(r, "vertex", "'vertex'")
+     && stl_ascii_read_vector(r, &facet->vertex[0].x, &facet->vertex[0].y,
+			      &facet->vertex[0].z)
+     && stl_ascii_expect(r, "vertex", "'vertex'")
+     && stl_ascii_read_vector(r, &facet->vertex[1].x, &facet->vertex[1].y,
+			      &facet->vertex[1].z)
+     && stl_ascii_expect(r, "vertex", "'vertex'")
+     && stl_ascii_read_vector(r, &facet->vertex[2].x, &facet->vertex[2].y,
+			      &facet->vertex[2].z)
+     && stl_ascii_expect(r, "endloop", "'endloop'")
+     && stl_ascii_expect(r, "endfacet", "'endfacet'"))
+    {
+      return 1;
+    }
+  return -1;
+}
+
+/* Parses the facets of an ASCII file in a single pass, growing facet_start
+   and neighbors_start as it goes.  Sets number_of_facets when done. */
+static void
+stl_read_ascii(stl_file *stl, int first_facet, int first)
+{
+  stl_ascii_reader reader;
+  stl_facet        facet;
+  int              reset_original;
+  int              status;
+  int              i;
+
+#ifdef HAVE_MMAP
+  if(stl_get_threads() > 1 && stl_read_ascii_parallel(stl, first_facet, first))
+    {
+      return;
+    }
+#endif
+
+  reset_original = first;
+  memset(&facet, 0, sizeof(facet));
+
+  stl_ascii_start(stl, &reader);
+
+  i = first_facet;
+  while((status = stl_ascii_next_facet(&reader, &facet)) > 0)
+    {
+      if(i == stl->stats.facets_malloced)
+	{
+	  stl->stats.number_of_facets = STL_MAX(2 * i, 1024);
+	  stl_reallocate(stl);
+	}
+      /* Write the facet into memory. */
+      stl->facet_start[i] = facet;
+      stl_facet_stats(stl, facet, first);
+      first = 0;
+      i++;
+    }
+  if(status < 0)
+    {
+      stl_ascii_error(&reader);
+    }
+  free(reader.buf);
+
+  stl->stats.number_of_facets = i;
+  if(reset_original)
+    {
+      stl->stats.original_num_facets = i;
+    }
+}
+
+#ifdef HAVE_MMAP
+/* Moves pos forward to the next "facet" keyword that starts a token and is
+   followed by "normal" */
+static size_t
+stl_ascii_snap(const char *buf, size_t pos, size_t end)
+{
+  stl_ascii_reader r;
+
+  for(; pos < end; pos++)
+    {
+      if(   (buf[pos] != 'f' && buf[pos] != 'F')
+	 || !STL_ASCII_IS_SPACE(buf[pos - 1]))
+	{
+	  continue;
+	}
+      stl_ascii_init_memory(&r, buf + pos, STL_MIN(end - pos, 256));
+      if(   stl_ascii_next_token(&r) && stl_ascii_is(&r, "facet")
+	 && stl_ascii_next_token(&r) && stl_ascii_is(&r, "normal"))
+	{
+	  return pos;
+	}
+    }
+  return end;
+}
+
+static void
+stl_ascii_parse_chunk(void *arg, int task)
+{
+  stl_ascii_chunk  *chunk = (stl_ascii_chunk*)arg + task;
+  stl_ascii_reader reader;
+  stl_facet        facet;
+  int              status;
+
+  memset(&facet, 0, sizeof(facet));
+  stl_ascii_init_memory(&reader, chunk->start, chunk->length);
+  while((status = stl_ascii_next_facet(&reader, &facet)) > 0)
+    {
+      if(chunk->number_of_facets == chunk->facets_malloced)
+	{
+	  chunk->facets_malloced = STL_MAX(2 * chunk->facets_malloced, 1024);
+	  chunk->facets = (stl_facet*)realloc(chunk->facets,
+			    chunk->facets_malloced * sizeof(stl_facet));
+	  if(chunk->facets == NULL)
+	    {
+	      chunk->failed = 1;
+	      return;
+	    }
+	}
+      if(chunk->number_of_facets == 0)
+	{
+	  chunk->max = facet.vertex[0];
+	  chunk->min = facet.vertex[0];
+	}
+      stl_extend_bounds(&chunk->max, &chunk->min, &facet);
+      chunk->facets[chunk->number_of_facets++] = facet;
+    }
+  chunk->failed = (status < 0);
+}
+
+/* Maps the file, cuts it into slices that begin at a "facet normal" and
+   parses the slices on several threads.  The facets are then copied into
+   facet_start in file order and the stats of the slices are combined.
+   Returns 0 if the file is too small or can't be mapped, and also if any
+   slice fails to parse, so the serial reader can point at the error. */
+static int
+stl_read_ascii_parallel(stl_file *stl, int first_facet, int first)
+{
+  struct stat     st;
+  char            *map;
+  size_t          size;
+  size_t          start;
+  size_t          pos;
+  stl_ascii_chunk *chunks;
+  int             num_chunks;
+  int             total;
+  int             failed;
+  int             i;
+
+  if(fstat(fileno(stl->fp), &st) != 0 || st.st_size < STL_ASCII_PARALLEL_SIZE)
+    {
+      return 0;
+    }
+  size = (size_t)st.st_size;
+  map = (char*)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(stl->fp), 0);
+  if(map == MAP_FAILED)
+    {
+      return 0;
+    }
+
+  /* Skip the first line of the file, it holds the header */
+  for(start = 0; start < size && map[start] != '\n'; start++);
+  if(start < size)
+    {
+      start++;
+    }
+
+  /* A few slices per thread keep them all busy until the end */
+  num_chunks = 4 * stl_get_threads();
+  chunks = (stl_ascii_chunk*)calloc(num_chunks, sizeof(stl_ascii_chunk));
+  if(chunks == NULL)
+    {
+      munmap(map, size);
+      return 0;
+    }
+  pos = start;
+  for(i = 0; i < num_chunks; i++)
+    {
+      chunks[i].start = map + pos;
+      if(i == num_chunks - 1)
+	{
+	  pos = size;
+	}
+      else
+	{
+	  pos = STL_MAX(pos, start + (size - start) / num_chunks * (i + 1));
+	  pos = stl_ascii_snap(map, pos, size);
+	}
+      chunks[i].length = map + pos - chunks[i].start;
+    }
+
+  stl_parallel_run(num_chunks, stl_ascii_parse_chunk, chunks);
+
+  total = 0;
+  failed = 0;
+  for(i = 0; i < num_chunks; i++)
+    {
+      total += chunks[i].number_of_facets;
+      failed |= chunks[i].failed;
+    }
+
+  if(!failed)
+    {
+      /* Stitch the slices together in file order */
+      stl->stats.number_of_facets = first_facet + total;
+      stl_reallocate(stl);
+      total = first_facet;
+      for(i = 0; i < num_chunks; i++)
+	{
+	  if(chunks[i].number_of_facets == 0)
+	    {
+	      continue;
+	    }
+	  memcpy(stl->facet_start + total, chunks[i].facets,
+		 chunks[i].number_of_facets * sizeof(stl_facet));
+	  total += chunks[i].number_of_facets;
+
+	  /* Seed the stats from the very first facet, like stl_facet_stats()
+	     does in the serial reader, then fold in the slice's bounds */
+	  if(first)
+	    {
+	      stl_facet_stats(stl, chunks[i].facets[0], first);
+	      first = 0;
+	      stl->stats.original_num_facets = stl->stats.number_of_facets;
+	    }
+	  stl->stats.max.x = STL_MAX(stl->stats.max.x, chunks[i].max.x);
+	  stl->stats.max.y = STL_MAX(stl->stats.max.y, chunks[i].max.y);
+	  stl->stats.max.z = STL_MAX(stl->stats.max.z, chunks[i].max.z);
+	  stl->stats.min.x = STL_MIN(stl->stats.min.x, chunks[i].min.x);
+	  stl->stats.min.y = STL_MIN(stl->stats.min.y, chunks[i].min.y);
+	  stl->stats.min.z = STL_MIN(stl->stats.min.z, chunks[i].min.z);
+	}
+    }
+
+  for(i = 0; i < num_chunks; i++)
+    {
+      free(chunks[i].facets);
+    }
+  free(chunks);
+  munmap(map, size);
+  return !failed;
+}
+#endif
+
+void
+stl_facet_stats(stl_file *stl, stl_facet facet, int first)
+{
+    float diff_x;
+    float diff_y;
+    float diff_z;
+    float max_diff;
+      /* while we are going through all of the facets, let's find the  */
+      /* maximum and minimum values for x, y, and z  */
+
+      /* Initialize the max and min values the first time through*/
+    if (first) {
+	  stl->stats.max.x = facet.vertex[0].x;
+	  stl->stats.min.x = facet.vertex[0].x;
+	  stl->stats.max.y = facet.vertex[0].y;
+	  stl->stats.min.y = facet.vertex[0].y;
+	  stl->stats.max.z = facet.vertex[0].z;
+	  stl->stats.min.z = facet.vertex[0].z;
+	  
+	  diff_x = ABS(facet.vertex[0].x - facet.vertex[1].x);
+	  diff_y = ABS(facet.vertex[0].y - facet.vertex[1].y);
+	  diff_z = ABS(facet.vertex[0].z - facet.vertex[1].z);
+	  max_diff = STL_MAX(diff_x, diff_y);
+	  max_diff = STL_MAX(diff_z, max_diff);
+	  stl->stats.shortest_edge = max_diff;
+
+	  first = 0;
+	}
+    
+      /* now find the max and min values */
+      stl->stats.max.x = STL_MAX(stl->stats.max.x, facet.vertex[0].x);
+      stl->stats.min.x = STL_MIN(stl->stats.min.x, facet.vertex[0].x);
+      stl->stats.max.y = STL_MAX(stl->stats.max.y, facet.vertex[0].y);
+      stl->stats.min.y = STL_MIN(stl->stats.min.y, facet.vertex[0].y);
+      stl->stats.max.z = STL_MAX(stl->stats.max.z, facet.vertex[0].z);
+      stl->stats.min.z = STL_MIN(stl->stats.min.z, facet.vertex[0].z);
+
+      stl->stats.max.x = STL_MAX(stl->stats.max.x, facet.vertex[1].x);
+      stl->stats.min.x = STL_MIN(stl->stats.min.x, facet.vertex[1].x);
+      stl->stats.max.y = STL_MAX(stl->stats.max.y, facet.vertex[1].y);
+      stl->stats.min.y = STL_MIN(stl->stats.min.y, facet.vertex[1].y);
+      stl->stats.max.z = STL_MAX(stl->stats.max.z, facet.vertex[1].z);
+      stl->stats.min.z = STL_MIN(stl->stats.min.z, facet.vertex[1].z);
+
+      stl->stats.max.x = STL_MAX(stl->stats.max.x, facet.vertex[2].x);
+      stl->stats.min.x = STL_MIN(stl->stats.min.x, facet.vertex[2].x);
+      stl->stats.max.y = STL_MAX(stl->stats.max.y, facet.vertex[2].y);
+      stl->stats.min.y = STL_MIN(stl->stats.min.y, facet.vertex[2].y);
+      stl->stats.max.z = STL_MAX(stl->stats.max.z, facet.vertex[2].z);
+      stl->stats.min.z = STL_MIN(stl->stats.min.z, facet.vertex[2].z);
+}
+
+void
+stl_close(stl_file *stl)
+{
+    stl_block_reader *reader = (stl_block_reader*)stl->reader;
+
+    if(reader != NULL)
+      {
+	free(reader->buf);
+	free(reader->ascii.buf);
+	free(reader->stages);
+	free(reader);
+	fclose(stl->fp);
+	stl->reader = NULL;
+      }
+    if(stl->pushback != NULL)
+      {
+	free(stl->pushback);
+	stl->pushback = NULL;
+      }
     if(stl->neighbors_start != NULL)
 	free(stl->neighbors_start);
     if(stl->facet_start != NULL)
@@ -375,5 +1799,13 @@ stl_close(stl_file *stl)
 	free(stl->v_indices);
     if(stl->v_shared != NULL)
 	free(stl->v_shared);
+    if(stl->edges.slots != NULL)
+	free(stl->edges.slots);
+    if(stl->open_edges != NULL)
+	free(stl->open_edges);
+    if(stl->part_ids != NULL)
+	free(stl->part_ids);
+    if(stl->part_stats != NULL)
+	free(stl->part_stats);
 }
 
@@ -0,0 +1,421 @@
+/*  ADMesh -- process triangulated solid meshes
+ *  Copyright (C) 1995, 1996  Anthony D. Martin <amartin@engr.csulb.edu>
+ *  Copyright (C) 2013, 2014  several contributors, see AUTHORS
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+
+ *  You should have received a copy of the GNU General Public License along
+ *  with this program; if not, write to the Free Software Foundation, Inc.,
+ *  51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ *  Questions, comments, suggestions, etc to
+ *           https://github.com/hroncok/admesh/issues
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "stl.h"
+
+/* Size of the buffer of a stream that writes to a file */
+#define STL_STREAM_BUFFER_SIZE 262144
+
+/* Room reserved for one formatted number, more than "%f" of FLT_MAX needs */
+#define STL_STREAM_MAX_NUMBER  64
+
+/* Items formatted by one task of stl_stream_put_parallel() */
+#define STL_STREAM_BLOCK_ITEMS 8192
+
+typedef struct
+{
+  stl_stream *blocks;
+  void       (*func)(stl_stream *s, void *arg, int first, int last);
+  void       *arg;
+  int        first;
+  int        count;
+} stl_stream_job;
+
+static void stl_stream_reserve(stl_stream *s, size_t length);
+static int stl_format_float_f(char *p, float value);
+static int stl_format_float_e(char *p, float value);
+static char *stl_format_digits(char *p, unsigned value, int count);
+static char *stl_format_unsigned(char *p, unsigned value);
+static void stl_stream_format_block(void *arg, int block);
+
+/* Powers of ten that a double holds exactly */
+static const double stl_powers_of_ten[] =
+{
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Sets up s to buffer the output to fp.  With fp == NULL everything is
+   kept in memory and the buffer grows as needed. */
+void
+stl_stream_open(stl_stream *s, FILE *fp)
+{
+  s->fp = fp;
+  s->used = 0;
+  s->size = STL_STREAM_BUFFER_SIZE;
+  s->buf = (char*)malloc(s->size);
+  if(s->buf == NULL)
+    {
+      perror("stl_stream_open");
+      exit(1);
+    }
+}
+
+void
+stl_stream_flush(stl_stream *s)
+{
+  if(s->fp == NULL || s->used == 0)
+    {
+      return;
+    }
+  if(fwrite(s->buf, 1, s->used, s->fp) != s->used)
+    {
+      perror("stl_stream_flush");
+      exit(1);
+    }
+  s->used = 0;
+}
+
+/* Flushes s, frees its buffer and closes its file */
+void
+stl_stream_close(stl_stream *s)
+{
+  stl_stream_flush(s);
+  free(s->buf);
+  s->buf = NULL;
+  if(s->fp != NULL)
+    {
+      stl_close_output(s->fp, "stl_stream_close");
+    }
+  s->fp = NULL;
+}
+
+/* Makes room for length more bytes at s->buf + s->used */
+static void
+stl_stream_reserve(stl_stream *s, size_t length)
+{
+  if(s->used + length <= s->size)
+    {
+      return;
+    }
+  if(s->fp != NULL)
+    {
+      stl_stream_flush(s);
+      if(length <= s->size)
+	{
+	  return;
+	}
+    }
+  while(s->used + length > s->size)
+    {
+      s->size *= 2;
+    }
+  s->buf = (char*)realloc(s->buf, s->size);
+  if(s->buf == NULL)
+    {
+      perror("stl_stream_reserve");
+      exit(1);
+    }
+}
+
+void
+stl_stream_write(stl_stream *s, const char *data, size_t length)
+{
+  stl_stream_reserve(s, length);
+  memcpy(s->buf + s->used, data, length);
+  s->used += length;
+}
+
+void
+stl_stream_puts(stl_stream *s, const char *str)
+{
+  stl_stream_write(s, str, strlen(str));
+}
+
+/* Writes items 0 .. count - 1 to s by calling func(s, arg, first, last)
+   for ranges of them.  With more than one thread the ranges are formatted
+   into memory streams side by side and then written in order, a few
+   blocks per thread at a time, so the output is the same as from a single
+   call.  func must only read shared data. */
+void
+stl_stream_put_parallel(stl_stream *s, int count,
+			void (*func)(stl_stream *s, void *arg,
+				     int first, int last),
+			void *arg)
+{
+  stl_stream_job job;
+  int            num_blocks;
+  int            i;
+
+  if(stl_get_threads() <= 1 || count <= STL_STREAM_BLOCK_ITEMS)
+    {
+      func(s, arg, 0, count);
+      return;
+    }
+
+  num_blocks = 4 * stl_get_threads();
+  job.blocks = (stl_stream*)malloc(num_blocks * sizeof(stl_stream));
+  if(job.blocks == NULL)
+    {
+      perror("stl_stream_put_parallel");
+      exit(1);
+    }
+  for(i = 0; i < num_blocks; i++)
+    {
+      stl_stream_open(&job.blocks[i], NULL);
+    }
+  job.func = func;
+  job.arg = arg;
+  job.count = count;
+
+  for(job.first = 0; job.first < count;
+      job.first += num_blocks * STL_STREAM_BLOCK_ITEMS)
+    {
+      stl_parallel_run(STL_MIN(num_blocks,
+			       (count - job.first + STL_STREAM_BLOCK_ITEMS - 1)
+			       / STL_STREAM_BLOCK_ITEMS),
+		       stl_stream_format_block, &job);
+      for(i = 0; i < num_blocks; i++)
+	{
+	  stl_stream_write(s, job.blocks[i].buf, job.blocks[i].used);
+	  job.blocks[i].used = 0;
+	}
+    }
+
+  for(i = 0; i < num_blocks; i++)
+    {
+      stl_stream_close(&job.blocks[i]);
+    }
+  free(job.blocks);
+}
+
+static void
+stl_stream_format_block(void *arg, int block)
+{
+  stl_stream_job *job = (stl_stream_job*)arg;
+  int            first;
+
+  first = job->first + block * STL_STREAM_BLOCK_ITEMS;
+  job->func(&job->blocks[block], job->arg, first,
+	    STL_MIN(first + STL_STREAM_BLOCK_ITEMS, job->count));
+}
+
+/* Writes value like "%d" */
+void
+stl_stream_put_int(stl_stream *s, int value)
+{
+  char *p;
+
+  stl_stream_reserve(s, STL_STREAM_MAX_NUMBER);
+  p = s->buf + s->used;
+  if(value < 0)
+    {
+      *p++ = '-';
+      p = stl_format_unsigned(p, 0u - (unsigned)value);
+    }
+  else
+    {
+      p = stl_format_unsigned(p, (unsigned)value);
+    }
+  s->used = p - s->buf;
+}
+
+/* Writes value like "%f" */
+void
+stl_stream_put_float_f(stl_stream *s, float value)
+{
+  int length;
+
+  stl_stream_reserve(s, STL_STREAM_MAX_NUMBER);
+  length = stl_format_float_f(s->buf + s->used, value);
+  if(length == 0)
+    {
+      length = sprintf(s->buf + s->used, "%f", value);
+    }
+  s->used += length;
+}
+
+/* Writes value like "% .8E" */
+void
+stl_stream_put_float_e(stl_stream *s, float value)
+{
+  int length;
+
+  stl_stream_reserve(s, STL_STREAM_MAX_NUMBER);
+  length = stl_format_float_e(s->buf + s->used, value);
+  if(length == 0)
+    {
+      length = sprintf(s->buf + s->used, "% .8E", value);
+    }
+  s->used += length;
+}
+
+/* Writes the count lowest decimal digits of value, with leading zeros */
+static char *
+stl_format_digits(char *p, unsigned value, int count)
+{
+  int i;
+
+  for(i = count - 1; i >= 0; i--)
+    {
+      p[i] = '0' + value % 10;
+      value /= 10;
+    }
+  return p + count;
+}
+
+/* Writes value in decimal without leading zeros */
+static char *
+stl_format_unsigned(char *p, unsigned value)
+{
+  char digits[10];
+  int  count;
+
+  count = 0;
+  do
+    {
+      digits[count++] = '0' + value % 10;
+      value /= 10;
+    }
+  while(value != 0);
+  while(count > 0)
+    {
+      *p++ = digits[--count];
+    }
+  return p;
+}
+
+/* Formats value like "%f" and returns the length, or 0 if it should be
+   left to sprintf().  A float times 10^6 needs at most 24 + 20 bits, so
+   below 10^9 the product is exact in a double and is rounded to even
+   just like printf() does. */
+static int
+stl_format_float_f(char *p, float value)
+{
+  char     *start;
+  double   scaled;
+  uint64_t rounded;
+  double   fraction;
+
+  if(!(fabs(value) < 1e9))
+    {
+      /* Too big, infinite or not a number */
+      return 0;
+    }
+  start = p;
+  scaled = fabs((double)value) * 1e6;
+  rounded = (uint64_t)scaled;
+  fraction = scaled - (double)rounded;
+  if(fraction > 0.5 || (fraction == 0.5 && (rounded & 1)))
+    {
+      rounded++;
+    }
+
+  if(signbit(value))
+    {
+      *p++ = '-';
+    }
+  p = stl_format_unsigned(p, (unsigned)(rounded / 1000000));
+  *p++ = '.';
+  p = stl_format_digits(p, (unsigned)(rounded % 1000000), 6);
+  return p - start;
+}
+
+/* Formats value like "% .8E" and returns the length, or 0 if it should be
+   left to sprintf().  The value is scaled to nine digits before the point
+   with one exact power of ten, so the double result is off by less than
+   10^-7.  That only matters when the digits after the point are too close
+   to one half to tell which way printf() would round. */
+static int
+stl_format_float_e(char *p, float value)
+{
+  char     *start;
+  double   magnitude;
+  double   scaled;
+  double   fraction;
+  unsigned rounded;
+  int      exponent;
+  int      binary_exponent;
+
+  magnitude = fabs((double)value);
+  if(magnitude == 0)
+    {
+      memcpy(p, signbit(value) ? "-0.00000000E+00" : " 0.00000000E+00", 15);
+      return 15;
+    }
+  if(!(magnitude < HUGE_VAL))
+    {
+      /* Infinite or not a number */
+      return 0;
+    }
+
+  /* magnitude is in [2^(binary_exponent-1), 2^binary_exponent), so the
+     decimal exponent is this estimate or one more */
+  frexp(magnitude, &binary_exponent);
+  exponent = (int)floor((binary_exponent - 1) * 0.30102999566398120);
+  if(exponent < -14 || exponent > 29)
+    {
+      return 0;
+    }
+  if(exponent <= 8)
+    {
+      scaled = magnitude * stl_powers_of_ten[8 - exponent];
+    }
+  else
+    {
+      scaled = magnitude / stl_powers_of_ten[exponent - 8];
+    }
+  if(scaled >= 1e9)
+    {
+      exponent++;
+      if(exponent <= 8)
+	{
+	  scaled = magnitude * stl_powers_of_ten[8 - exponent];
+	}
+      else
+	{
+	  scaled = magnitude / stl_powers_of_ten[exponent - 8];
+	}
+    }
+
+  rounded = (unsigned)scaled;
+  fraction = scaled - rounded;
+  if(fabs(fraction - 0.5) < 1e-6)
+    {
+      return 0;
+    }
+  if(fraction > 0.5)
+    {
+      rounded++;
+      if(rounded == 1000000000)
+	{
+	  rounded = 100000000;
+	  exponent++;
+	}
+    }
+
+  start = p;
+  *p++ = signbit(value) ? '-' : ' ';
+  *p++ = '0' + rounded / 100000000;
+  *p++ = '.';
+  p = stl_format_digits(p, rounded % 100000000, 8);
+  *p++ = 'E';
+  *p++ = exponent < 0 ? '-' : '+';
+  p = stl_format_digits(p, exponent < 0 ? -exponent : exponent, 2);
+  return p - start;
+}
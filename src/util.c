@@ -23,13 +23,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <float.h>
 #include <math.h>
 
 #include "stl.h"
 
-static void stl_rotate(float *x, float *y, float angle);
-static float get_area(stl_facet *facet);
-static float get_volume(stl_file *stl);
+/* Facets that one task of stl_calculate_volume() sums up.  The sums are
+   added up in the same groups however many threads there are. */
+#define STL_MASS_BLOCK_FACETS 16384
+
+/* State shared by the threads of stl_calculate_volume() and
+   stl_calculate_stats_blocks() */
+typedef struct
+{
+  const stl_facet *facets;
+  int        num_facets;
+  stl_vertex origin;
+  stl_mass   *blocks;		/* the sums of each block */
+}stl_mass_job;
+
+static void stl_mass_add(stl_mass *mass, int i, double value);
+static void stl_mass_block(void *arg, int block);
+static void stl_mass_inside_out(stl_stats *stats);
+static void stl_scale_extent(float *min, float *max, float *size,
+			     float factor);
+static int stl_trafo_is_uniform(const float *trafo3x4);
 
 
 void
@@ -42,6 +60,7 @@ stl_verify_neighbors(stl_file *stl)
   int neighbor;
   int vnot;
 
+  stl_flush_transform(stl);
   stl->stats.backwards_edges = 0;
 
   for(i = 0; i < stl->stats.number_of_facets; i++)
@@ -81,89 +100,72 @@ stl_verify_neighbors(stl_file *stl)
 void
 stl_translate(stl_file *stl, float x, float y, float z)
 {
-  int i;
-  int j;
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+  /* The minimum is needed, so rotations can't wait any longer, and a file
+     read a block at a time may not have been measured yet */
+  if(stl->size_pending || stl->reader != NULL)
     {
-      for(j = 0; j < 3; j++)
-	{
-	  stl->facet_start[i].vertex[j].x -= (stl->stats.min.x - x);
-	  stl->facet_start[i].vertex[j].y -= (stl->stats.min.y - y);
-	  stl->facet_start[i].vertex[j].z -= (stl->stats.min.z - z);
-	}
+      stl_flush_transform(stl);
     }
-  stl->stats.max.x -= (stl->stats.min.x - x);
-  stl->stats.max.y -= (stl->stats.min.y - y);
-  stl->stats.max.z -= (stl->stats.min.z - z);
+  stl_translate_relative(stl, x - stl->stats.min.x, y - stl->stats.min.y,
+			 z - stl->stats.min.z);
   stl->stats.min.x = x;
   stl->stats.min.y = y;
   stl->stats.min.z = z;
-  
-  stl_invalidate_shared_vertices(stl);
 }
 
 /* Translates the stl by x,y,z, relatively from wherever it is currently */
 void
 stl_translate_relative(stl_file *stl, float x, float y, float z)
 {
-  int i;
-  int j;
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
-    {
-      for(j = 0; j < 3; j++)
-	{
-	  stl->facet_start[i].vertex[j].x += x;
-	  stl->facet_start[i].vertex[j].y += y;
-	  stl->facet_start[i].vertex[j].z += z;
-	}
-    }
+  stl->trafo[3] += x;
+  stl->trafo[7] += y;
+  stl->trafo[11] += z;
+  stl->trafo_pending = 1;
+
   stl->stats.min.x += x;
   stl->stats.min.y += y;
   stl->stats.min.z += z;
   stl->stats.max.x += x;
   stl->stats.max.y += y;
   stl->stats.max.z += z;
-  
-  stl_invalidate_shared_vertices(stl);
+}
+
+/* Scales the extent from min to max along one axis by factor */
+static void
+stl_scale_extent(float *min, float *max, float *size, float factor)
+{
+  float a;
+  float b;
+
+  a = *min * factor;
+  b = *max * factor;
+  *min = STL_MIN(a, b);
+  *max = STL_MAX(a, b);
+  *size = *max - *min;
 }
 
 void
 stl_scale_versor(stl_file *stl, float versor[3])
 {
-  int i;
-  int j;
-  
-  /* scale extents */
-  stl->stats.min.x *= versor[0];
-  stl->stats.min.y *= versor[1];
-  stl->stats.min.z *= versor[2];
-  stl->stats.max.x *= versor[0];
-  stl->stats.max.y *= versor[1];
-  stl->stats.max.z *= versor[2];
-  
-  /* scale size */
-  stl->stats.size.x *= versor[0];
-  stl->stats.size.y *= versor[1];
-  stl->stats.size.z *= versor[2];
+  stl_trafo_scale(stl->trafo, versor);
+  stl->trafo_pending = 1;
+
+  /* scale extents and size */
+  stl_scale_extent(&stl->stats.min.x, &stl->stats.max.x, &stl->stats.size.x,
+		   versor[0]);
+  stl_scale_extent(&stl->stats.min.y, &stl->stats.max.y, &stl->stats.size.y,
+		   versor[1]);
+  stl_scale_extent(&stl->stats.min.z, &stl->stats.max.z, &stl->stats.size.z,
+		   versor[2]);
+  stl->stats.bounding_diameter = sqrt(
+    stl->stats.size.x * stl->stats.size.x +
+    stl->stats.size.y * stl->stats.size.y +
+    stl->stats.size.z * stl->stats.size.z);
   
   /* scale volume */
   if (stl->stats.volume > 0.0) {
-    stl->stats.volume *= (versor[0] * versor[1] * versor[2]);
+    stl->stats.volume *= fabs(versor[0] * versor[1] * versor[2]);
   }
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
-    {
-      for(j = 0; j < 3; j++)
-	{
-	  stl->facet_start[i].vertex[j].x *= versor[0];
-	  stl->facet_start[i].vertex[j].y *= versor[1];
-	  stl->facet_start[i].vertex[j].z *= versor[2];
-	}
-    }
-   
-    stl_invalidate_shared_vertices(stl);
 }
 
 void
@@ -176,89 +178,292 @@ stl_scale(stl_file *stl, float factor)
     stl_scale_versor(stl, versor);
 }
 
-static void calculate_normals(stl_file *stl)
+/* Sets trafo3x4 to the identity.  A trafo3x4 holds the rows of an affine
+   transformation, x' = trafo3x4[0] * x + trafo3x4[1] * y
+   + trafo3x4[2] * z + trafo3x4[3] and so on for y' and z'. */
+void
+stl_trafo_identity(float *trafo3x4)
 {
-	long i;
-	float normal[3];
-	
-	for(i = 0; i < stl->stats.number_of_facets; i++){
-		stl_calculate_normal(normal, &stl->facet_start[i]);
-		stl_normalize_vector(normal);
-		stl->facet_start[i].normal.x = normal[0];
-		stl->facet_start[i].normal.y = normal[1];
-		stl->facet_start[i].normal.z = normal[2];
-	}
+  int i;
+
+  for(i = 0; i < 12; i++)
+    {
+      trafo3x4[i] = (i % 5 == 0) ? 1.0 : 0.0;
+    }
 }
 
+/* Makes trafo3x4 rotate CCW about axis (0 to 2 for x to z) by angle
+   degrees after what it did so far */
 void
-stl_rotate_x(stl_file *stl, float angle)
+stl_trafo_rotate(float *trafo3x4, int axis, float angle)
+{
+  double radian_angle;
+  double c;
+  double s;
+  float  row_a;
+  float  row_b;
+  int    a;
+  int    b;
+  int    j;
+
+  radian_angle = (angle / 180.0) * M_PI;
+  c = cos(radian_angle);
+  s = sin(radian_angle);
+  /* The rotation turns the a axis towards the b axis */
+  a = (axis + 1) % 3;
+  b = (axis + 2) % 3;
+  for(j = 0; j < 4; j++)
+    {
+      row_a = trafo3x4[4 * a + j];
+      row_b = trafo3x4[4 * b + j];
+      trafo3x4[4 * a + j] = c * row_a - s * row_b;
+      trafo3x4[4 * b + j] = s * row_a + c * row_b;
+    }
+}
+
+/* Makes trafo3x4 scale by versor after what it did so far.  A factor of
+   -1 mirrors about the plane of the other two axes. */
+void
+stl_trafo_scale(float *trafo3x4, float versor[3])
 {
   int i;
   int j;
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+
+  for(i = 0; i < 3; i++)
     {
-      for(j = 0; j < 3; j++)
+      for(j = 0; j < 4; j++)
 	{
-	  stl_rotate(&stl->facet_start[i].vertex[j].y,
-		     &stl->facet_start[i].vertex[j].z, angle);
+	  trafo3x4[4 * i + j] *= versor[i];
 	}
     }
-  stl_get_size(stl);
-	calculate_normals(stl);
 }
 
+/* Transforms the stl by trafo3x4 after the transformations so far.  Like
+   the other transformations it is only put together with them here, and
+   stl_flush_transform() applies them all to the facets at once. */
 void
-stl_rotate_y(stl_file *stl, float angle)
+stl_transform(stl_file *stl, float *trafo3x4)
 {
-  int i;
-  int j;
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+  float  product[12];
+  double det;
+  int    i;
+  int    j;
+
+  for(i = 0; i < 3; i++)
     {
-      for(j = 0; j < 3; j++)
+      for(j = 0; j < 4; j++)
 	{
-	  stl_rotate(&stl->facet_start[i].vertex[j].z,
-		     &stl->facet_start[i].vertex[j].x, angle);
+	  product[4 * i + j] = trafo3x4[4 * i] * stl->trafo[j]
+	    + trafo3x4[4 * i + 1] * stl->trafo[4 + j]
+	    + trafo3x4[4 * i + 2] * stl->trafo[8 + j]
+	    + (j == 3 ? trafo3x4[4 * i + 3] : 0.0);
 	}
     }
-  stl_get_size(stl);
-	calculate_normals(stl);
+  memcpy(stl->trafo, product, sizeof(product));
+  stl->trafo_pending = 1;
+  stl->size_pending = 1;
+
+  /* scale volume */
+  det = trafo3x4[0] * (trafo3x4[5] * trafo3x4[10] - trafo3x4[6] * trafo3x4[9])
+    - trafo3x4[1] * (trafo3x4[4] * trafo3x4[10] - trafo3x4[6] * trafo3x4[8])
+    + trafo3x4[2] * (trafo3x4[4] * trafo3x4[9] - trafo3x4[5] * trafo3x4[8]);
+  if(stl->stats.volume > 0.0)
+    {
+      stl->stats.volume *= fabs(det);
+    }
 }
 
+/* Whether the linear part of trafo3x4 only scales by the same positive
+   factor along all axes, which doesn't turn the normals */
+static int
+stl_trafo_is_uniform(const float *trafo3x4)
+{
+  return (trafo3x4[0] > 0 && trafo3x4[5] == trafo3x4[0]
+	  && trafo3x4[10] == trafo3x4[0]
+	  && trafo3x4[1] == 0 && trafo3x4[2] == 0 && trafo3x4[4] == 0
+	  && trafo3x4[6] == 0 && trafo3x4[8] == 0 && trafo3x4[9] == 0);
+}
+
+/* Applies trafo3x4 to count facets.  The normals are turned by the
+   inverse transpose of the linear part and normalized.  Unless min is
+   NULL, the box from min to max is grown to hold the new vertices. */
 void
-stl_rotate_z(stl_file *stl, float angle)
+stl_transform_facets(const float *trafo3x4, stl_facet *facets, int count,
+		     stl_vertex *min, stl_vertex *max)
 {
-  int i;
-  int j;
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+  stl_facet *facet;
+  int       turn_normals;
+  double    m[12];
+  double    n[9];
+  double    det;
+  double    x;
+  double    y;
+  double    z;
+  float     normal[3];
+  int       i;
+  int       j;
+
+  for(i = 0; i < 12; i++)
+    {
+      m[i] = trafo3x4[i];
+    }
+  turn_normals = !stl_trafo_is_uniform(trafo3x4);
+  /* The cofactors of the linear part are its inverse transpose times its
+     determinant */
+  n[0] = m[5] * m[10] - m[6] * m[9];
+  n[1] = m[6] * m[8] - m[4] * m[10];
+  n[2] = m[4] * m[9] - m[5] * m[8];
+  n[3] = m[2] * m[9] - m[1] * m[10];
+  n[4] = m[0] * m[10] - m[2] * m[8];
+  n[5] = m[1] * m[8] - m[0] * m[9];
+  n[6] = m[1] * m[6] - m[2] * m[5];
+  n[7] = m[2] * m[4] - m[0] * m[6];
+  n[8] = m[0] * m[5] - m[1] * m[4];
+  det = m[0] * n[0] + m[1] * n[1] + m[2] * n[2];
+  if(det < 0)
     {
+      for(i = 0; i < 9; i++)
+	{
+	  n[i] = -n[i];
+	}
+    }
+
+  for(i = 0; i < count; i++)
+    {
+      facet = &facets[i];
+      if(turn_normals)
+	{
+	  x = facet->normal.x;
+	  y = facet->normal.y;
+	  z = facet->normal.z;
+	  normal[0] = n[0] * x + n[1] * y + n[2] * z;
+	  normal[1] = n[3] * x + n[4] * y + n[5] * z;
+	  normal[2] = n[6] * x + n[7] * y + n[8] * z;
+	  stl_normalize_vector(normal);
+	  facet->normal.x = normal[0];
+	  facet->normal.y = normal[1];
+	  facet->normal.z = normal[2];
+	}
+
       for(j = 0; j < 3; j++)
 	{
-	  stl_rotate(&stl->facet_start[i].vertex[j].x,
-		     &stl->facet_start[i].vertex[j].y, angle);
+	  x = facet->vertex[j].x;
+	  y = facet->vertex[j].y;
+	  z = facet->vertex[j].z;
+	  facet->vertex[j].x = m[0] * x + m[1] * y + m[2] * z + m[3];
+	  facet->vertex[j].y = m[4] * x + m[5] * y + m[6] * z + m[7];
+	  facet->vertex[j].z = m[8] * x + m[9] * y + m[10] * z + m[11];
+	  if(min == NULL)
+	    {
+	      continue;
+	    }
+	  min->x = STL_MIN(min->x, facet->vertex[j].x);
+	  min->y = STL_MIN(min->y, facet->vertex[j].y);
+	  min->z = STL_MIN(min->z, facet->vertex[j].z);
+	  max->x = STL_MAX(max->x, facet->vertex[j].x);
+	  max->y = STL_MAX(max->y, facet->vertex[j].y);
+	  max->z = STL_MAX(max->z, facet->vertex[j].z);
 	}
     }
-  stl_get_size(stl);
-	calculate_normals(stl);
 }
 
-		
+/* Applies the transformations waiting in stl->trafo to all of the facets
+   in one pass.  Everything that reads the facets calls this first.  The
+   size is found on the way if it isn't known.  The shared vertices are
+   moved along rather than thrown away, unless they were welded, as
+   moving may make distinct vertices equal.  Facets that are read a block
+   at a time are transformed as they are read, by stl_flush_blocks(). */
+void
+stl_flush_transform(stl_file *stl)
+{
+  stl_vertex min;
+  stl_vertex max;
+  double     x;
+  double     y;
+  double     z;
+  double     m[12];
+  int        i;
 
-static void
-stl_rotate(float *x, float *y, float angle)
+  if(stl->reader != NULL)
+    {
+      stl_flush_blocks(stl);
+      return;
+    }
+  if(!stl->trafo_pending)
+    {
+      return;
+    }
+
+  for(i = 0; i < 12; i++)
+    {
+      m[i] = stl->trafo[i];
+    }
+  if(stl->size_pending && stl->stats.number_of_facets > 0)
+    {
+      min.x = min.y = min.z = FLT_MAX;
+      max.x = max.y = max.z = -FLT_MAX;
+      stl_transform_facets(stl->trafo, stl->facet_start,
+			   stl->stats.number_of_facets, &min, &max);
+      stl->stats.min = min;
+      stl->stats.max = max;
+      stl->stats.size.x = stl->stats.max.x - stl->stats.min.x;
+      stl->stats.size.y = stl->stats.max.y - stl->stats.min.y;
+      stl->stats.size.z = stl->stats.max.z - stl->stats.min.z;
+      stl->stats.bounding_diameter = sqrt(
+	stl->stats.size.x * stl->stats.size.x +
+	stl->stats.size.y * stl->stats.size.y +
+	stl->stats.size.z * stl->stats.size.z);
+    }
+  else
+    {
+      stl_transform_facets(stl->trafo, stl->facet_start,
+			   stl->stats.number_of_facets, NULL, NULL);
+    }
+
+  if(stl->v_shared != NULL && !stl->v_welded)
+    {
+      for(i = 0; i < stl->stats.shared_vertices; i++)
+	{
+	  x = stl->v_shared[i].x;
+	  y = stl->v_shared[i].y;
+	  z = stl->v_shared[i].z;
+	  stl->v_shared[i].x = m[0] * x + m[1] * y + m[2] * z + m[3];
+	  stl->v_shared[i].y = m[4] * x + m[5] * y + m[6] * z + m[7];
+	  stl->v_shared[i].z = m[8] * x + m[9] * y + m[10] * z + m[11];
+	}
+    }
+  else
+    {
+      stl_invalidate_shared_vertices(stl);
+    }
+
+  stl_trafo_identity(stl->trafo);
+  stl->trafo_pending = 0;
+  stl->size_pending = 0;
+}
+
+void
+stl_rotate_x(stl_file *stl, float angle)
 {
-  double r;
-  double theta;
-  double radian_angle;
-  
-  radian_angle = (angle / 180.0) * M_PI;
-  
-  r = sqrt((*x * *x) + (*y * *y));
-  theta = atan2(*y, *x);
-  *x = r * cos(theta + radian_angle);
-  *y = r * sin(theta + radian_angle);
+  stl_trafo_rotate(stl->trafo, 0, angle);
+  stl->trafo_pending = 1;
+  stl->size_pending = 1;
+}
+
+void
+stl_rotate_y(stl_file *stl, float angle)
+{
+  stl_trafo_rotate(stl->trafo, 1, angle);
+  stl->trafo_pending = 1;
+  stl->size_pending = 1;
+}
+
+void
+stl_rotate_z(stl_file *stl, float angle)
+{
+  stl_trafo_rotate(stl->trafo, 2, angle);
+  stl->trafo_pending = 1;
+  stl->size_pending = 1;
 }
 
 extern void
@@ -267,6 +472,7 @@ stl_get_size(stl_file *stl)
   int i;
   int j;
 
+  stl_flush_transform(stl);
   stl->stats.min.x = stl->facet_start[0].vertex[0].x;
   stl->stats.min.y = stl->facet_start[0].vertex[0].y;
   stl->stats.min.z = stl->facet_start[0].vertex[0].z;
@@ -305,131 +511,394 @@ stl_get_size(stl_file *stl)
 void
 stl_mirror_xy(stl_file *stl)
 {
-  int i;
-  int j;
-  float temp_size;
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
-    {
-      for(j = 0; j < 3; j++)
-	{
-	  stl->facet_start[i].vertex[j].z *= -1.0;
-    	}
-    }
-  temp_size = stl->stats.min.z;
-  stl->stats.min.z = stl->stats.max.z;
-  stl->stats.max.z = temp_size;
-  stl->stats.min.z *= -1.0;
-  stl->stats.max.z *= -1.0;
+  float versor[3];
+
+  versor[0] = 1.0;
+  versor[1] = 1.0;
+  versor[2] = -1.0;
+  stl_scale_versor(stl, versor);
 }
 
 void
 stl_mirror_yz(stl_file *stl)
+{
+  float versor[3];
+
+  versor[0] = -1.0;
+  versor[1] = 1.0;
+  versor[2] = 1.0;
+  stl_scale_versor(stl, versor);
+}
+
+void
+stl_mirror_xz(stl_file *stl)
+{
+  float versor[3];
+
+  versor[0] = 1.0;
+  versor[1] = -1.0;
+  versor[2] = 1.0;
+  stl_scale_versor(stl, versor);
+}
+
+/* Adds value to sum i of mass, keeping the rounding error of the sum in
+   its compensation (Neumaier's variant of Kahan summation) */
+static void
+stl_mass_add(stl_mass *mass, int i, double value)
+{
+  double sum;
+
+  sum = mass->sum[i] + value;
+  if(fabs(mass->sum[i]) >= fabs(value))
+    {
+      mass->compensation[i] += (mass->sum[i] - sum) + value;
+    }
+  else
+    {
+      mass->compensation[i] += (value - sum) + mass->sum[i];
+    }
+  mass->sum[i] = sum;
+}
+
+void
+stl_mass_clear(stl_mass *mass)
 {
   int i;
-  int j;
-  float temp_size;
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+
+  for(i = 0; i < STL_MASS_SUMS; i++)
     {
-      for(j = 0; j < 3; j++)
+      mass->sum[i] = 0.0;
+      mass->compensation[i] = 0.0;
+    }
+}
+
+/* Adds the tetrahedron from origin to facet and the area of facet to mass.
+   The sums are kept without their constant factors: six times the
+   volume, twice the area, 24 times the first moments and 120 times the
+   second moments, all relative to origin. */
+void
+stl_mass_add_facet(stl_mass *mass, const stl_vertex *origin,
+		   const stl_facet *facet)
+{
+  double v[3][3];
+  double s[3];
+  double cross[3];
+  double det;
+  int    i;
+  int    j;
+  int    k;
+
+  for(i = 0; i < 3; i++)
+    {
+      v[i][0] = (double)facet->vertex[i].x - origin->x;
+      v[i][1] = (double)facet->vertex[i].y - origin->y;
+      v[i][2] = (double)facet->vertex[i].z - origin->z;
+    }
+
+  /* The cross product of two edges is twice the area */
+  cross[0] = (v[1][1] - v[0][1]) * (v[2][2] - v[0][2])
+    - (v[1][2] - v[0][2]) * (v[2][1] - v[0][1]);
+  cross[1] = (v[1][2] - v[0][2]) * (v[2][0] - v[0][0])
+    - (v[1][0] - v[0][0]) * (v[2][2] - v[0][2]);
+  cross[2] = (v[1][0] - v[0][0]) * (v[2][1] - v[0][1])
+    - (v[1][1] - v[0][1]) * (v[2][0] - v[0][0]);
+  stl_mass_add(mass, STL_MASS_AREA,
+	       sqrt(cross[0] * cross[0] + cross[1] * cross[1]
+		    + cross[2] * cross[2]));
+
+  det = v[0][0] * (v[1][1] * v[2][2] - v[1][2] * v[2][1])
+    + v[0][1] * (v[1][2] * v[2][0] - v[1][0] * v[2][2])
+    + v[0][2] * (v[1][0] * v[2][1] - v[1][1] * v[2][0]);
+  stl_mass_add(mass, STL_MASS_VOLUME, det);
+
+  for(i = 0; i < 3; i++)
+    {
+      s[i] = v[0][i] + v[1][i] + v[2][i];
+      stl_mass_add(mass, STL_MASS_FIRST + i, det * s[i]);
+    }
+  k = STL_MASS_SECOND;
+  for(i = 0; i < 3; i++)
+    {
+      for(j = i; j < 3; j++)
 	{
-	  stl->facet_start[i].vertex[j].x *= -1.0;
-    	}
-    }
-  temp_size = stl->stats.min.x;
-  stl->stats.min.x = stl->stats.max.x;
-  stl->stats.max.x = temp_size;
-  stl->stats.min.x *= -1.0;
-  stl->stats.max.x *= -1.0;
+	  stl_mass_add(mass, k++, det * (s[i] * s[j] + v[0][i] * v[0][j]
+					 + v[1][i] * v[1][j]
+					 + v[2][i] * v[2][j]));
+	}
+    }
 }
 
+/* Adds the sums of from to mass */
 void
-stl_mirror_xz(stl_file *stl)
+stl_mass_merge(stl_mass *mass, const stl_mass *from)
 {
   int i;
-  int j;
-  float temp_size;
-  
-  for(i = 0; i < stl->stats.number_of_facets; i++)
+
+  for(i = 0; i < STL_MASS_SUMS; i++)
+    {
+      stl_mass_add(mass, i, from->sum[i]);
+      stl_mass_add(mass, i, from->compensation[i]);
+    }
+}
+
+/* Puts the volume, area, center of mass and inertia tensor that mass was
+   summed up to around origin into stats.  The inertia is taken about
+   the center of mass, for a density of 1. */
+void
+stl_mass_to_stats(const stl_mass *mass, const stl_vertex *origin,
+		  stl_stats *stats)
+{
+  double volume;
+  double first[3];
+  double second[3][3];
+  double trace;
+  int    i;
+  int    j;
+  int    k;
+
+  volume = (mass->sum[STL_MASS_VOLUME] + mass->compensation[STL_MASS_VOLUME])
+    / 6.0;
+  stats->volume = volume;
+  stats->surface_area = (mass->sum[STL_MASS_AREA]
+			 + mass->compensation[STL_MASS_AREA]) / 2.0;
+
+  for(i = 0; i < 3; i++)
+    {
+      first[i] = (mass->sum[STL_MASS_FIRST + i]
+		  + mass->compensation[STL_MASS_FIRST + i]) / 24.0;
+    }
+  k = STL_MASS_SECOND;
+  for(i = 0; i < 3; i++)
+    {
+      for(j = i; j < 3; j++)
+	{
+	  second[i][j] = (mass->sum[k] + mass->compensation[k]) / 120.0;
+	  /* Move the second moments to the center of mass */
+	  if(volume != 0.0)
+	    {
+	      second[i][j] -= first[i] * first[j] / volume;
+	    }
+	  second[j][i] = second[i][j];
+	  k++;
+	}
+    }
+
+  if(volume != 0.0)
+    {
+      stats->center_of_mass.x = origin->x + first[0] / volume;
+      stats->center_of_mass.y = origin->y + first[1] / volume;
+      stats->center_of_mass.z = origin->z + first[2] / volume;
+    }
+  else
+    {
+      stats->center_of_mass = *origin;
+    }
+  trace = second[0][0] + second[1][1] + second[2][2];
+  for(i = 0; i < 3; i++)
     {
       for(j = 0; j < 3; j++)
 	{
-	  stl->facet_start[i].vertex[j].y *= -1.0;
-    	}
-    }
-  temp_size = stl->stats.min.y;
-  stl->stats.min.y = stl->stats.max.y;
-  stl->stats.max.y = temp_size;
-  stl->stats.min.y *= -1.0;
-  stl->stats.max.y *= -1.0;
+	  stats->inertia[i][j] = (i == j ? trace : 0.0) - second[i][j];
+	}
+    }
 }
 
-static float get_volume(stl_file *stl)
+/* Sums up one block of facets for stl_calculate_volume() */
+static void
+stl_mass_block(void *arg, int block)
 {
-	long i;
-	stl_vertex p0;
-	stl_vertex p;
-	stl_normal n;
-	float height;
-	float area;
-	float volume = 0.0;
-	
-	/* Choose a point, any point as the reference */
-	p0.x = stl->facet_start[0].vertex[0].x;
-	p0.y = stl->facet_start[0].vertex[0].y;
-	p0.z = stl->facet_start[0].vertex[0].z;
-
-	for(i = 0; i < stl->stats.number_of_facets; i++){
-		p.x = stl->facet_start[i].vertex[0].x - p0.x;
-		p.y = stl->facet_start[i].vertex[0].y - p0.y;
-		p.z = stl->facet_start[i].vertex[0].z - p0.z;
-		/* Do dot product to get distance from point to plane */
-		n = stl->facet_start[i].normal;
-		height = (n.x * p.x) + (n.y * p.y) + (n.z * p.z);
-		area = get_area(&stl->facet_start[i]);
-		volume += (area * height) / 3.0;
-	}
-	return volume;
+  stl_mass_job *job = (stl_mass_job*)arg;
+  int          first;
+  int          last;
+  int          i;
+
+  first = block * STL_MASS_BLOCK_FACETS;
+  last = STL_MIN(first + STL_MASS_BLOCK_FACETS, job->num_facets);
+  stl_mass_clear(&job->blocks[block]);
+  for(i = first; i < last; i++)
+    {
+      stl_mass_add_facet(&job->blocks[block], &job->origin,
+			 &job->facets[i]);
+    }
 }
 
-void stl_calculate_volume(stl_file *stl)
+/* Turns what stl_mass_to_stats() found for facets that are inside out
+   into what it would find for the reversed facets */
+static void
+stl_mass_inside_out(stl_stats *stats)
 {
-	stl->stats.volume = get_volume(stl);
-	if(stl->stats.volume < 0.0){
-		stl_reverse_all_facets(stl);
-		stl->stats.volume = -stl->stats.volume;
+  int i;
+  int j;
+
+  stats->volume = -stats->volume;
+  for(i = 0; i < 3; i++)
+    {
+      for(j = 0; j < 3; j++)
+	{
+	  stats->inertia[i][j] = -stats->inertia[i][j];
 	}
+    }
 }
 
-static float get_area(stl_facet *facet)
+/* Finds the volume, surface area, center of mass and inertia tensor in
+   one pass over the facets.  The facets are summed up in blocks of a
+   fixed size on as many threads as there are, and the blocks are added
+   up in order, so the result doesn't depend on the number of threads.
+   If the volume comes out negative, the facets are inside out and are
+   all reversed. */
+void
+stl_calculate_volume(stl_file *stl)
 {
-	double cross[3][3];
-	float sum[3];
-	float n[3];
-	float area;
-	int i;
-	
-	/* cast to double before calculating cross product because large coordinates
-	   can result in overflowing product
-	  (bad area is responsible for bad volume and bad facets reversal) */
-	for(i = 0; i < 3; i++){
-	    cross[i][0]=(((double)facet->vertex[i].y * (double)facet->vertex[(i + 1) % 3].z) -
-			 ((double)facet->vertex[i].z * (double)facet->vertex[(i + 1) % 3].y));
-	    cross[i][1]=(((double)facet->vertex[i].z * (double)facet->vertex[(i + 1) % 3].x) -
-			 ((double)facet->vertex[i].x * (double)facet->vertex[(i + 1) % 3].z));
-	    cross[i][2]=(((double)facet->vertex[i].x * (double)facet->vertex[(i + 1) % 3].y) -
-			 ((double)facet->vertex[i].y * (double)facet->vertex[(i + 1) % 3].x));
+  stl_mass_job job;
+  stl_mass     mass;
+  int          num_blocks;
+  int          i;
+
+  stl_flush_transform(stl);
+
+  /* Choose a point, any point as the reference.  Near the mesh the
+     sums lose less to rounding. */
+  job.facets = stl->facet_start;
+  job.num_facets = stl->stats.number_of_facets;
+  job.origin.x = job.origin.y = job.origin.z = 0.0;
+  if(stl->stats.number_of_facets > 0)
+    {
+      job.origin = stl->facet_start[0].vertex[0];
+    }
+  num_blocks = (stl->stats.number_of_facets + STL_MASS_BLOCK_FACETS - 1)
+    / STL_MASS_BLOCK_FACETS;
+  job.blocks = (stl_mass*)malloc(STL_MAX(num_blocks, 1) * sizeof(stl_mass));
+  if(job.blocks == NULL)
+    {
+      perror("stl_calculate_volume");
+      exit(1);
+    }
+  stl_parallel_run(num_blocks, stl_mass_block, &job);
+  stl_mass_clear(&mass);
+  for(i = 0; i < num_blocks; i++)
+    {
+      stl_mass_merge(&mass, &job.blocks[i]);
+    }
+  free(job.blocks);
+
+  stl_mass_to_stats(&mass, &job.origin, &stl->stats);
+  if(stl->stats.volume < 0.0)
+    {
+      stl_reverse_all_facets(stl);
+      stl_mass_inside_out(&stl->stats);
+    }
+}
+
+/* Finds in one pass over a file opened by stl_open_blocks() what
+   stl_stats_out() prints that doesn't need the neighbors: the size, the
+   shortest edge, the number of facets and of degenerate facets, the
+   volume and the area.  Degenerate facets are counted and left out, as
+   the exact check would remove them.  The other facets are summed up in
+   the same blocks as by stl_calculate_volume(), so a file without
+   degenerate facets gets the same volume either way. */
+void
+stl_calculate_stats_blocks(stl_file *stl)
+{
+  stl_mass_job job;
+  stl_mass     mass;
+  stl_facet    *facets;
+  stl_facet    *facet;
+  float        diff_x;
+  float        diff_y;
+  float        diff_z;
+  float        max_diff;
+  int          size;
+  int          pending;
+  int          count;
+  int          end;
+  int          kept;
+  int          num_blocks;
+  int          i;
+  int          j;
+
+  /* A few blocks are read at a time for the threads, after the facets
+     left over from the last read that didn't fill a block */
+  size = STL_MASS_BLOCK_FACETS * (stl_get_threads() + 1);
+  facets = (stl_facet*)malloc(size * sizeof(stl_facet));
+  job.blocks = (stl_mass*)malloc((stl_get_threads() + 1) * sizeof(stl_mass));
+  if(facets == NULL || job.blocks == NULL)
+    {
+      perror("stl_calculate_stats_blocks");
+      exit(1);
+    }
+  job.facets = facets;
+  job.origin.x = job.origin.y = job.origin.z = 0.0;
+  stl_mass_clear(&mass);
+  stl->stats.degenerate_facets = 0;
+  kept = 0;
+  pending = 0;
+
+  stl_rewind_blocks(stl);
+  do
+    {
+      count = stl_read_block(stl, facets + pending, size - pending);
+      /* The facets that are kept are moved up behind the pending ones */
+      end = pending;
+      for(i = pending; i < pending + count; i++)
+	{
+	  facet = &facets[i];
+	  if(   !memcmp(&facet->vertex[0], &facet->vertex[1], sizeof(stl_vertex))
+	     || !memcmp(&facet->vertex[1], &facet->vertex[2], sizeof(stl_vertex))
+	     || !memcmp(&facet->vertex[0], &facet->vertex[2], sizeof(stl_vertex)))
+	    {
+	      stl->stats.degenerate_facets += 1;
+	      continue;
+	    }
+	  for(j = 0; j < 3; j++)
+	    {
+	      diff_x = ABS(facet->vertex[j].x - facet->vertex[(j + 1) % 3].x);
+	      diff_y = ABS(facet->vertex[j].y - facet->vertex[(j + 1) % 3].y);
+	      diff_z = ABS(facet->vertex[j].z - facet->vertex[(j + 1) % 3].z);
+	      max_diff = STL_MAX(diff_x, diff_y);
+	      max_diff = STL_MAX(diff_z, max_diff);
+	      stl->stats.shortest_edge = STL_MIN(max_diff,
+						 stl->stats.shortest_edge);
+	    }
+	  if(kept == 0)
+	    {
+	      /* Near the mesh the sums lose less to rounding */
+	      job.origin = facet->vertex[0];
+	    }
+	  if(end != i)
+	    {
+	      facets[end] = *facet;
+	    }
+	  end++;
+	  kept++;
 	}
-	
-	sum[0] = cross[0][0] + cross[1][0] + cross[2][0];
-	sum[1] = cross[0][1] + cross[1][1] + cross[2][1];
-	sum[2] = cross[0][2] + cross[1][2] + cross[2][2];
 
-	/* This should already be done.  But just in case, let's do it again */
-	stl_calculate_normal(n, facet);
-	stl_normalize_vector(n);
+      /* Only full blocks are summed up before the end of the file */
+      if(count > 0)
+	{
+	  num_blocks = end / STL_MASS_BLOCK_FACETS;
+	}
+      else
+	{
+	  num_blocks = (end + STL_MASS_BLOCK_FACETS - 1) / STL_MASS_BLOCK_FACETS;
+	}
+      job.num_facets = STL_MIN(end, num_blocks * STL_MASS_BLOCK_FACETS);
+      stl_parallel_run(num_blocks, stl_mass_block, &job);
+      for(i = 0; i < num_blocks; i++)
+	{
+	  stl_mass_merge(&mass, &job.blocks[i]);
+	}
+      pending = end - job.num_facets;
+      memmove(facets, facets + job.num_facets, pending * sizeof(stl_facet));
+    }
+  while(count > 0);
+  free(facets);
+  free(job.blocks);
 
-	area = 0.5 * (n[0] * sum[0] + n[1] * sum[1] + n[2] * sum[2]);
-	return area;
+  stl->stats.number_of_facets = kept;
+  stl_mass_to_stats(&mass, &job.origin, &stl->stats);
+  if(stl->stats.volume < 0.0)
+    {
+      stl_mass_inside_out(&stl->stats);
+    }
+  stl->size_pending = 0;
 }